@@ -0,0 +1,216 @@
+#include "adpcm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_heap_caps.h"
+
+static const char* TAG = "ADPCM";
+
+// quantizer step sizes as defined by the IMA-ADPCM specification
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17,
+    19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+    130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796,
+    876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358,
+    5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+// step index adjustment based on the magnitude of the last nibble
+static const int8_t index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+/*
+@brief applies a nibble to the decoder state and returns the new predicted frame.
+@param nibble 4 bit code to apply.
+@param predictor current prediction, updated in place.
+@param index current step index, updated in place.
+*/
+static inline int16_t decode_nibble(uint8_t nibble, int32_t *predictor, int32_t *index) {
+    int32_t step = step_table[*index];
+
+    // vpdiff = (nibble magnitude + 0.5) * step / 4, computed without multiplications
+    int32_t diff = step >> 3;
+    if (nibble & 4) diff += step;
+    if (nibble & 2) diff += step >> 1;
+    if (nibble & 1) diff += step >> 2;
+
+    if (nibble & 8) {
+        *predictor -= diff;
+    } else {
+        *predictor += diff;
+    }
+
+    // clamp to the 16 bit range
+    if (*predictor > 32767) *predictor = 32767;
+    else if (*predictor < -32768) *predictor = -32768;
+
+    *index += index_table[nibble];
+    if (*index < 0) *index = 0;
+    else if (*index > 88) *index = 88;
+
+    return (int16_t)*predictor;
+}
+
+/*
+@brief finds the nibble that best approximates the next frame, and updates the encoder state.
+@param frame frame to encode.
+@param predictor current prediction, updated in place.
+@param index current step index, updated in place.
+*/
+static inline uint8_t encode_frame(int16_t frame, int32_t *predictor, int32_t *index) {
+    int32_t diff = frame - *predictor;
+    int32_t step = step_table[*index];
+    uint8_t nibble = 0;
+
+    if (diff < 0) {
+        nibble = 8;
+        diff = -diff;
+    }
+
+    // successive approximation of diff / step on 3 bits
+    if (diff >= step) {
+        nibble |= 4;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        nibble |= 2;
+        diff -= step;
+    }
+    step >>= 1;
+    if (diff >= step) {
+        nibble |= 1;
+    }
+
+    // keep the encoder in sync with what the decoder will reconstruct
+    decode_nibble(nibble, predictor, index);
+    return nibble;
+}
+
+uint32_t adpcm_block_count(uint32_t frames) {
+    return (frames + ADPCM_BLOCK_FRAMES - 1) / ADPCM_BLOCK_FRAMES;
+}
+
+size_t adpcm_encoded_size(uint32_t frames) {
+    return (size_t)adpcm_block_count(frames) * ADPCM_BLOCK_BYTES;
+}
+
+void adpcm_encode(const int16_t *pcm, uint32_t frames, uint8_t *out) {
+    uint32_t blocks = adpcm_block_count(frames);
+
+    // the step index is carried over between blocks, so the quantizer doesn't have to adapt again
+    int32_t index = 0;
+
+    for (uint32_t b = 0; b < blocks; b++) {
+        uint32_t first = b * ADPCM_BLOCK_FRAMES;
+        uint8_t *block = out + b * ADPCM_BLOCK_BYTES;
+
+        // the first frame is stored verbatim, it acts as the seek point of the block
+        int32_t predictor = pcm[first];
+        adpcm_block_hdr_t hdr = {
+            .first_frame = pcm[first],
+            .step_index = (uint8_t)index,
+            .reserved = 0
+        };
+        memcpy(block, &hdr, sizeof(hdr));
+
+        uint8_t *nibbles = block + ADPCM_BLOCK_HDR_SIZE;
+        memset(nibbles, 0, ADPCM_BLOCK_FRAMES / 2);
+
+        for (uint32_t i = 1; i < ADPCM_BLOCK_FRAMES; i++) {
+            // pad the last block with silence
+            int16_t frame = (first + i < frames) ? pcm[first + i] : 0;
+            uint8_t nibble = encode_frame(frame, &predictor, &index);
+
+            // low nibble first
+            uint32_t n = i - 1;
+            nibbles[n >> 1] |= (n & 1) ? (nibble << 4) : nibble;
+        }
+    }
+}
+
+void adpcm_decode_block(const uint8_t *block, int16_t *out) {
+    adpcm_block_hdr_t hdr;
+    memcpy(&hdr, block, sizeof(hdr));
+
+    int32_t predictor = hdr.first_frame;
+    int32_t index = hdr.step_index > 88 ? 88 : hdr.step_index;
+    const uint8_t *nibbles = block + ADPCM_BLOCK_HDR_SIZE;
+
+    out[0] = hdr.first_frame;
+
+    // two frames per byte, the last nibble of the block is padding
+    int16_t *dst = out + 1;
+    for (int n = 0; n < ADPCM_BLOCK_FRAMES / 2 - 1; n++) {
+        uint8_t byte = nibbles[n];
+        *dst++ = decode_nibble(byte & 0x0F, &predictor, &index);
+        *dst++ = decode_nibble(byte >> 4, &predictor, &index);
+    }
+    *dst = decode_nibble(nibbles[ADPCM_BLOCK_FRAMES / 2 - 1] & 0x0F, &predictor, &index);
+}
+
+int16_t adpcm_block_first_frame(const uint8_t *block) {
+    int16_t first_frame;
+    memcpy(&first_frame, block, sizeof(first_frame));
+    return first_frame;
+}
+
+void adpcm_benchmark(void) {
+    // one second of audio at 16 kHz
+    const uint32_t frames = 16000;
+
+    int16_t *pcm = heap_caps_malloc(frames * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    uint8_t *encoded = heap_caps_malloc(adpcm_encoded_size(frames), MALLOC_CAP_SPIRAM);
+    int16_t *scratch = heap_caps_malloc(ADPCM_BLOCK_FRAMES * sizeof(int16_t), MALLOC_CAP_INTERNAL);
+    if (pcm == NULL || encoded == NULL || scratch == NULL) {
+        ESP_LOGE(TAG, "Not enough memory to run the benchmark");
+        heap_caps_free(pcm);
+        heap_caps_free(encoded);
+        heap_caps_free(scratch);
+        return;
+    }
+
+    // two tones plus some noise, so the quantizer has something to adapt to
+    for (uint32_t i = 0; i < frames; i++) {
+        float t = (float)i / 16000.0f;
+        pcm[i] = (int16_t)(8000.0f * sinf(2.0f * M_PI * 220.0f * t) + 4000.0f * sinf(2.0f * M_PI * 1760.0f * t) + (rand() % 512) - 256);
+    }
+
+    esp_cpu_cycle_count_t start = esp_cpu_get_cycle_count();
+    adpcm_encode(pcm, frames, encoded);
+    esp_cpu_cycle_count_t enc_cycles = esp_cpu_get_cycle_count() - start;
+
+    // decode block by block, the same way the mixer does
+    uint32_t blocks = adpcm_block_count(frames);
+    int64_t sq_err = 0;
+    start = esp_cpu_get_cycle_count();
+    for (uint32_t b = 0; b < blocks; b++) {
+        adpcm_decode_block(encoded + b * ADPCM_BLOCK_BYTES, scratch);
+    }
+    esp_cpu_cycle_count_t dec_cycles = esp_cpu_get_cycle_count() - start;
+
+    // measure the error introduced by the codec (outside of the timed section)
+    for (uint32_t b = 0; b < blocks; b++) {
+        adpcm_decode_block(encoded + b * ADPCM_BLOCK_BYTES, scratch);
+        for (uint32_t i = 0; i < ADPCM_BLOCK_FRAMES && b * ADPCM_BLOCK_FRAMES + i < frames; i++) {
+            int32_t err = scratch[i] - pcm[b * ADPCM_BLOCK_FRAMES + i];
+            sq_err += err * err;
+        }
+    }
+
+    ESP_LOGI(TAG, "encode: %.2f cycles/frame", (float)enc_cycles / frames);
+    ESP_LOGI(TAG, "decode: %.2f cycles/frame (%lu blocks)", (float)dec_cycles / (blocks * ADPCM_BLOCK_FRAMES), blocks);
+    ESP_LOGI(TAG, "size: %u -> %u bytes, rms error %.1f", frames * sizeof(int16_t), adpcm_encoded_size(frames), sqrtf((float)sq_err / frames));
+
+    heap_caps_free(pcm);
+    heap_caps_free(encoded);
+    heap_caps_free(scratch);
+}
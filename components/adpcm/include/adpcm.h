@@ -0,0 +1,71 @@
+/*********************************************************************************
+ *                                     ADPCM                                     *
+ *    IMA-ADPCM codec used to keep samples compressed (about 4:1) in PSRAM.      *
+ *  The stream is split in fixed-size blocks, each one starting with a header    *
+ *  holding the first frame verbatim and the step index: every block can be      *
+ *          decoded on its own, so block boundaries act as seek points.          *
+ *********************************************************************************/
+#ifndef ADPCM_H_
+#define ADPCM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// number of frames contained in a single block
+#define ADPCM_BLOCK_FRAMES 256
+
+// size of the block header: first frame (int16) + step index (uint8) + padding
+#define ADPCM_BLOCK_HDR_SIZE 4
+
+// size in bytes of a single encoded block (the first frame is in the header, the others are nibbles)
+#define ADPCM_BLOCK_BYTES (ADPCM_BLOCK_HDR_SIZE + ADPCM_BLOCK_FRAMES / 2)
+
+// set to 1 to print the decoder benchmark at boot
+#define ADPCM_RUN_BENCHMARK 0
+
+// header placed at the beginning of every encoded block
+typedef struct {
+    int16_t first_frame;    // first frame of the block, stored as is
+    uint8_t step_index;     // step index of the decoder at the start of the block
+    uint8_t reserved;       // padding, always 0
+} adpcm_block_hdr_t;
+
+/*
+@brief returns the number of blocks needed to encode a certain number of frames.
+@param frames number of 16 bit mono frames.
+*/
+uint32_t adpcm_block_count(uint32_t frames);
+
+/*
+@brief returns the size in bytes of the encoded stream for a certain number of frames.
+@param frames number of 16 bit mono frames.
+*/
+size_t adpcm_encoded_size(uint32_t frames);
+
+/*
+@brief encodes a 16 bit mono PCM buffer into IMA-ADPCM blocks. The last block is padded with silence.
+@param pcm source PCM frames.
+@param frames number of frames to encode.
+@param out destination buffer, at least adpcm_encoded_size(frames) bytes long.
+*/
+void adpcm_encode(const int16_t *pcm, uint32_t frames, uint8_t *out);
+
+/*
+@brief decodes a whole block into ADPCM_BLOCK_FRAMES PCM frames.
+@param block pointer to the beginning of the encoded block.
+@param out destination buffer, at least ADPCM_BLOCK_FRAMES frames long.
+*/
+void adpcm_decode_block(const uint8_t *block, int16_t *out);
+
+/*
+@brief returns the first frame of a block without decoding it.
+@param block pointer to the beginning of the encoded block.
+*/
+int16_t adpcm_block_first_frame(const uint8_t *block);
+
+/*
+@brief measures the decoder speed on a synthetic signal and logs the CPU cycles spent per frame.
+*/
+void adpcm_benchmark(void);
+
+#endif
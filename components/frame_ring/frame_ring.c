@@ -0,0 +1,70 @@
+#include "frame_ring.h"
+#include <string.h>
+#include "esp_heap_caps.h"
+
+esp_err_t frame_ring_init(frame_ring_t *ring, uint32_t size, uint32_t caps) {
+    if (ring == NULL || size == 0) return ESP_ERR_INVALID_ARG;
+
+    // round up to a power of 2
+    uint32_t pow2 = 1;
+    while (pow2 < size) pow2 <<= 1;
+
+    ring->frames = heap_caps_malloc(pow2 * sizeof(int16_t), caps);
+    if (ring->frames == NULL) return ESP_ERR_NO_MEM;
+
+    ring->size = pow2;
+    ring->mask = pow2 - 1;
+    frame_ring_reset(ring);
+
+    return ESP_OK;
+}
+
+void frame_ring_reset(frame_ring_t *ring) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->overruns = 0;
+}
+
+size_t frame_ring_push(frame_ring_t *ring, const int16_t *frames, size_t count) {
+    uint32_t head = ring->head;
+    // acquire: the consumer has finished reading the frames before the tail
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (ring->size - (head - tail) < count) {
+        ring->overruns += count;
+        return 0;
+    }
+
+    // the block may wrap around the end of the storage
+    uint32_t start = head & ring->mask;
+    size_t first = ring->size - start < count ? ring->size - start : count;
+    memcpy(&ring->frames[start], frames, first * sizeof(int16_t));
+    memcpy(ring->frames, frames + first, (count - first) * sizeof(int16_t));
+
+    // release: the frames are visible before the new head
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+size_t frame_ring_pop(frame_ring_t *ring, int16_t *out, size_t count) {
+    uint32_t tail = ring->tail;
+    // acquire: the producer has finished writing the frames before the head
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    size_t available = head - tail;
+    if (count > available) count = available;
+    if (count == 0) return 0;
+
+    uint32_t start = tail & ring->mask;
+    size_t first = ring->size - start < count ? ring->size - start : count;
+    memcpy(out, &ring->frames[start], first * sizeof(int16_t));
+    memcpy(out + first, ring->frames, (count - first) * sizeof(int16_t));
+
+    // release: the frames are read before the producer can overwrite them
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+}
+
+size_t frame_ring_available(const frame_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+}
@@ -0,0 +1,62 @@
+/*********************************************************************************
+ *                                  FRAME RING                                   *
+ *   Lock-free single-producer/single-consumer ring of 16 bit audio frames.      *
+ *  The producer (the audio task) only moves the head and the consumer only      *
+ *   moves the tail, so neither side ever blocks, allocates or logs: a full      *
+ *            ring drops the new frames and counts them as overruns.             *
+ *********************************************************************************/
+#ifndef FRAME_RING_H_
+#define FRAME_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// ring of frames, the size is a power of 2 so the indexes wrap with a mask
+typedef struct {
+    int16_t *frames;            // storage
+    uint32_t size;              // capacity in frames (power of 2)
+    uint32_t mask;              // size - 1
+    volatile uint32_t head;     // total frames written, only moved by the producer
+    volatile uint32_t tail;     // total frames read, only moved by the consumer
+    volatile uint32_t overruns; // frames dropped because the ring was full
+} frame_ring_t;
+
+/*
+@brief allocates the storage of the ring.
+@param ring the ring.
+@param size capacity in frames, rounded up to a power of 2.
+@param caps heap capabilities of the storage (i.e. MALLOC_CAP_SPIRAM).
+*/
+esp_err_t frame_ring_init(frame_ring_t *ring, uint32_t size, uint32_t caps);
+
+/*
+@brief empties the ring and clears the overruns. Neither side must be using it.
+@param ring the ring.
+*/
+void frame_ring_reset(frame_ring_t *ring);
+
+/*
+@brief producer side: appends a block of frames. The block is written entirely or dropped.
+Returns the number of frames written.
+@param ring the ring.
+@param frames the frames to write.
+@param count number of frames.
+*/
+size_t frame_ring_push(frame_ring_t *ring, const int16_t *frames, size_t count);
+
+/*
+@brief consumer side: reads up to count frames. Returns the number of frames read.
+@param ring the ring.
+@param out destination buffer.
+@param count max number of frames to read.
+*/
+size_t frame_ring_pop(frame_ring_t *ring, int16_t *out, size_t count);
+
+/*
+@brief returns the number of frames ready to be read.
+@param ring the ring.
+*/
+size_t frame_ring_available(const frame_ring_t *ring);
+
+#endif
@@ -12,6 +12,10 @@
 #include "adc1.h"
 #include "lcd.h"
 #include "recorder.h"
+#include "looper.h"
+#include "bounce.h"
+#include "latency.h"
+#include "sequencer.h"
 
 #pragma endregion
 
@@ -35,6 +39,18 @@ static uint32_t start_chopping_ptrs[MAX_CHOPPING_PRECISION] = {0};
 
 static uint32_t end_chopping_ptrs[MAX_CHOPPING_PRECISION] = {0};
 
+static uint8_t kit_slot = 0;
+
+// mute group toggled from the general settings
+static uint8_t mute_group_sel = 1;
+
+// length of the bounces, in bars
+static uint8_t bounce_bars = 1;
+
+// track and step edited in the sequencer menu
+static uint8_t seq_track = 0;
+static uint8_t seq_step = 0;
+
 #pragma endregion
 
 #pragma region FUNCTION DECLARATIONS
@@ -120,6 +136,27 @@ based on the chopping menu.
 */
 void get_chopping_second_line(char* out);
 
+/*
+@breif function that gets the second line of the screen 
+based on the overdub menu.
+@param out the line that will be changed and then printed.
+*/
+void get_overdub_second_line(char* out);
+
+/*
+@breif function that gets the second line of the screen 
+for the bounce option.
+@param out the line that will be changed and then printed.
+*/
+void get_bounce_second_line(char* out);
+
+/*
+@breif function that gets the second line of the screen 
+based on the sequencer menu.
+@param out the line that will be changed and then printed.
+*/
+void get_sequencer_second_line(char* out);
+
 #pragma endregion
 
 #pragma region GENERAL MENU
@@ -138,6 +175,12 @@ opt_interactions_t gen_handlers[] = {
         .second_line = get_gen_menu_second_line,
         .js_right_action = goto_gen_effects,
         .pt_action = sink
+    },
+    {
+        .first_line = "Sequencer",
+        .second_line = get_gen_menu_second_line,
+        .js_right_action = goto_sequencer,
+        .pt_action = sink
     }
 };
 
@@ -183,6 +226,18 @@ opt_interactions_t btn_handlers[] = {
         .second_line = get_btn_menu_or_btn_effects_second_line,
         .js_right_action = goto_chopping,
         .pt_action = sink
+    },
+    {
+        .first_line = "Overdub",
+        .second_line = get_btn_menu_or_btn_effects_second_line,
+        .js_right_action = goto_overdub,
+        .pt_action = sink
+    },
+    {
+        .first_line = "Bounce",
+        .second_line = get_bounce_second_line,
+        .js_right_action = bounce_to_pad,
+        .pt_action = change_bounce_bars
     }
 };
 
@@ -211,6 +266,60 @@ opt_interactions_t gen_settings_handlers[] = {
         .second_line = get_gen_settings_second_line,
         .js_right_action = goto_metronome,
         .pt_action = sink
+    },
+    {
+        .first_line = "Record to",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_record_destination
+    },
+    {
+        .first_line = "Record from",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_record_source
+    },
+    {
+        .first_line = "Auto trim",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_auto_trim
+    },
+    {
+        .first_line = "Pre-roll",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_preroll
+    },
+    {
+        .first_line = "Capture",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = capture,
+        .pt_action = sink
+    },
+    {
+        .first_line = "Load kit",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = kit_load,
+        .pt_action = change_kit_slot
+    },
+    {
+        .first_line = "Save kit",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = kit_save,
+        .pt_action = change_kit_slot
+    },
+    {
+        .first_line = "Latency",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = latency_report,
+        .pt_action = change_latency_measure
+    },
+    {
+        .first_line = "Mute group",
+        .second_line = get_gen_settings_second_line,
+        .js_right_action = mute_group_toggle,
+        .pt_action = change_mute_group_sel
     }
 };
 
@@ -233,6 +342,48 @@ opt_interactions_t btn_settings_handlers[] = {
         .second_line = get_volume_second_line,
         .js_right_action = sink, 
         .pt_action = change_vol,
+    },
+    {
+        .first_line = "Storage",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink, 
+        .pt_action = change_storage,
+    },
+    {
+        .first_line = "Loop xfade",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_loop_xfade,
+    },
+    {
+        .first_line = "Choke group",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_choke_group,
+    },
+    {
+        .first_line = "Mute group",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_mute_group,
+    },
+    {
+        .first_line = "Launch",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_launch_quantize,
+    },
+    {
+        .first_line = "Repeat",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_note_repeat,
+    },
+    {
+        .first_line = "Repeat ramp",
+        .second_line = get_btn_settings_second_line,
+        .js_right_action = sink,
+        .pt_action = change_repeat_ramp,
     }
 };
 
@@ -432,6 +583,18 @@ opt_interactions_t metronome_handlers[] = {
         .js_right_action = sink,
         .pt_action = change_metronome_bpm,
     },
+    {
+        .first_line = "Rec sync: ",
+        .second_line = get_metronome_second_line,
+        .js_right_action = sink,
+        .pt_action = change_record_quantize,
+    },
+    {
+        .first_line = "Count-in: ",
+        .second_line = get_metronome_second_line,
+        .js_right_action = sink,
+        .pt_action = change_count_in,
+    },
 };
 
 menu_t metronome_menu = {
@@ -442,6 +605,130 @@ menu_t metronome_menu = {
 
 /************************************* */
 
+/**********************************************
+OVERDUB MENU
+***********************************************/
+opt_interactions_t overdub_handlers[] = {
+    {
+        .first_line = "Overdub: ",
+        .second_line = get_overdub_second_line,
+        .js_right_action = sink,
+        .pt_action = change_overdub,
+    },
+    {
+        .first_line = "Feedback: ",
+        .second_line = get_overdub_second_line,
+        .js_right_action = sink,
+        .pt_action = change_overdub_feedback,
+    },
+    {
+        .first_line = "Source: ",
+        .second_line = get_overdub_second_line,
+        .js_right_action = sink,
+        .pt_action = change_overdub_source,
+    },
+    {
+        .first_line = "Undo layer",
+        .second_line = get_overdub_second_line,
+        .js_right_action = overdub_undo,
+        .pt_action = sink,
+    },
+};
+
+menu_t overdub_menu = {
+    .curr_index = 0,
+    .max_size = OVERDUB_NUM_OPT,
+    .opt_handlers = overdub_handlers
+};
+
+/************************************* */
+
+/**********************************************
+SEQUENCER MENU
+***********************************************/
+opt_interactions_t sequencer_handlers[] = {
+    {
+        .first_line = "Play: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_play,
+    },
+    {
+        .first_line = "Rec: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_record,
+    },
+    {
+        .first_line = "Quantize: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_quantize,
+    },
+    {
+        .first_line = "Swing: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_swing,
+    },
+    {
+        .first_line = "Clear rec",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sequencer_clear,
+        .pt_action = sink,
+    },
+    {
+        .first_line = "Steps: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_length,
+    },
+    {
+        .first_line = "Track: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_track,
+    },
+    {
+        .first_line = "Step: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_step,
+    },
+    {
+        .first_line = "Trig: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_sequencer_trig,
+    },
+    {
+        .first_line = "Lock pitch: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_pitch_lock,
+    },
+    {
+        .first_line = "Lock volume: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_volume_lock,
+    },
+    {
+        .first_line = "Lock start: ",
+        .second_line = get_sequencer_second_line,
+        .js_right_action = sink,
+        .pt_action = change_start_lock,
+    },
+};
+
+menu_t sequencer_menu = {
+    .curr_index = 0,
+    .max_size = SEQUENCER_NUM_OPT,
+    .opt_handlers = sequencer_handlers
+};
+
+/************************************* */
+
 #pragma endregion
 
 //Menu collection, essential for the navigation
@@ -458,6 +745,8 @@ menu_t* menu_navigation[] = {
     &distortion_menu,
     NULL,
     &chopping_menu,
+    &overdub_menu,
+    &sequencer_menu,
 };
 
 
@@ -498,15 +787,114 @@ void get_btn_menu_or_btn_effects_second_line(char* out){
     sprintf(out, "Pad %u", pad_num); //button is presset
 }
 void get_gen_settings_second_line(char* out){
-    sprintf(out, "General");
+    switch (menu_navigation[curr_menu]->curr_index){
+    case RECORD_DEST:
+        if(recorder_get_destination() == REC_TO_SD){
+            sprintf(out, "SD card");
+        } else {
+            sprintf(out, "Memory");
+        }
+        break;
+    case RECORD_SOURCE:
+        uint8_t source = recorder_get_source();
+        if(source == RECORD_SOURCE_MASTER){
+            sprintf(out, "Master");
+        } else if(source == RECORD_SOURCE_ALL_VOICES){
+            sprintf(out, "All samples");
+        } else {
+            // a single voice
+            sprintf(out, "Sample %d", __builtin_ctz(source) + 1);
+        }
+        break;
+    case AUTO_TRIM:
+        sprintf(out, recorder_get_auto_trim() ? "On" : "Off");
+        break;
+    case PREROLL:
+        sprintf(out, recorder_get_preroll() ? "On" : "Off");
+        break;
+    case CAPTURE:
+        if(recorder_get_destination() == REC_TO_SD){
+            sprintf(out, "To SD card");
+        } else {
+            sprintf(out, "To a pad");
+        }
+        break;
+    case LATENCY:
+        sprintf(out, latency_get_enabled() ? "Measuring" : "Off");
+        break;
+    case LOAD_KIT:
+    case SAVE_KIT:
+        sprintf(out, "Slot %u", kit_slot);
+        break;
+    case MUTE_TOGGLE:
+        sprintf(out, "Group %u: %s", mute_group_sel, get_mute_group_state(mute_group_sel) ? "muted" : "on");
+        break;
+    default:
+        sprintf(out, "General");
+        break;
+    }
 }
 void get_btn_settings_second_line(char* out){
     sprintf(out, " "); //reset string
     uint8_t bank_index = get_sample_bank_index(pressed_button);
     if(bank_index == NOT_DEFINED) return;
 
-    pb_mode_t curr_mode = get_playback_mode(bank_index);
-    get_mode_stringify(curr_mode, out);
+    switch (menu_navigation[curr_menu]->curr_index){
+    case MODE:
+        pb_mode_t curr_mode = get_playback_mode(bank_index);
+        get_mode_stringify(curr_mode, out);
+        break;
+    case STORAGE:
+        if(get_sample_encoding(bank_index) == SAMPLE_ADPCM){
+            sprintf(out, "ADPCM 4:1");
+        } else {
+            sprintf(out, "PCM 16 bit");
+        }
+        break;
+    case LOOP_XFADE:
+        uint16_t xfade = get_loop_crossfade(bank_index);
+        if(xfade == 0){
+            sprintf(out, "Off");
+        } else {
+            sprintf(out, "%.1f ms", xfade * 1000.0f / GRVCHP_SAMPLE_FREQ);
+        }
+        break;
+    case CHOKE_GROUP:
+    case MUTE_GROUP:
+        uint8_t group = menu_navigation[curr_menu]->curr_index == CHOKE_GROUP ? get_choke_group(bank_index) : get_mute_group(bank_index);
+        if(group == PLAYBACK_GROUP_NONE){
+            sprintf(out, "Off");
+        } else {
+            sprintf(out, "Group %u", group);
+        }
+        break;
+    case LAUNCH_QUANT:
+        switch (get_launch_quantize(bank_index)){
+            case LAUNCH_QUANTIZE_BEAT: sprintf(out, "Beat"); break;
+            case LAUNCH_QUANTIZE_BAR: sprintf(out, "Bar"); break;
+            default: sprintf(out, "Off"); break;
+        }
+        break;
+    case NOTE_REPEAT:
+        switch (get_note_repeat(bank_index)){
+            case REPEAT_8TH: sprintf(out, "1/8"); break;
+            case REPEAT_16TH: sprintf(out, "1/16"); break;
+            case REPEAT_32ND: sprintf(out, "1/32"); break;
+            case REPEAT_8TH_TRIPLET: sprintf(out, "1/8 triplet"); break;
+            case REPEAT_16TH_TRIPLET: sprintf(out, "1/16 triplet"); break;
+            default: sprintf(out, "Off"); break;
+        }
+        break;
+    case REPEAT_RAMP:
+        switch (get_repeat_ramp(bank_index)){
+            case REPEAT_RAMP_UP: sprintf(out, "Up"); break;
+            case REPEAT_RAMP_DOWN: sprintf(out, "Down"); break;
+            default: sprintf(out, "Off"); break;
+        }
+        break;
+    default:
+        break;
+    }
 }
 void get_metronome_second_line(char* out){
     switch (menu_navigation[curr_menu] -> curr_index){
@@ -522,10 +910,120 @@ void get_metronome_second_line(char* out){
             int mtrn_bpm = get_metronome_bpm();
             sprintf(out, "%d", mtrn_bpm);
             break;
+        case REC_SYNC:
+            switch (recorder_get_quantize()){
+                case REC_QUANTIZE_BEAT: sprintf(out, "Beat"); break;
+                case REC_QUANTIZE_BAR: sprintf(out, "Bar"); break;
+                default: sprintf(out, "Off"); break;
+            }
+            break;
+        case COUNT_IN:
+            sprintf(out, recorder_get_count_in() ? "On" : "Off");
+            break;
         default:
             break;
         }
 }
+void get_bounce_second_line(char* out){
+    if(bounce_is_running()){
+        sprintf(out, "Rendering...");
+    } else {
+        sprintf(out, bounce_bars == 1 ? "%u bar" : "%u bars", bounce_bars);
+    }
+}
+void get_sequencer_second_line(char* out){
+    seq_lock_t lock;
+    sequencer_get_lock(seq_track, seq_step, &lock);
+
+    switch (menu_navigation[curr_menu]->curr_index){
+        case PLAY_SEQ:
+            sprintf(out, sequencer_get_playing() ? "On" : "Off");
+            break;
+        case REC_SEQ:
+            sprintf(out, sequencer_get_recording() ? "On" : "Off");
+            break;
+        case QUANTIZE_SEQ:
+            switch (sequencer_get_quantize()){
+                case SEQ_QUANTIZE_16TH: sprintf(out, "1/16"); break;
+                case SEQ_QUANTIZE_8TH: sprintf(out, "1/8"); break;
+                case SEQ_QUANTIZE_BEAT: sprintf(out, "1/4"); break;
+                default: sprintf(out, "Off"); break;
+            }
+            break;
+        case SWING_SEQ:
+            sprintf(out, "%u%%", sequencer_get_swing());
+            break;
+        case CLEAR_SEQ:
+            sprintf(out, "%u presses", sequencer_get_event_count());
+            break;
+        case STEPS_SEQ:
+            sprintf(out, "%u", sequencer_get_length());
+            break;
+        case TRACK_SEQ:
+            // the page of the selected step: x = on, . = off
+            uint8_t page_start = seq_step - seq_step % SEQ_PAGE_STEPS;
+            for(int i = 0; i < SEQ_PAGE_STEPS; i++){
+                out[i] = sequencer_get_step(seq_track, page_start + i) ? 'x' : '.';
+            }
+            out[SEQ_PAGE_STEPS] = '\0';
+            break;
+        case STEP_SEQ:
+            sprintf(out, "%u of %u", seq_step + 1, sequencer_get_length());
+            break;
+        case TRIG_SEQ:
+            sprintf(out, "T%u S%u: %s", seq_track + 1, seq_step + 1, sequencer_get_step(seq_track, seq_step) ? "On" : "Off");
+            break;
+        case PITCH_LOCK:
+            if((lock.flags & SEQ_LOCK_PITCH) == 0){
+                sprintf(out, "Off");
+            } else {
+                sprintf(out, "%+d st", lock.semitones);
+            }
+            break;
+        case VOLUME_LOCK:
+            if((lock.flags & SEQ_LOCK_VOLUME) == 0){
+                sprintf(out, "Off");
+            } else {
+                sprintf(out, "%u%%", lock.volume);
+            }
+            break;
+        case START_LOCK:
+            if((lock.flags & SEQ_LOCK_START) == 0){
+                sprintf(out, "Off");
+            } else {
+                sprintf(out, "%.1f%%", lock.start / 10.0f);
+            }
+            break;
+        default:
+            break;
+    }
+}
+void get_overdub_second_line(char* out){
+    sprintf(out, " "); //reset string
+    uint8_t bank_index = get_sample_bank_index(pressed_button);
+    if(bank_index == NOT_DEFINED) return;
+
+    switch (menu_navigation[curr_menu]->curr_index){
+        case ENABLE_OD:
+            sprintf(out, looper_get_target() == bank_index ? "On" : "Off");
+            break;
+        case FEEDBACK:
+            sprintf(out, "%d%%", (int)round(looper_get_feedback() * 100));
+            break;
+        case OD_SOURCE:
+            if(looper_get_source() == LOOPER_SOURCE_MASTER){
+                sprintf(out, "Master");
+            } else {
+                sprintf(out, "Sample %d", looper_get_source() + 1);
+            }
+            break;
+        case UNDO:
+            sprintf(out, "%u layers", looper_get_undo_count());
+            break;
+        default:
+            break;
+    }
+}
 void get_bitcrusher_second_line(char* out){
     sprintf(out, " "); //reset string
     uint8_t bank_index = get_sample_bank_index(pressed_button);
@@ -818,6 +1316,16 @@ void goto_metronome(){
     curr_menu = METRONOME;
 }
 
+void goto_overdub(){
+    overdub_menu.curr_index = 0;
+    curr_menu = OVERDUB;
+}
+
+void goto_sequencer(){
+    sequencer_menu.curr_index = 0;
+    curr_menu = SEQUENCER;
+}
+
 void sample_load() {
     int sample_idx = get_pad_num(pressed_button) - 1;
     
@@ -915,6 +1423,72 @@ void save() {
     st_sample(get_sample_bank_index(pressed_button), sample_names_bank[get_sample_bank_index(pressed_button)]);
 }
 
+void overdub_undo() {
+    looper_undo();
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void bounce_to_pad() {
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx != NOT_DEFINED){
+        bounce_loop_state(bounce_bars, idx);
+    }
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+    screen_has_to_change = true;
+}
+
+void sequencer_clear() {
+    sequencer_clear_events();
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void capture() {
+    recorder_capture();
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void kit_load() {
+    if(ld_kit(kit_slot) != ESP_OK){
+        ESP_LOGW(TAG_FSM, "kit %u was not loaded", kit_slot);
+    }
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void kit_save() {
+    if(st_kit(kit_slot) != ESP_OK){
+        ESP_LOGW(TAG_FSM, "kit %u was not saved", kit_slot);
+    }
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void mute_group_toggle() {
+    set_mute_group_state(mute_group_sel, !get_mute_group_state(mute_group_sel));
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
+void latency_report() {
+    latency_stats_t stats;
+    latency_get_stats(&stats);
+
+    if(stats.count == 0){
+        print_double("Latency", "No presses yet");
+    } else {
+        // min/avg/p99 in ms
+        char line[17];
+        snprintf(line, sizeof(line), "%.1f/%.1f/%.1f", stats.min_us / 1000.0f, stats.avg_us / 1000.0f, stats.p99_us / 1000.0f);
+        print_double("min/avg/p99 ms", line);
+    }
+    // it's not a submenu, so the state pushed by js_right_handler is dropped
+    menu_pop();
+}
+
 #pragma endregion
 
 #pragma region POTENTIOMETER HANDLING
@@ -1028,6 +1602,280 @@ void rotate_mode(int pot_value){
     set_playback_mode(idx, new_mode);
 }
 
+// Function that compresses or decompresses the sample
+void change_storage(int pot_value){
+
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    sample_encoding_t new_encoding = pot_value > 50 ? SAMPLE_ADPCM : SAMPLE_PCM16;
+    if(get_sample_encoding(idx) == new_encoding) return;
+
+    screen_has_to_change = set_sample_encoding(idx, new_encoding) == ESP_OK;
+}
+
+// Function that sets the crossfade at the loop point, from 0 (off) to 16 ms
+void change_loop_xfade(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    uint16_t new_xfade = pot_value * MIXER_XFADE_MAX_FRAMES / 100;
+    screen_has_to_change = get_loop_crossfade(idx) != new_xfade;
+
+    set_loop_crossfade(idx, new_xfade);
+}
+
+// Function that puts the sample in a choke group, or in none
+void change_choke_group(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    uint8_t new_group = pot_value * (PLAYBACK_CHOKE_GROUPS + 1) / 101;
+    screen_has_to_change = get_choke_group(idx) != new_group;
+
+    set_choke_group(idx, new_group);
+}
+
+// Function that puts the sample in a mute group, or in none
+void change_mute_group(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    uint8_t new_group = pot_value * (PLAYBACK_MUTE_GROUPS + 1) / 101;
+    screen_has_to_change = get_mute_group(idx) != new_group;
+
+    set_mute_group(idx, new_group);
+}
+
+// Function that sets the grid on which a loop sample starts and stops
+void change_launch_quantize(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    launch_quantize_t new_quantize = pot_value * (LAUNCH_QUANTIZE_BAR + 1) / 101;
+    screen_has_to_change = get_launch_quantize(idx) != new_quantize;
+
+    set_launch_quantize(idx, new_quantize);
+}
+
+// Function that sets the rate at which a held sample is retriggered
+void change_note_repeat(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    note_repeat_t new_rate = pot_value * (REPEAT_16TH_TRIPLET + 1) / 101;
+    screen_has_to_change = get_note_repeat(idx) != new_rate;
+
+    set_note_repeat(idx, new_rate);
+}
+
+// Function that sets the volume ramp of the repeats
+void change_repeat_ramp(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    repeat_ramp_t new_ramp = pot_value * (REPEAT_RAMP_DOWN + 1) / 101;
+    screen_has_to_change = get_repeat_ramp(idx) != new_ramp;
+
+    set_repeat_ramp(idx, new_ramp);
+}
+
+// Function that selects the mute group toggled from the general settings
+void change_mute_group_sel(int pot_value){
+    uint8_t new_group = 1 + pot_value * PLAYBACK_MUTE_GROUPS / 101;
+    screen_has_to_change = new_group != mute_group_sel;
+
+    mute_group_sel = new_group;
+}
+
+// Function that selects where the recordings go
+void change_record_destination(int pot_value){
+    record_destination_t new_destination = pot_value > 50 ? REC_TO_SD : REC_TO_MEMORY;
+    if(recorder_get_destination() == new_destination) return;
+
+    recorder_set_destination(new_destination);
+    screen_has_to_change = recorder_get_destination() == new_destination;
+}
+
+// Function that selects the capture source: master, one of the samples or all of them
+void change_record_source(int pot_value){
+    int choice = pot_value * (SAMPLE_NUM + 2) / 101;
+    uint8_t new_source;
+    if(choice == 0){
+        new_source = RECORD_SOURCE_MASTER;
+    } else if(choice <= SAMPLE_NUM){
+        new_source = RECORD_SOURCE_VOICE(choice - 1);
+    } else {
+        new_source = RECORD_SOURCE_ALL_VOICES;
+    }
+    if(recorder_get_source() == new_source) return;
+
+    recorder_set_source(new_source);
+    screen_has_to_change = recorder_get_source() == new_source;
+}
+
+// Function that enables or disables the trimming and normalization of the recordings
+void change_auto_trim(int pot_value){
+    bool new_state = pot_value > 50;
+    screen_has_to_change = recorder_get_auto_trim() != new_state;
+
+    recorder_set_auto_trim(new_state);
+}
+
+// Function that starts or stops the latency measurement
+void change_latency_measure(int pot_value){
+    bool new_state = pot_value > 50;
+    if(latency_get_enabled() == new_state) return;
+
+    latency_set_enabled(new_state);
+    screen_has_to_change = true;
+}
+
+// Function that enables or disables the pre-roll
+void change_preroll(int pot_value){
+    bool new_state = pot_value > 50;
+    if(recorder_get_preroll() == new_state) return;
+
+    screen_has_to_change = recorder_set_preroll(new_state) == ESP_OK;
+}
+
+// Function that selects the kit slot
+void change_kit_slot(int pot_value){
+    uint8_t new_slot = pot_value * KIT_SLOTS / 101;
+    screen_has_to_change = new_slot != kit_slot;
+
+    kit_slot = new_slot;
+}
+
+// Function that selects the length of the bounces: 1, 2, 4 or 8 bars
+void change_bounce_bars(int pot_value){
+    uint8_t new_bars = 1 << (pot_value * 4 / 101);
+    screen_has_to_change = new_bars != bounce_bars;
+
+    bounce_bars = new_bars;
+}
+
+// Function that starts or stops the pattern
+void change_sequencer_play(int pot_value){
+    bool new_state = pot_value > 50;
+    if(sequencer_get_playing() == new_state) return;
+
+    sequencer_set_playing(new_state);
+    screen_has_to_change = true;
+}
+
+// Function that arms or disarms the recording of the pad presses
+void change_sequencer_record(int pot_value){
+    bool new_state = pot_value > 50;
+    if(sequencer_get_recording() == new_state) return;
+
+    sequencer_set_recording(new_state);
+    screen_has_to_change = true;
+}
+
+// Function that selects the grid of the recorded presses: off, 1/16, 1/8 or 1/4
+void change_sequencer_quantize(int pot_value){
+    seq_quantize_t new_quantize = pot_value * (SEQ_QUANTIZE_BEAT + 1) / 101;
+    if(sequencer_get_quantize() == new_quantize) return;
+
+    sequencer_set_quantize(new_quantize);
+    screen_has_to_change = true;
+}
+
+// Function that selects the swing, from 50% (straight) to 75%
+void change_sequencer_swing(int pot_value){
+    uint8_t new_swing = SEQ_SWING_MIN + pot_value * (SEQ_SWING_MAX - SEQ_SWING_MIN) / 100;
+    screen_has_to_change = sequencer_get_swing() != new_swing;
+
+    sequencer_set_swing(new_swing);
+}
+
+// Function that selects the length of the pattern: 16, 32, 48 or 64 steps
+void change_sequencer_length(int pot_value){
+    uint8_t new_length = SEQ_PAGE_STEPS * (1 + pot_value * (SEQ_MAX_STEPS / SEQ_PAGE_STEPS) / 101);
+    if(sequencer_get_length() == new_length) return;
+
+    sequencer_set_length(new_length);
+    if(seq_step >= new_length){
+        seq_step = new_length - 1;
+    }
+    screen_has_to_change = true;
+}
+
+// Function that selects the track, one per sample
+void change_sequencer_track(int pot_value){
+    uint8_t new_track = pot_value * SEQ_TRACKS / 101;
+    screen_has_to_change = new_track != seq_track;
+
+    seq_track = new_track;
+}
+
+// Function that selects the step, in the length of the pattern
+void change_sequencer_step(int pot_value){
+    uint8_t new_step = pot_value * sequencer_get_length() / 101;
+    screen_has_to_change = new_step != seq_step;
+
+    seq_step = new_step;
+}
+
+// Function that turns the selected step on or off
+void change_sequencer_trig(int pot_value){
+    bool new_state = pot_value > 50;
+    if(sequencer_get_step(seq_track, seq_step) == new_state) return;
+
+    screen_has_to_change = sequencer_set_step(seq_track, seq_step, new_state) == ESP_OK;
+}
+
+// Function that locks the pitch of the selected step, the bottom of the range removes the lock
+void change_pitch_lock(int pot_value){
+    seq_lock_t lock;
+    sequencer_get_lock(seq_track, seq_step, &lock);
+
+    // off, then -12 to +12 semitones
+    int choice = pot_value * (2 * SEQ_LOCK_PITCH_RANGE + 2) / 101;
+    if(choice == 0){
+        if((lock.flags & SEQ_LOCK_PITCH) == 0) return;
+        screen_has_to_change = sequencer_clear_lock(seq_track, seq_step, SEQ_LOCK_PITCH) == ESP_OK;
+        return;
+    }
+
+    int new_semitones = choice - 1 - SEQ_LOCK_PITCH_RANGE;
+    if((lock.flags & SEQ_LOCK_PITCH) != 0 && lock.semitones == new_semitones) return;
+    screen_has_to_change = sequencer_set_lock(seq_track, seq_step, SEQ_LOCK_PITCH, new_semitones) == ESP_OK;
+}
+
+// Function that locks the volume of the selected step, the bottom of the range removes the lock
+void change_volume_lock(int pot_value){
+    seq_lock_t lock;
+    sequencer_get_lock(seq_track, seq_step, &lock);
+
+    if(pot_value < SEQ_LOCK_OFF_ZONE){
+        if((lock.flags & SEQ_LOCK_VOLUME) == 0) return;
+        screen_has_to_change = sequencer_clear_lock(seq_track, seq_step, SEQ_LOCK_VOLUME) == ESP_OK;
+        return;
+    }
+
+    int new_volume = (pot_value - SEQ_LOCK_OFF_ZONE) * 100 / (100 - SEQ_LOCK_OFF_ZONE);
+    if((lock.flags & SEQ_LOCK_VOLUME) != 0 && lock.volume == new_volume) return;
+    screen_has_to_change = sequencer_set_lock(seq_track, seq_step, SEQ_LOCK_VOLUME, new_volume) == ESP_OK;
+}
+
+// Function that locks the start offset of the selected step, the bottom of the range removes the lock
+void change_start_lock(int pot_value){
+    seq_lock_t lock;
+    sequencer_get_lock(seq_track, seq_step, &lock);
+
+    if(pot_value < SEQ_LOCK_OFF_ZONE){
+        if((lock.flags & SEQ_LOCK_START) == 0) return;
+        screen_has_to_change = sequencer_clear_lock(seq_track, seq_step, SEQ_LOCK_START) == ESP_OK;
+        return;
+    }
+
+    int new_start = (pot_value - SEQ_LOCK_OFF_ZONE) * 1000 / (100 - SEQ_LOCK_OFF_ZONE);
+    if((lock.flags & SEQ_LOCK_START) != 0 && lock.start == new_start) return;
+    screen_has_to_change = sequencer_set_lock(seq_track, seq_step, SEQ_LOCK_START, new_start) == ESP_OK;
+}
+
 // Function that gets the next mode
 pb_mode_t next_mode(int pot_value){
     // return (mode_t)(((int)curr_mode + next + MODE_NUM_OPT)%MODE_NUM_OPT);
@@ -1169,6 +2017,57 @@ void change_metronome_bpm(int pot_value){
     set_metronome_bpm(new_bpm);
 }
 
+// Function that starts or stops the overdub on the pressed pad's sample
+void change_overdub(int pot_value){
+    uint8_t idx = get_sample_bank_index(pressed_button);
+    if(idx == NOT_DEFINED) return;
+
+    bool new_state = pot_value > 50;
+    if((looper_get_target() == idx) == new_state) return;
+
+    if(new_state){
+        // only one sample at a time
+        looper_stop();
+        screen_has_to_change = looper_start(idx) == ESP_OK;
+    } else {
+        looper_stop();
+        screen_has_to_change = true;
+    }
+}
+
+// Function that changes the overdub feedback
+void change_overdub_feedback(int pot_value){
+    float new_feedback = pot_value / 100.0f;
+    screen_has_to_change = looper_get_feedback() != new_feedback;
+
+    looper_set_feedback(new_feedback);
+}
+
+// Function that selects the overdub source: master, or one of the samples
+void change_overdub_source(int pot_value){
+    int new_source = (pot_value * (SAMPLE_NUM + 1) / 101) - 1;
+    screen_has_to_change = looper_get_source() != new_source;
+
+    looper_set_source(new_source);
+}
+
+// Function that selects the grid of the recordings
+void change_record_quantize(int pot_value){
+    record_quantize_t new_quantize = pot_value <= 33 ? REC_QUANTIZE_OFF : (pot_value <= 66 ? REC_QUANTIZE_BEAT : REC_QUANTIZE_BAR);
+    if(recorder_get_quantize() == new_quantize) return;
+
+    recorder_set_quantize(new_quantize);
+    screen_has_to_change = recorder_get_quantize() == new_quantize;
+}
+
+// Function that enables or disables the count-in
+void change_count_in(int pot_value){
+    bool new_state = pot_value > 50;
+    screen_has_to_change = recorder_get_count_in() != new_state;
+
+    recorder_set_count_in(new_state);
+}
+
 void change_chopping_start(int pot_value){
     const uint8_t idx = get_sample_bank_index(pressed_button);
     uint8_t precision = get_chopping_precision();
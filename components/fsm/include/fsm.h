@@ -21,16 +21,16 @@
 #define MENU_NUM 8
 
 // number of options in general menu
-#define GEN_MENU_NUM_OPT 2
+#define GEN_MENU_NUM_OPT 3
 
 // number of options in button menu
-#define BTN_MENU_NUM_OPT 5
+#define BTN_MENU_NUM_OPT 7
 
 // number of options in general settings
-#define GEN_SETTINGS_NUM_OPT 2
+#define GEN_SETTINGS_NUM_OPT 11
 
 // number of options in button settings
-#define BTN_SETTINGS_NUM_OPT 2
+#define BTN_SETTINGS_NUM_OPT 9
 
 // number of options in general effects
 #define GEN_EFFECTS_NUM_OPT 2
@@ -54,7 +54,16 @@
 #define CHOPPING_NUM_OPT 3
 
 // number of metronome options
-#define METRONOME_NUM_OPT 2
+#define METRONOME_NUM_OPT 4
+
+// number of overdub options
+#define OVERDUB_NUM_OPT 4
+
+// number of sequencer options
+#define SEQUENCER_NUM_OPT 12
+
+// bottom of the potentiometer range that removes a volume or start lock
+#define SEQ_LOCK_OFF_ZONE 5
 
 #pragma endregion
 
@@ -88,7 +97,9 @@ typedef enum {
     PITCH,
     DISTORTION,
     SAMPLE_LOAD,
-    CHOPPING
+    CHOPPING,
+    OVERDUB,
+    SEQUENCER
 } menu_types;
 
 // enum that describes the bitcrusher menu options
@@ -108,21 +119,63 @@ typedef enum{
 // enum that describes the button settings menu options
 typedef enum{
     MODE,
-    SAMPLE_VOLUME
+    SAMPLE_VOLUME,
+    STORAGE,
+    LOOP_XFADE,
+    CHOKE_GROUP,
+    MUTE_GROUP,
+    LAUNCH_QUANT,
+    NOTE_REPEAT,
+    REPEAT_RAMP
 } btn_settings_menu_t;
 
 // enum that describes the general settings menu options
 typedef enum{
     GEN_VOLUME,
-    METRONOME_MENU
+    METRONOME_MENU,
+    RECORD_DEST,
+    RECORD_SOURCE,
+    AUTO_TRIM,
+    PREROLL,
+    CAPTURE,
+    LOAD_KIT,
+    SAVE_KIT,
+    LATENCY,
+    MUTE_TOGGLE
 } gen_settings_menu_t;
 
 // enum that describes the metronome menu options
 typedef enum {
     ENABLE_MTRN,
     BPM,
+    REC_SYNC,
+    COUNT_IN,
 } metronome_menu_t;
 
+// enum that describes the overdub menu options
+typedef enum{
+    ENABLE_OD,
+    FEEDBACK,
+    OD_SOURCE,
+    UNDO
+} overdub_menu_t;
+
+// enum that describes the sequencer menu options
+typedef enum{
+    PLAY_SEQ,
+    REC_SEQ,
+    QUANTIZE_SEQ,
+    SWING_SEQ,
+    CLEAR_SEQ,
+    STEPS_SEQ,
+    TRACK_SEQ,
+    STEP_SEQ,
+    TRIG_SEQ,
+    PITCH_LOCK,
+    VOLUME_LOCK,
+    START_LOCK
+} sequencer_menu_t;
+
 // enum that describes the chopping menu options
 typedef enum{
     PRECISION,
@@ -270,6 +323,16 @@ void goto_chopping();
 */
 void goto_metronome();
 
+/*
+@brief helper function that switches to overdub menu.
+*/
+void goto_overdub();
+
+/*
+@brief helper function that switches to sequencer menu.
+*/
+void goto_sequencer();
+
 /*
 @brief function that handles the up and down index in menus.
 @param index pointer to the current menu index.
@@ -314,6 +377,46 @@ void set_button_pressed(int gpio);
 */
 void save();
 
+/*
+@brief undo the last overdub layer.
+*/
+void overdub_undo();
+
+/*
+@brief commit what has just been played (the pre-roll) to a pad or to SD.
+*/
+void capture();
+
+/*
+@brief render what is playing now, for the selected number of bars, into the pressed pad's sample.
+*/
+void bounce_to_pad();
+
+/*
+@brief remove the presses recorded into the sequencer pattern.
+*/
+void sequencer_clear();
+
+/*
+@brief load the kit in the selected slot from SD.
+*/
+void kit_load();
+
+/*
+@brief save all the banks in the selected kit slot in SD.
+*/
+void kit_save();
+
+/*
+@brief show the statistics of the measured latency (press to sound) on the screen and log them.
+*/
+void latency_report();
+
+/*
+@brief mute or unmute the selected mute group.
+*/
+void mute_group_toggle();
+
 /*
 @biref function that handles the potentiometer message 
 by calling the current menu relative action.
@@ -491,6 +594,41 @@ by calling the correct helper function.
 */
 void change_metronome_bpm(int pot_value);
 
+/*
+@brief function that selects the grid of the recordings (off, beat or bar)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_record_quantize(int pot_value);
+
+/*
+@brief function that enables or disables the count-in of the recordings
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_count_in(int pot_value);
+
+/*
+@brief function that starts or stops overdubbing the pressed pad's sample
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_overdub(int pot_value);
+
+/*
+@brief function that changes how much of the previous layers is kept
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_overdub_feedback(int pot_value);
+
+/*
+@brief function that selects what is overdubbed (master output or a single sample)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_overdub_source(int pot_value);
+
 /*
 @brief function that changes the chopping start value based
 on the pressed button by calling the correct helper function.
@@ -514,6 +652,188 @@ on the pressed button by calling the correct helper function.
 void change_chopping_precision(int pot_value);
 
 
+/*
+@brief function that switches the storage of the sample between
+PCM and ADPCM based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_storage(int pot_value);
+
+/*
+@brief function that sets the crossfade at the loop point of the sample
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_loop_xfade(int pot_value);
+
+/*
+@brief function that sets the choke group of the sample (off or 1-4)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_choke_group(int pot_value);
+
+/*
+@brief function that sets the mute group of the sample (off or 1-4)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_mute_group(int pot_value);
+
+/*
+@brief function that sets the launch grid of the sample (off, beat or bar)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_launch_quantize(int pot_value);
+
+/*
+@brief function that sets the note repeat rate of the sample (off, 1/8, 1/16,
+1/32, 1/8 triplet or 1/16 triplet) based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_note_repeat(int pot_value);
+
+/*
+@brief function that sets the volume ramp of the repeats of the sample (off,
+up or down) based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_repeat_ramp(int pot_value);
+
+/*
+@brief function that selects the mute group toggled from the general settings
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_mute_group_sel(int pot_value);
+
+/*
+@brief function that selects where the recordings go (memory or SD card)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_record_destination(int pot_value);
+
+/*
+@brief function that selects what is recorded (master, a single sample
+or all the samples before the master volume) based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_record_source(int pot_value);
+
+/*
+@brief function that enables or disables the silence trimming and
+normalization of the recordings based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_auto_trim(int pot_value);
+
+/*
+@brief function that enables or disables the pre-roll
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_preroll(int pot_value);
+
+/*
+@brief function that starts or stops the latency measurement
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_latency_measure(int pot_value);
+
+/*
+@brief function that selects the kit slot to load or save based
+on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_kit_slot(int pot_value);
+
+/*
+@brief function that selects the length of the bounces (1, 2, 4 or 8 bars)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_bounce_bars(int pot_value);
+
+/*
+@brief function that starts or stops the sequencer
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_play(int pot_value);
+
+/*
+@brief function that arms or disarms the recording of the pad presses into the pattern
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_record(int pot_value);
+
+/*
+@brief function that selects the grid of the recorded presses (off, 1/16, 1/8, 1/4)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_quantize(int pot_value);
+
+/*
+@brief function that selects the swing of the grid (50% to 75%)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_swing(int pot_value);
+
+/*
+@brief function that selects the length of the pattern (16, 32, 48 or 64 steps)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_length(int pot_value);
+
+/*
+@brief function that selects the track being edited
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_track(int pot_value);
+
+/*
+@brief function that selects the step being edited
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_step(int pot_value);
+
+/*
+@brief function that turns the selected step on or off
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_sequencer_trig(int pot_value);
+
+/*
+@brief function that locks the pitch of the selected step (-12 to +12 semitones, off at the bottom)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_pitch_lock(int pot_value);
+
+/*
+@brief function that locks the volume of the selected step (off at the bottom)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_volume_lock(int pot_value);
+
+/*
+@brief function that locks the start offset of the selected step (off at the bottom)
+based on the potentiometer value.
+@param pot_value value of the potentiometer.
+*/
+void change_start_lock(int pot_value);
+
 /*
 @brief helper function that based on the potentiometer value
 returns a specific mode.
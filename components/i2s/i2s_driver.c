@@ -13,6 +13,8 @@ i2s_chan_handle_t i2s_driver_init(){
     i2s_chan_handle_t out_channel; // master channel for the output
 
     i2s_chan_config_t out_chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_AUTO, I2S_ROLE_MASTER);
+    out_chan_cfg.dma_desc_num = GRVCHP_OUT_DMA_DESC_NUM;
+    out_chan_cfg.dma_frame_num = GRVCHP_OUT_DMA_FRAME_NUM;
     ESP_ERROR_CHECK(i2s_new_channel(&out_chan_cfg, &out_channel, NULL));
 
     i2s_std_config_t out_port_cfg = {
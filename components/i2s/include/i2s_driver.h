@@ -10,6 +10,10 @@
 
 #define GRVCHP_SAMPLE_FREQ 16000
 
+// DMA buffers of the output channel (the driver defaults, kept explicit for the latency meter)
+#define GRVCHP_OUT_DMA_DESC_NUM 6
+#define GRVCHP_OUT_DMA_FRAME_NUM 240
+
 /*
 @brief initializes the i2s driver
 */
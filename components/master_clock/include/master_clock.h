@@ -0,0 +1,113 @@
+#ifndef MASTER_CLOCK_H_
+#define MASTER_CLOCK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "i2s_driver.h"
+
+// ticks in a beat
+#define CLOCK_PPQN 96
+
+// fractional bits of the tick length (frames in 16.16 fixed point)
+#define CLOCK_FRAC_BITS 16
+
+// tick length of a tempo, in 16.16 frames
+#define CLOCK_FRAMES_PER_TICK_Q16(bpm) ((uint32_t)((GRVCHP_SAMPLE_FREQ * 60.0 * (1 << CLOCK_FRAC_BITS)) / ((bpm) * CLOCK_PPQN) + 0.5))
+
+// tempo at boot
+#define CLOCK_DEFAULT_BPM 120.0f
+
+// modules that follow the clock
+#define CLOCK_MAX_CLIENTS 4
+
+// ticks that can fall in a block (a tick is at least 47 frames long, at 210 bpm)
+#define CLOCK_MAX_BLOCK_TICKS 8
+
+// the ticks of a block, given to the clients before it's rendered
+typedef struct {
+    uint64_t start_frame;                          // frames since the clock started, at the first frame of the block
+    uint16_t frames;                               // length of the block
+    uint64_t first_tick;                           // index of the first tick of the block
+    uint8_t tick_count;                            // ticks in the block
+    uint16_t tick_frame[CLOCK_MAX_BLOCK_TICKS];    // frame of the block of every tick
+    uint32_t frames_per_tick_q16;                  // tick length at the end of the block
+} clock_block_t;
+
+// function called by the mixer task at the start of every block, with the ticks of the block
+typedef void (*clock_client_t)(const clock_block_t *block, void *arg);
+
+// master clock struct
+typedef struct {
+    // position, only touched by the mixer
+    uint64_t frame;                 // frames since the clock started
+    uint64_t tick;                  // index of the next tick
+    uint32_t until_tick_q16;        // frames to the next tick (16.16)
+    uint32_t frames_per_tick_q16;   // current tick length (16.16), the fractional part is carried from tick to tick
+
+    // tempo ramp, one step per tick
+    uint32_t target_q16;            // tick length at the end of the ramp
+    int32_t ramp_step_q16;          // change of the tick length at every tick
+    uint32_t ramp_ticks;            // ticks left in the ramp
+
+    // tempo requested by the other tasks, picked up at the next block
+    volatile bool tempo_pending;
+    float requested_bpm;
+    uint32_t requested_ramp_ms;
+
+    clock_client_t clients[CLOCK_MAX_CLIENTS];
+    void *client_args[CLOCK_MAX_CLIENTS];
+    uint8_t client_count;
+
+    clock_block_t block;            // the ticks of the last block
+} master_clock_t;
+
+/*
+@brief function that adds a client to the clock. The clients are called in the order they subscribed.
+Must be called before the mixer starts.
+@param client the function called at every block.
+@param arg passed to the function.
+*/
+esp_err_t clock_subscribe(clock_client_t client, void *arg);
+
+/*
+@brief function that changes the tempo. The change starts on the next block and goes one tick at a time,
+so the ticks never jump.
+@param bpm new tempo.
+@param ramp_ms duration of the change, 0 to change on the next tick.
+*/
+void clock_set_bpm(float bpm, uint32_t ramp_ms);
+
+/*
+@brief getter function for the current tempo (during a ramp, the tempo reached so far).
+*/
+float clock_get_bpm(void);
+
+/*
+@brief getter function for the current tick length, in frames.
+*/
+float clock_get_frames_per_tick(void);
+
+/*
+@brief getter function for the frames since the clock started.
+*/
+uint64_t clock_get_frame(void);
+
+/*
+@brief function called by the mixer at the start of every block: it places the ticks of the block,
+steps the tempo ramp and calls the clients.
+@param frames length of the block.
+@return the ticks of the block.
+*/
+const clock_block_t *clock_advance(uint16_t frames);
+
+/*
+@brief function that finds the tick of a block that falls on a grid (a beat, a bar...) of the clock.
+@param block the ticks of the block.
+@param grid_ticks length of the grid, in ticks (CLOCK_PPQN for a beat).
+@return frame of the block of the grid point, -1 if the block has none.
+*/
+int clock_block_grid_frame(const clock_block_t *block, uint32_t grid_ticks);
+
+#endif
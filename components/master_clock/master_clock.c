@@ -0,0 +1,116 @@
+#include "master_clock.h"
+#include "esp_log.h"
+
+static const char* TAG_CLOCK = "CLOCK";
+
+static master_clock_t mclock = {
+    .frames_per_tick_q16 = CLOCK_FRAMES_PER_TICK_Q16(CLOCK_DEFAULT_BPM),
+    .target_q16 = CLOCK_FRAMES_PER_TICK_Q16(CLOCK_DEFAULT_BPM),
+};
+
+/*
+@brief starts the ramp to the tempo requested by the other tasks, if any.
+*/
+static void clock_take_tempo_request(void);
+
+esp_err_t clock_subscribe(clock_client_t client, void *arg) {
+    if (client == NULL) return ESP_ERR_INVALID_ARG;
+
+    // logging action + skip if there is no room
+    if (mclock.client_count >= CLOCK_MAX_CLIENTS) {
+        ESP_LOGE(TAG_CLOCK, "No room for another client (%d)", CLOCK_MAX_CLIENTS);
+        return ESP_ERR_NO_MEM;
+    }
+
+    mclock.client_args[mclock.client_count] = arg;
+    mclock.clients[mclock.client_count] = client;
+    mclock.client_count++;
+    return ESP_OK;
+}
+
+void clock_set_bpm(float bpm, uint32_t ramp_ms) {
+    mclock.requested_bpm = bpm;
+    mclock.requested_ramp_ms = ramp_ms;
+    __atomic_store_n(&mclock.tempo_pending, true, __ATOMIC_RELEASE);
+}
+
+float clock_get_bpm(void) {
+    uint32_t frames_per_tick_q16 = __atomic_load_n(&mclock.frames_per_tick_q16, __ATOMIC_RELAXED);
+    return (GRVCHP_SAMPLE_FREQ * 60.0f * (1 << CLOCK_FRAC_BITS)) / ((float)frames_per_tick_q16 * CLOCK_PPQN);
+}
+
+float clock_get_frames_per_tick(void) {
+    return (float)__atomic_load_n(&mclock.frames_per_tick_q16, __ATOMIC_RELAXED) / (1 << CLOCK_FRAC_BITS);
+}
+
+uint64_t clock_get_frame(void) {
+    return mclock.frame;
+}
+
+static void clock_take_tempo_request(void) {
+    if (!__atomic_exchange_n(&mclock.tempo_pending, false, __ATOMIC_ACQ_REL)) return;
+
+    uint32_t target_q16 = CLOCK_FRAMES_PER_TICK_Q16(mclock.requested_bpm);
+    uint32_t ramp_ticks = (uint64_t)mclock.requested_ramp_ms * GRVCHP_SAMPLE_FREQ * (1 << CLOCK_FRAC_BITS)
+                          / 1000 / mclock.frames_per_tick_q16;
+
+    mclock.target_q16 = target_q16;
+    if (ramp_ticks == 0) {
+        // the next tick already has the new length
+        mclock.ramp_ticks = 1;
+        mclock.ramp_step_q16 = 0;
+    } else {
+        mclock.ramp_ticks = ramp_ticks;
+        mclock.ramp_step_q16 = ((int32_t)target_q16 - (int32_t)mclock.frames_per_tick_q16) / (int32_t)ramp_ticks;
+    }
+
+    // logging action
+    ESP_LOGD(TAG_CLOCK, "Tempo to %.1f bpm in %lu ticks", mclock.requested_bpm, mclock.ramp_ticks);
+}
+
+const clock_block_t *clock_advance(uint16_t frames) {
+    clock_take_tempo_request();
+
+    clock_block_t *block = &mclock.block;
+    block->start_frame = mclock.frame;
+    block->frames = frames;
+    block->first_tick = mclock.tick;
+    block->tick_count = 0;
+
+    // the ticks are placed in 16.16 frames, so the fraction of every tick is carried to the next one
+    uint64_t end_q16 = (uint64_t)frames << CLOCK_FRAC_BITS;
+    uint64_t pos_q16 = mclock.until_tick_q16;
+    while (pos_q16 < end_q16) {
+        if (block->tick_count < CLOCK_MAX_BLOCK_TICKS) {
+            block->tick_frame[block->tick_count++] = pos_q16 >> CLOCK_FRAC_BITS;
+        }
+        mclock.tick++;
+
+        // the tempo changes between two ticks, never inside one
+        if (mclock.ramp_ticks > 0) {
+            mclock.ramp_ticks--;
+            uint32_t frames_per_tick_q16 = mclock.ramp_ticks == 0 ? mclock.target_q16
+                                                                  : mclock.frames_per_tick_q16 + mclock.ramp_step_q16;
+            __atomic_store_n(&mclock.frames_per_tick_q16, frames_per_tick_q16, __ATOMIC_RELAXED);
+        }
+        pos_q16 += mclock.frames_per_tick_q16;
+    }
+    mclock.until_tick_q16 = pos_q16 - end_q16;
+    mclock.frame += frames;
+    block->frames_per_tick_q16 = mclock.frames_per_tick_q16;
+
+    for (uint8_t i = 0; i < mclock.client_count; i++) {
+        mclock.clients[i](block, mclock.client_args[i]);
+    }
+    return block;
+}
+
+int clock_block_grid_frame(const clock_block_t *block, uint32_t grid_ticks) {
+    if (grid_ticks == 0) return -1;
+
+    // a grid point is a whole number of grids since the clock started
+    for (uint8_t i = 0; i < block->tick_count; i++) {
+        if ((block->first_tick + i) % grid_ticks == 0) return block->tick_frame[i];
+    }
+    return -1;
+}
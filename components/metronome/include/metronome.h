@@ -3,15 +3,20 @@
 
 #include "mixer.h"
 
+// a tempo change reaches the new bpm in this time, one clock tick at a time
+#define METRONOME_TEMPO_RAMP_MS 200
+
 typedef struct metronome {
     bool state; /* metronome on or off */
     float bpm; /* Beats Per Minute */
     int8_t subdivisions; /* How many mentronome clicks in a beat */
-    float samples_per_subdivision; /* How many samples are supposed to be played before the next metronome click*/
     bool playback_enabled; /* whether the metronome "click" should play or not */
     int16_t playback_ptr; /* track the playback of the metronome click */
     const unsigned char *raw_data; /* the actual metronome audio */
     wav_header_t header; /* needed to determine when to stop playback */
+    volatile uint32_t tick_count; /* index of the last click since the clock started, the grid used by the recorder */
+    int block_tick_offset; /* frame of the block being rendered on which the metronome clicks, -1 if none */
+    uint32_t block_tick_index; /* index of that click */
 } metronome;
 
 void init_metronome();
@@ -46,4 +51,10 @@ void reset_mtrn();
 
 void advance_metronome_ptr();
 
+void advance_metronome_tick();
+
+uint32_t get_metronome_tick_count();
+
+int get_metronome_block_tick();
+
 #endif
@@ -1,6 +1,7 @@
 #include "metronome.h"
 #include "metronome_sound.h"
 #include <stdio.h>
+#include "master_clock.h"
 
 #pragma region METRONOME
 
@@ -9,12 +10,18 @@ const char* TAG_MTRN = "Metronome";
 //metronome object
 static metronome mtrn;
 
+// the clicks are the clock ticks that start a subdivision
+static void metronome_on_clock(const clock_block_t *block, void *arg);
+
 void init_metronome(){
     mtrn.state = false;
     mtrn.bpm = 120.;
     mtrn.subdivisions = 1;
     mtrn.playback_enabled = false;
+    mtrn.tick_count = 0;
+    mtrn.block_tick_offset = -1;
     set_metronome_tick();
+    clock_subscribe(metronome_on_clock, NULL);
 
     mtrn.playback_ptr = 0;
     memcpy(&mtrn.header, metronome_clean_wav, WAV_HDR_SIZE);
@@ -54,13 +61,13 @@ int8_t get_metronome_subdiv(){
 }
 
 void set_metronome_tick(){
-    float new_sample_per_subdiv = GRVCHP_SAMPLE_FREQ * ((60.0 / mtrn.bpm) / mtrn.subdivisions ); 
-    ESP_LOGI(TAG_MTRN, "samples per subdivision: %f", new_sample_per_subdiv);
-    mtrn.samples_per_subdivision = new_sample_per_subdiv;
+    // the master clock keeps the time, it moves to the new tempo without losing its phase
+    clock_set_bpm(mtrn.bpm, METRONOME_TEMPO_RAMP_MS);
+    ESP_LOGI(TAG_MTRN, "samples per subdivision: %f", GRVCHP_SAMPLE_FREQ * ((60.0 / mtrn.bpm) / mtrn.subdivisions ));
 }
 
 float get_samples_per_subdiv(){
-    return mtrn.samples_per_subdivision;
+    return clock_get_frames_per_tick() * (CLOCK_PPQN / mtrn.subdivisions);
 }
 
 void set_metronome_playback(bool new_state){
@@ -87,5 +94,32 @@ void advance_metronome_ptr(){
     mtrn.playback_ptr += 2;
 }
 
+void advance_metronome_tick(){
+    mtrn.tick_count = mtrn.block_tick_index;
+}
+
+uint32_t get_metronome_tick_count(){
+    return mtrn.tick_count;
+}
+
+int get_metronome_block_tick(){
+    return mtrn.block_tick_offset;
+}
+
+static void metronome_on_clock(const clock_block_t *block, void *arg){
+    uint32_t ticks_per_subdiv = CLOCK_PPQN / mtrn.subdivisions;
+
+    // a subdivision is always longer than a block, so there's one click at most
+    mtrn.block_tick_offset = -1;
+    for (uint8_t i = 0; i < block->tick_count; i++) {
+        uint64_t tick = block->first_tick + i;
+        if (tick % ticks_per_subdiv == 0) {
+            mtrn.block_tick_offset = block->tick_frame[i];
+            mtrn.block_tick_index = tick / ticks_per_subdiv;
+            break;
+        }
+    }
+}
+
 #pragma endregion
 
@@ -0,0 +1,261 @@
+#include "bounce.h"
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "playback_mode.h"
+#include "looper.h"
+
+static const char* TAG_BOUNCE = "BOUNCE";
+
+static bounce_t bounce = {
+    .target_bank_index = -1,
+    .out_handle = ARENA_INVALID_HANDLE,
+};
+
+/*
+@brief task that renders the bounce and stores it in the target bank, then deletes itself.
+*/
+static void bounce_task(void *args);
+
+/*
+@brief takes a private copy of every voice and pins its audio.
+*/
+static void bounce_snapshot_voices(void);
+
+/*
+@brief unpins the audio of the voices.
+*/
+static void bounce_release_voices(void);
+
+/*
+@brief orders the events by frame, stops first.
+*/
+static int bounce_compare_events(const void *a, const void *b);
+
+esp_err_t bounce_events(const bounce_event_t *events, size_t count, uint32_t total_frames, int target_bank_index) {
+    if (target_bank_index < 0 || target_bank_index >= SAMPLE_NUM || count > BOUNCE_MAX_EVENTS || (count > 0 && events == NULL)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // logging action + skip if too long
+    if (total_frames == 0 || total_frames > BOUNCE_MAX_FRAMES) {
+        ESP_LOGE(TAG_BOUNCE, "Cannot bounce %lu frames, the limit is %d", total_frames, BOUNCE_MAX_FRAMES);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // logging action + skip if in wrong state
+    bool expected = false;
+    if (!__atomic_compare_exchange_n(&bounce.running, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        ESP_LOGE(TAG_BOUNCE, "A bounce is already running");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the target is written in place by the looper, it can't be replaced under it
+    if (looper_get_target() == target_bank_index) {
+        ESP_LOGE(TAG_BOUNCE, "Sample %d is being overdubbed", target_bank_index);
+        bounce.running = false;
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the events list is allocated the first time and then kept
+    if (bounce.events == NULL) {
+        bounce.events = heap_caps_malloc(BOUNCE_MAX_EVENTS * sizeof(bounce_event_t), MALLOC_CAP_SPIRAM);
+        if (bounce.events == NULL) {
+            ESP_LOGE(TAG_BOUNCE, "Cannot allocate the events list");
+            bounce.running = false;
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    size_t bytes = total_frames * sizeof(int16_t);
+    bounce.out_handle = arena_alloc(bytes, (void **)&bounce.out);
+    if (bounce.out_handle == ARENA_INVALID_HANDLE) {
+        ESP_LOGE(TAG_BOUNCE, "Cannot allocate %zu bytes for the bounce", bytes);
+        bounce.running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    arena_pin(bounce.out_handle);
+
+    if (count > 0) {
+        memcpy(bounce.events, events, count * sizeof(bounce_event_t));
+        qsort(bounce.events, count, sizeof(bounce_event_t), bounce_compare_events);
+    }
+    bounce.event_count = count;
+    bounce.total_frames = total_frames;
+    bounce.target_bank_index = target_bank_index;
+
+    bounce_snapshot_voices();
+
+    if (xTaskCreate(bounce_task, "bounce_task", BOUNCE_TASK_STACK, NULL, BOUNCE_TASK_PRIORITY, NULL) != pdPASS) {
+        ESP_LOGE(TAG_BOUNCE, "Cannot create the bounce task");
+        bounce_release_voices();
+        arena_unpin(bounce.out_handle);
+        arena_free(bounce.out_handle);
+        bounce.out_handle = ARENA_INVALID_HANDLE;
+        bounce.running = false;
+        return ESP_ERR_NO_MEM;
+    }
+
+    // logging action
+    ESP_LOGI(TAG_BOUNCE, "Bouncing %u events, %lu frames, into sample %d", count, total_frames, target_bank_index);
+    return ESP_OK;
+}
+
+esp_err_t bounce_loop_state(uint8_t bars, int target_bank_index) {
+    if (bars == 0) return ESP_ERR_INVALID_ARG;
+
+    // every voice playing now starts with the bounce
+    bounce_event_t events[SAMPLE_NUM];
+    size_t count = 0;
+    sample_bitmask playing = now_playing;
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        if ((playing & (1 << i)) != 0 && sample_bank[i] != NULL) {
+            events[count++] = (bounce_event_t){ .frame = 0, .bank_index = i, .type = BOUNCE_EVT_START };
+        }
+    }
+
+    // logging action + skip if there is nothing to bounce
+    if (count == 0) {
+        ESP_LOGW(TAG_BOUNCE, "Nothing is playing");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    float frames = (float)bars * RECORD_BEATS_PER_BAR * 60.0f / get_metronome_bpm() * GRVCHP_SAMPLE_FREQ;
+    return bounce_events(events, count, (uint32_t)(frames + 0.5f), target_bank_index);
+}
+
+bool bounce_is_running(void) {
+    return bounce.running;
+}
+
+static void bounce_snapshot_voices(void) {
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        bounce_voice_t *voice = &bounce.voices[i];
+        sample_t *smp = sample_bank[i];
+
+        voice->available = false;
+        voice->playing = false;
+        voice->handle = ARENA_INVALID_HANDLE;
+        if (smp == NULL || smp->data_handle == ARENA_INVALID_HANDLE) continue;
+
+        // the block can't move while it's read, and it's kept alive if the sample is replaced meanwhile
+        voice->handle = smp->data_handle;
+        arena_pin(voice->handle);
+
+        pb_mode_t mode = get_playback_mode(i);
+        voice->data = smp->raw_data;
+        voice->encoding = smp->encoding;
+        voice->total_frames = smp->total_frames;
+        voice->start_ptr = smp->start_ptr;
+        voice->end_ptr = smp->end_ptr;
+        voice->pitch = get_pitch_factor(i);
+        voice->volume = smp->volume;
+        voice->effects = *get_sample_effect(i);
+        voice->effects.bitcrusher.counter = 0;
+        voice->effects.bitcrusher.last_frame = 0;
+        voice->cache.block = NULL;
+        voice->available = voice->data != NULL;
+
+        if (voice->available) {
+            mixer_dsp_build_loop(voice->data, voice->encoding, voice->total_frames, (uint32_t)voice->start_ptr, voice->end_ptr,
+                                 mode == LOOP || mode == ONESHOT_LOOP, get_loop_crossfade(i), voice->xfade, &voice->cache, &voice->loop);
+        }
+    }
+}
+
+static void bounce_release_voices(void) {
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        if (bounce.voices[i].handle != ARENA_INVALID_HANDLE) {
+            arena_unpin(bounce.voices[i].handle);
+            bounce.voices[i].handle = ARENA_INVALID_HANDLE;
+        }
+        bounce.voices[i].available = false;
+    }
+}
+
+static int bounce_compare_events(const void *a, const void *b) {
+    const bounce_event_t *ea = a;
+    const bounce_event_t *eb = b;
+    if (ea->frame != eb->frame) return ea->frame < eb->frame ? -1 : 1;
+
+    // on the same frame a stop comes before a start, so a voice can be retriggered
+    return (int)eb->type - (int)ea->type;
+}
+
+static void bounce_task(void *args) {
+    int64_t render_start = esp_timer_get_time();
+    int16_t *out = (int16_t *)bounce.out;
+    size_t next_event = 0;
+
+    for (uint32_t f = 0; f < bounce.total_frames; f++) {
+        // the events of this frame
+        while (next_event < bounce.event_count && bounce.events[next_event].frame <= f) {
+            bounce_event_t *evt = &bounce.events[next_event++];
+            if (evt->bank_index >= SAMPLE_NUM) continue;
+
+            bounce_voice_t *voice = &bounce.voices[evt->bank_index];
+            if (!voice->available) continue;
+
+            voice->playing = evt->type == BOUNCE_EVT_START;
+            voice->playback_ptr = voice->start_ptr;
+        }
+
+        int32_t mixed = 0;
+
+        // same pipeline as the live mixer, on the private copies
+        for (int j = 0; j < SAMPLE_NUM; j++) {
+            bounce_voice_t *voice = &bounce.voices[j];
+            if (!voice->playing) continue;
+
+            int16_t sample_to_play = mixer_dsp_interpolate(voice->data, voice->encoding, voice->total_frames,
+                                                           voice->playback_ptr, &voice->loop, &voice->cache);
+            sample_to_play *= voice->volume;
+            apply_distortion_mono(&voice->effects.distortion, &sample_to_play);
+            apply_bitcrusher_mono(&voice->effects.bitcrusher, &sample_to_play);
+            mixed += sample_to_play;
+
+            // at the end the loop modes wrap, the others stop
+            voice->playback_ptr += voice->pitch;
+            if (voice->loop.enabled) {
+                mixer_dsp_wrap(&voice->playback_ptr, &voice->loop);
+            } else if (voice->playback_ptr > voice->end_ptr || voice->playback_ptr >= voice->total_frames) {
+                voice->playback_ptr = voice->start_ptr;
+                voice->playing = false;
+            }
+        }
+
+        if (mixed > MAX_CLIPPING) mixed = MAX_CLIPPING;
+        if (mixed < MIN_CLIPPING) mixed = MIN_CLIPPING;
+        out[f] = mixed;
+
+        // leave some time to the idle task
+        if ((f + 1) % BOUNCE_YIELD_FRAMES == 0) {
+            vTaskDelay(1);
+        }
+    }
+
+    // logging action
+    int64_t render_us = esp_timer_get_time() - render_start;
+    ESP_LOGI(TAG_BOUNCE, "Rendered %lu frames in %lld ms (%.1fx real time)", bounce.total_frames, render_us / 1000,
+             render_us > 0 ? (bounce.total_frames * 1000000.0f / GRVCHP_SAMPLE_FREQ) / render_us : 0.0f);
+
+    bounce_release_voices();
+
+    // the bounce replaces the sample of the target bank
+    if (sample_replace_audio(bounce.target_bank_index, bounce.out_handle, bounce.total_frames * sizeof(int16_t)) == ESP_OK) {
+        ESP_LOGI(TAG_BOUNCE, "Sample %d updated.", bounce.target_bank_index);
+    } else {
+        ESP_LOGE(TAG_BOUNCE, "Cannot store the bounce in bank %d", bounce.target_bank_index);
+    }
+
+    bounce.out_handle = ARENA_INVALID_HANDLE;
+    bounce.out = NULL;
+    bounce.target_bank_index = -1;
+    __atomic_store_n(&bounce.running, false, __ATOMIC_RELEASE);
+
+    vTaskDelete(NULL);
+}
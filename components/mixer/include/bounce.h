@@ -0,0 +1,97 @@
+#ifndef BOUNCE_H_
+#define BOUNCE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mixer.h"
+#include "effects.h"
+#include "mixer_dsp.h"
+#include "sample_arena.h"
+#include "recorder.h"
+
+// longest bounce, same as a recording
+#define BOUNCE_MAX_FRAMES RECORD_MAX_FRAMES
+
+// events of a single bounce
+#define BOUNCE_MAX_EVENTS 256
+
+// the render task runs below every other task, it only uses the spare CPU time
+#define BOUNCE_TASK_STACK 4096
+#define BOUNCE_TASK_PRIORITY 1
+
+// frames rendered between two yields (about a second of audio), so the idle task can feed the watchdog
+#define BOUNCE_YIELD_FRAMES 16384
+
+// what a timed event does to its voice
+typedef enum {
+    BOUNCE_EVT_START,      // (re)starts the voice from its start pointer, like a pad press
+    BOUNCE_EVT_STOP,       // stops the voice
+} bounce_event_type_t;
+
+// an event of the pattern, on the frame it happens
+typedef struct {
+    uint32_t frame;                // frame of the bounce
+    uint8_t bank_index;            // the voice
+    bounce_event_type_t type;
+} bounce_event_t;
+
+// private copy of a voice, taken when the bounce starts: the live voice keeps playing undisturbed
+typedef struct {
+    bool available;                // the bank had a sample when the bounce started
+    bool playing;
+    arena_handle_t handle;         // audio block, pinned while rendering
+    const unsigned char *data;
+    sample_encoding_t encoding;
+    uint32_t total_frames;
+    float start_ptr;
+    uint32_t end_ptr;
+    float playback_ptr;
+    float pitch;
+    float volume;
+    mixer_loop_t loop;             // loop modes wrap at the end (with their crossfade), the others stop
+    int16_t xfade[MIXER_XFADE_MAX_FRAMES];
+    effects_t effects;             // copy of the effects, with their own state
+    mixer_decode_cache_t cache;
+} bounce_voice_t;
+
+// bounce struct
+typedef struct {
+    volatile bool running;
+    int target_bank_index;
+    uint32_t total_frames;
+
+    bounce_event_t *events;        // sorted by frame, PSRAM
+    size_t event_count;
+
+    unsigned char *out;            // rendered audio, pinned while rendering
+    arena_handle_t out_handle;
+
+    bounce_voice_t voices[SAMPLE_NUM];
+} bounce_t;
+
+/*
+@brief function that renders a pattern of timed pad events into a sample, in the background and as fast as the CPU allows.
+The live mixer keeps playing meanwhile; the master volume is not applied. The sample in the target bank is replaced when done.
+@param events the events, in any order (they're copied).
+@param count number of events.
+@param total_frames length of the bounce.
+@param target_bank_index where the result is stored.
+*/
+esp_err_t bounce_events(const bounce_event_t *events, size_t count, uint32_t total_frames, int target_bank_index);
+
+/*
+@brief function that renders the voices that are playing now for some bars of the metronome, every voice starting
+from its start pointer. See bounce_events().
+@param bars length of the bounce, in bars of the metronome.
+@param target_bank_index where the result is stored.
+*/
+esp_err_t bounce_loop_state(uint8_t bars, int target_bank_index);
+
+/*
+@brief tells whether a bounce is being rendered.
+*/
+bool bounce_is_running(void);
+
+#endif
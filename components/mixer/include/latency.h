@@ -0,0 +1,72 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "driver/i2s_types.h"
+
+// measurements kept for the statistics, the oldest one is overwritten first
+#define LATENCY_HISTORY 128
+
+// bytes of a frame in the DMA buffers (16 bit mono)
+#define LATENCY_BYTES_PER_FRAME 2
+
+// statistics of the last measurements, in microseconds
+typedef struct {
+    uint32_t count;             // measurements taken into account
+    uint32_t min_us;
+    uint32_t avg_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} latency_stats_t;
+
+// latency meter struct
+typedef struct {
+    volatile bool enabled;
+
+    // the press being measured (one at a time): ISR time of the press and stream frame of the voice's first frame
+    volatile bool pending;
+    int64_t press_us;
+    uint32_t voice_frame;
+
+    // frames of the stream the DMA has finished sending (the zero-filled descriptors sent after the enable are left out)
+    volatile uint32_t sent_frames;
+
+    uint32_t history[LATENCY_HISTORY];
+    volatile uint32_t history_count;    // total measurements, the history holds the last LATENCY_HISTORY
+} latency_t;
+
+/*
+@brief function that hooks the meter to the DMA "sent" interrupt of the output channel.
+Must be called before the channel is enabled.
+@param channel the output channel.
+*/
+esp_err_t latency_attach(i2s_chan_handle_t channel);
+
+/*
+@brief function that starts or stops measuring. Starting clears the previous measurements.
+@param enabled new state.
+*/
+void latency_set_enabled(bool enabled);
+
+/*
+@brief getter function for the measurement state.
+*/
+bool latency_get_enabled(void);
+
+/*
+@brief function called by the mixer when a pad press starts a voice. Ignored while another press is being measured.
+@param press_us time of the press, taken in the pad ISR.
+@param voice_frame position in the output stream of the first frame of the voice.
+*/
+void latency_mark_voice_start(int64_t press_us, uint32_t voice_frame);
+
+/*
+@brief function that computes the statistics of the last measurements and logs them.
+@param out the statistics, count is 0 if nothing was measured.
+*/
+void latency_get_stats(latency_stats_t *out);
+
+#endif
@@ -6,6 +6,7 @@
 #include "esp_log.h"
 #include "pad_section.h"
 #include "playback_mode.h"
+#include "sample_arena.h"
 
 // Size of the wav header, must be stripped before playing
 #define WAV_HDR_SIZE 44
@@ -32,6 +33,23 @@
 #define MIN_CLIPPING -32768
 #define MAX_CHOPPING_PRECISION 5
 
+// playback events that can wait for the next block, enough for a chord on every pad plus the finish events (power of two)
+#define MIXER_EVENT_QUEUE_LEN 32
+
+// longest crossfade at the loop point (16 ms)
+#define MIXER_XFADE_MAX_FRAMES 256
+
+// fade of a choked voice, and of a voice that is muted or unmuted (4 ms)
+#define MIXER_CHOKE_FRAMES 64
+#define MIXER_MUTE_FRAMES 64
+
+// longest wait of mixer_hold() for the block boundary
+#define MIXER_HOLD_TIMEOUT_MS 200
+
+// a note repeat volume ramp reaches its end in this many hits, from (or to) this fraction of the sample volume
+#define MIXER_REPEAT_RAMP_HITS 8
+#define MIXER_REPEAT_RAMP_MIN 0.25f
+
 #pragma region TYPES
 
 // Type used to store the metadata of a WAV file
@@ -63,6 +81,16 @@ typedef struct wav_header_t
  */
 typedef uint8_t sample_bitmask; 
 
+// how the audio of a sample is stored in memory
+typedef enum {
+    SAMPLE_PCM16,   // raw 16 bit mono frames, as in the WAV file
+    SAMPLE_ADPCM    // IMA-ADPCM blocks (see adpcm.h), decoded by the mixer one block at a time
+} sample_encoding_t;
+
+// sample_t dirty flags: what differs from the copy on the SD card
+// (metadata changes are detected by sd_reader comparing them with the stored ones)
+#define SAMPLE_DIRTY_AUDIO (1 << 0)
+
 
 /**
  * @brief Sample metadata struct
@@ -73,6 +101,8 @@ typedef uint8_t sample_bitmask;
 typedef struct sample_t
 {
     unsigned char *raw_data; /** raw sample bytes */
+    sample_encoding_t encoding; /** format of raw_data, the header always describes the PCM audio */
+    arena_handle_t data_handle; /** arena block holding raw_data (raw_data is NULL while the block is moved) */
     wav_header_t header; /** contains sample metadata like size and bit rate */
     uint32_t total_frames; /* frame number (data size / 2)*/
     float playback_ptr; /** progress indicator for the sample */
@@ -82,12 +112,30 @@ typedef struct sample_t
     int bank_index;
     bool playback_finished;
     float volume;
+    uint8_t dirty; /** SAMPLE_DIRTY_* flags, cleared when the sample is saved */
 
 } sample_t;
 
+// a playback event waiting for the mixer
+typedef struct {
+    int64_t timestamp_us;           // when the pad changed level, 0 to play it at the start of the next block
+    uint32_t frame;                 // frame of the block it's played on, set by the mixer
+    uint8_t bank_index;
+    enum evt_type_t event_type;
+} mixer_event_t;
+
+// slot of the event ring, see mixer_post_event()
+typedef struct {
+    volatile uint32_t turn;
+    mixer_event_t event;
+} mixer_event_slot_t;
+
 // all samples that can be played
 extern sample_t* sample_bank[SAMPLE_NUM];
 
+// samples currently playing, one bit per bank index
+extern sample_bitmask now_playing;
+
 #pragma endregion
 
 //Sample actions
@@ -95,7 +143,52 @@ void action_start_sample(int);
 void action_start_or_stop_sample(int);
 void action_stop_sample(int);
 void action_restart_sample(int);
+void action_choke_sample(int);
 void action_ignore(int);
+
+/*
+@brief starts or stops a loop sample on the next point of its launch grid (see set_launch_quantize()), on the exact frame.
+Asking for the state the sample is already in cancels a launch still waiting. Called by the mixer task only.
+@param bank_index index of the sample.
+@param play true to start it from its start pointer, false to stop it.
+*/
+void mixer_launch_sample(int bank_index, bool play);
+
+/*
+@brief getter function for the state of a sample after the launch it is waiting for, if any.
+@param bank_index index of the sample.
+*/
+bool mixer_get_launch_state(int bank_index);
+
+/*
+@brief tells the mixer that the audio of a bank changed, in place or with a new block: the loop crossfade and
+the decoded block are rebuilt at the next block boundary.
+@param bank_index index of the sample.
+*/
+void mixer_audio_changed(int bank_index);
+
+/*
+@brief starts or stops the note repeat of a held sample: while held, the mixer restarts it on the grid of its
+repeat rate (see set_note_repeat()), on the exact frame. Called by the mixer task only.
+@param bank_index index of the sample.
+@param held true on the press, false on the release.
+*/
+void mixer_repeat_sample(int bank_index, bool held);
+
+/*
+@brief hands a playback event to the mixer, which runs the handler of the sample mode on the frame of the next
+block matching the time of the event. Every pad event gets the same latency (one block), instead of up to a block
+of jitter. Lock-free and safe from ISRs and from any task; returns false (and counts it) if the ring is full.
+@param bank_index index of the sample.
+@param event_type the event.
+@param timestamp_us time of the event, from esp_timer_get_time(), or 0 for the start of the next block.
+*/
+bool mixer_post_event(uint8_t bank_index, enum evt_type_t event_type, int64_t timestamp_us);
+
+/*
+@brief getter function for the number of events dropped because the ring was full.
+*/
+uint32_t mixer_get_dropped_events(void);
 //chopping
 bool set_sample_end_ptr(uint8_t, uint32_t);
 bool set_sample_start_ptr(uint8_t, float);
@@ -105,6 +198,32 @@ uint32_t get_sample_total_frames(uint8_t bank_index);
 uint8_t get_chopping_precision();
 void set_chopping_precision(uint8_t precision);
 
+// storage
+/*
+@brief converts the audio of a sample between PCM and ADPCM. The sample must not be playing.
+@param bank_index index of the sample.
+@param encoding the new storage format.
+*/
+esp_err_t set_sample_encoding(uint8_t bank_index, sample_encoding_t encoding);
+sample_encoding_t get_sample_encoding(uint8_t bank_index);
+
+/*
+@brief sets the crossfade at the loop point of a sample (loop modes only), 0 for a plain wrap.
+@param bank_index index of the sample.
+@param frames crossfade length, up to MIXER_XFADE_MAX_FRAMES.
+*/
+void set_loop_crossfade(uint8_t bank_index, uint16_t frames);
+uint16_t get_loop_crossfade(uint8_t bank_index);
+
+/*
+@brief gives new PCM audio to a sample, creating the sample if the bank is empty. The old audio is freed
+and the sample starts over with default settings. The engine is held during the swap, so it must not be called from the mixer task.
+@param bank_index index of the sample.
+@param new_handle pinned arena block with the audio, owned by the sample afterwards (freed on error).
+@param bytes size of the audio.
+*/
+esp_err_t sample_replace_audio(int bank_index, arena_handle_t new_handle, size_t bytes);
+
 // volume
 void set_volume(uint8_t, float);
 float get_volume(uint8_t);
@@ -126,6 +245,32 @@ float get_metronome_bpm();
 
 void create_mixer(i2s_chan_handle_t channel);
 
+/*
+@brief tells whether the engine is silent: no voice is playing and nothing is being recorded.
+*/
+bool mixer_is_idle(void);
+
+/*
+@brief holds the engine at the next block boundary and waits for it: until mixer_release() no voice starts
+(the pad events stay queued and are played late, the sequencer steps are dropped), so the audio of the voices
+that are not playing can be moved, replaced or freed. The voices already playing keep going. Holds can nest.
+Must not be called from the mixer task.
+@return false if the mixer didn't reach the boundary in MIXER_HOLD_TIMEOUT_MS, the engine is not held.
+*/
+bool mixer_hold(void);
+
+/*
+@brief ends a hold taken with mixer_hold().
+*/
+void mixer_release(void);
+
+/*
+@brief waits for the next block boundary: after it the mixer doesn't use any sample pointer it read before the call,
+so a sample taken out of sample_bank (or a voice stopped) can be freed. Must not be called from the mixer task.
+@return false if the mixer didn't reach the boundary in MIXER_HOLD_TIMEOUT_MS.
+*/
+bool mixer_sync(void);
+
 void sample_init (sample_t* in_sample, int size, int bank_index);
 
 #endif
@@ -0,0 +1,241 @@
+/*********************************************************************************
+ *                                   MIXER DSP                                   *
+ *     Per-voice kernels shared by the live mixer and the offline renderer:      *
+ *       frame reading (PCM or ADPCM), interpolation and voice effects.          *
+ *    They only touch the state they are given, so a voice rendered offline      *
+ *                  never disturbs the one playing live.                         *
+ *********************************************************************************/
+#ifndef MIXER_DSP_H_
+#define MIXER_DSP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "mixer.h"
+#include "effects.h"
+#include "adpcm.h"
+
+// decoded ADPCM block of a voice, so a block is decoded only when the voice moves into it
+typedef struct {
+    int16_t scratch[ADPCM_BLOCK_FRAMES];   // decoded frames
+    const unsigned char *block;            // encoded block held by scratch, NULL if none
+} mixer_decode_cache_t;
+
+// loop region of a voice, rebuilt when the pointers, the audio or the crossfade change
+typedef struct {
+    bool enabled;               // the voice wraps at end (loop modes)
+    uint32_t start;             // first frame of the loop
+    uint32_t end;               // frame after the last one
+    const int16_t *xfade;       // precomputed crossfade frames, read instead of the audio
+    uint32_t xfade_start;       // first frame replaced by xfade
+    uint32_t xfade_len;         // 0 if there is no crossfade
+} mixer_loop_t;
+
+/*
+@brief reads a single frame of a sample, decoding the containing block if the sample is compressed.
+@param data audio of the sample.
+@param encoding format of data.
+@param frame index of the frame.
+@param cache decode cache of the voice.
+*/
+static inline int16_t mixer_dsp_read_frame(const unsigned char *data, sample_encoding_t encoding, uint32_t frame, mixer_decode_cache_t *cache) {
+    if (encoding == SAMPLE_PCM16) {
+        return ((const int16_t*)data)[frame];
+    }
+
+    uint32_t offset = frame % ADPCM_BLOCK_FRAMES;
+    const unsigned char *block = data + (frame / ADPCM_BLOCK_FRAMES) * ADPCM_BLOCK_BYTES;
+
+    // the first frame of every block is stored verbatim, no need to decode
+    if (offset == 0) {
+        return adpcm_block_first_frame(block);
+    }
+
+    // decode the whole block only when the voice moves into it
+    if (cache->block != block) {
+        adpcm_decode_block(block, cache->scratch);
+        cache->block = block;
+    }
+    return cache->scratch[offset];
+}
+
+/*
+@brief reads a frame of a voice, taking it from the crossfade when it falls in it.
+*/
+static inline int16_t mixer_dsp_read_loop_frame(const unsigned char *data, sample_encoding_t encoding, uint32_t frame,
+                                                const mixer_loop_t *loop, mixer_decode_cache_t *cache) {
+    if (frame - loop->xfade_start < loop->xfade_len) {
+        return loop->xfade[frame - loop->xfade_start];
+    }
+    return mixer_dsp_read_frame(data, encoding, frame, cache);
+}
+
+/*
+@brief reads a sample at a fractional position, interpolating between the two nearest frames.
+@param data audio of the sample.
+@param encoding format of data.
+@param total_frames frames of the sample.
+@param pos playback position.
+@param loop loop region: with the loop enabled, the frame after the end is the start of the loop.
+@param cache decode cache of the voice.
+*/
+static inline int16_t mixer_dsp_interpolate(const unsigned char *data, sample_encoding_t encoding, uint32_t total_frames,
+                                            float pos, const mixer_loop_t *loop, mixer_decode_cache_t *cache) {
+    //first frame
+    uint32_t frame_a = (uint32_t)pos;
+    float frac = pos - frame_a;
+
+    //second frame
+    uint32_t frame_b = frame_a + 1;
+
+    //loop handling
+    if (loop->enabled && frame_b >= loop->end) {
+        frame_b = loop->start;
+    } else if (frame_b >= total_frames) {
+        frame_b = frame_a;
+    }
+
+    //interpolation
+    float la = mixer_dsp_read_loop_frame(data, encoding, frame_a, loop, cache);
+    float lb = mixer_dsp_read_loop_frame(data, encoding, frame_b, loop, cache);
+    return la * (1.0f - frac) + lb * frac;
+}
+
+/*
+@brief moves the playback position of a looping voice back into the loop, keeping the fractional part.
+@return false if the voice doesn't loop and is past the end.
+*/
+static inline bool mixer_dsp_wrap(float *pos, const mixer_loop_t *loop) {
+    if (*pos < loop->end) return true;
+    if (!loop->enabled || loop->end <= loop->start) return false;
+
+    float length = loop->end - loop->start;
+    *pos -= length;
+
+    // very high pitch, more than a whole loop per frame
+    if (*pos >= loop->end) {
+        *pos = loop->start + fmodf(*pos - loop->start, length);
+    }
+    return true;
+}
+
+/*
+@brief computes the loop region of a voice and its crossfade. The crossfade blends the last frames of the loop
+into the audio before the start or, if the loop starts too early, the first frames into the audio after the end,
+so the loop keeps its length. Without room on either side there is no crossfade.
+@param data audio of the sample.
+@param encoding format of data.
+@param total_frames frames of the sample.
+@param start first frame of the loop.
+@param end_ptr last frame of the loop.
+@param enabled the voice loops.
+@param xfade_frames requested crossfade length.
+@param xfade_buf room for MIXER_XFADE_MAX_FRAMES frames.
+@param cache decode cache of the voice.
+@param loop the result.
+*/
+static inline void mixer_dsp_build_loop(const unsigned char *data, sample_encoding_t encoding, uint32_t total_frames,
+                                        uint32_t start, uint32_t end_ptr, bool enabled, uint32_t xfade_frames,
+                                        int16_t *xfade_buf, mixer_decode_cache_t *cache, mixer_loop_t *loop) {
+    loop->enabled = enabled;
+    loop->start = start;
+    loop->end = end_ptr + 1 < total_frames ? end_ptr + 1 : total_frames;
+    loop->xfade = xfade_buf;
+    loop->xfade_start = 0;
+    loop->xfade_len = 0;
+
+    if (!enabled || xfade_frames == 0 || loop->end <= loop->start) return;
+
+    uint32_t n = xfade_frames;
+    if (n > MIXER_XFADE_MAX_FRAMES) n = MIXER_XFADE_MAX_FRAMES;
+    if (n > (loop->end - loop->start) / 2) n = (loop->end - loop->start) / 2;
+    if (n == 0) return;
+
+    if (start >= n) {
+        // the tail fades into what comes before the start, the wrap then continues it
+        uint32_t tail = loop->end - n;
+        for (uint32_t k = 0; k < n; k++) {
+            float g = (float)(k + 1) / (n + 1);
+            float out = mixer_dsp_read_frame(data, encoding, tail + k, cache) * (1.0f - g)
+                      + mixer_dsp_read_frame(data, encoding, start - n + k, cache) * g;
+            xfade_buf[k] = (int16_t)out;
+        }
+        loop->xfade_start = tail;
+    } else if (total_frames - loop->end >= n) {
+        // the head fades in from what comes after the end, which continues the tail
+        for (uint32_t k = 0; k < n; k++) {
+            float g = (float)(k + 1) / (n + 1);
+            float out = mixer_dsp_read_frame(data, encoding, start + k, cache) * g
+                      + mixer_dsp_read_frame(data, encoding, loop->end + k, cache) * (1.0f - g);
+            xfade_buf[k] = (int16_t)out;
+        }
+        loop->xfade_start = start;
+    } else {
+        return;
+    }
+    loop->xfade_len = n;
+}
+
+/*
+@brief apply the bit crusher effect to the audio bufer.
+@param bc bit crusher parameters.
+@param out audio buffer where the effect will be applied.
+*/
+static inline void apply_bitcrusher_mono(bitcrusher_params_t* bc, int16_t *out) {
+
+    if(!bc->enabled) return; //exit if the effect is not enabled
+
+    // DOWNSAMPLING (reduce sample_rate)
+    bc->counter++;
+
+    // if the counter is less than the downsample value, repeat the same value as before
+    if (bc->counter < bc->downsample) {
+        *out = bc->last_frame;
+        return;
+    }
+
+    // update the sample
+    bc->counter = 0;
+
+    // BIT CRUSHING (reduce "resolution")
+    if (bc->bit_depth < 16) {
+        // how much bit do we need to "cut"
+        int shift_amount = 16 - bc->bit_depth;
+
+        // left shift in order to set to zero least significant bits, and right shift to bring the other bits back
+        *out = (*out >> shift_amount) << shift_amount;
+    }
+
+    // update last sample
+    bc->last_frame = *out;
+}
+
+/*
+@brief apply the distrotion effect to the audio bufer.
+@param dst_params distortion parameters.
+@param out audio buffer where the effect will be applied.
+*/
+static inline void apply_distortion_mono(distortion_params_t* dst_params, int16_t *out){
+
+    if(dst_params == NULL) return;
+    if(!dst_params->enabled) return;
+
+    //calculate gain
+    int32_t temp = *out * dst_params->gain;
+
+    temp = (int16_t)temp;
+
+    //calculate threshold
+    int16_t threshold = dst_params->threshold;
+
+    if(temp > threshold){
+        temp = threshold;
+    }
+    else if(temp < -threshold){
+        temp = -threshold;
+    }
+
+    *out = temp;
+}
+
+#endif
@@ -0,0 +1,123 @@
+#include "latency.h"
+#include <stdlib.h>
+#include <string.h>
+#include "driver/i2s_std.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "mixer.h"
+#include "i2s_driver.h"
+
+static const char* TAG_LAT = "LATENCY";
+
+static latency_t latency = { 0 };
+
+/*
+@brief DMA interrupt: a buffer went out on the wire. The press being measured is done when the voice's first frame is out.
+*/
+static bool IRAM_ATTR latency_on_sent(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx);
+
+/*
+@brief DMA interrupt: a buffer was sent again because nothing new was written (underflow), its frames are not part of the stream.
+*/
+static bool IRAM_ATTR latency_on_send_q_ovf(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx);
+
+/*
+@brief orders the measurements, for the percentile.
+*/
+static int latency_compare(const void *a, const void *b);
+
+esp_err_t latency_attach(i2s_chan_handle_t channel) {
+    // after the enable the DMA sends every descriptor once, zero-filled, before the first write comes out:
+    // those frames are not part of the stream
+    latency.sent_frames = -(GRVCHP_OUT_DMA_DESC_NUM * GRVCHP_OUT_DMA_FRAME_NUM);
+
+    i2s_event_callbacks_t callbacks = {
+        .on_sent = latency_on_sent,
+        .on_send_q_ovf = latency_on_send_q_ovf,
+    };
+    return i2s_channel_register_event_callback(channel, &callbacks, NULL);
+}
+
+void latency_set_enabled(bool enabled) {
+    if (enabled && !latency.enabled) {
+        latency.pending = false;
+        latency.history_count = 0;
+    }
+    latency.enabled = enabled;
+
+    // logging action
+    ESP_LOGI(TAG_LAT, "Latency measurement %s", enabled ? "started" : "stopped");
+}
+
+bool latency_get_enabled(void) {
+    return latency.enabled;
+}
+
+void latency_mark_voice_start(int64_t press_us, uint32_t voice_frame) {
+    if (!latency.enabled || __atomic_load_n(&latency.pending, __ATOMIC_ACQUIRE)) return;
+
+    latency.press_us = press_us;
+    latency.voice_frame = voice_frame;
+    __atomic_store_n(&latency.pending, true, __ATOMIC_RELEASE);
+}
+
+static bool IRAM_ATTR latency_on_sent(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
+    uint32_t sent = latency.sent_frames + event->size / LATENCY_BYTES_PER_FRAME;
+    latency.sent_frames = sent;
+
+    if (!__atomic_load_n(&latency.pending, __ATOMIC_ACQUIRE)) return false;
+
+    // the counters wrap, compare the distance
+    if ((int32_t)(sent - latency.voice_frame) > 0) {
+        latency.history[latency.history_count % LATENCY_HISTORY] = (uint32_t)(esp_timer_get_time() - latency.press_us);
+        latency.history_count++;
+        __atomic_store_n(&latency.pending, false, __ATOMIC_RELEASE);
+    }
+    return false;
+}
+
+static bool IRAM_ATTR latency_on_send_q_ovf(i2s_chan_handle_t handle, i2s_event_data_t *event, void *user_ctx) {
+    latency.sent_frames -= event->size / LATENCY_BYTES_PER_FRAME;
+    return false;
+}
+
+static int latency_compare(const void *a, const void *b) {
+    uint32_t va = *(const uint32_t *)a;
+    uint32_t vb = *(const uint32_t *)b;
+    return va < vb ? -1 : (va > vb ? 1 : 0);
+}
+
+void latency_get_stats(latency_stats_t *out) {
+    memset(out, 0, sizeof(*out));
+
+    // logging action
+    ESP_LOGI(TAG_LAT, "%lu playback events dropped (event ring full)", mixer_get_dropped_events());
+
+    uint32_t total = latency.history_count;
+    uint32_t count = total < LATENCY_HISTORY ? total : LATENCY_HISTORY;
+    if (count == 0) {
+        ESP_LOGI(TAG_LAT, "No press measured yet");
+        return;
+    }
+
+    // copy, so the interrupt can keep adding measurements
+    uint32_t sorted[LATENCY_HISTORY];
+    memcpy(sorted, latency.history, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), latency_compare);
+
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        sum += sorted[i];
+    }
+
+    out->count = count;
+    out->min_us = sorted[0];
+    out->avg_us = sum / count;
+    out->p99_us = sorted[(count * 99 + 99) / 100 - 1];
+    out->max_us = sorted[count - 1];
+
+    // logging action
+    ESP_LOGI(TAG_LAT, "%lu presses: min %lu us, avg %lu us, p99 %lu us, max %lu us",
+             out->count, out->min_us, out->avg_us, out->p99_us, out->max_us);
+}
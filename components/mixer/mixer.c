@@ -1,6 +1,7 @@
 #include "mixer.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include "esp_heap_caps.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "driver/i2s_std.h"
@@ -12,8 +13,17 @@
 #include "effects.h"
 #include "esp_log.h"
 #include "recorder.h"
+#include "looper.h"
 #include "fsm.h"
 #include "sd_reader.h"
+#include "adpcm.h"
+#include "mixer_dsp.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "latency.h"
+#include "sequencer.h"
+#include "master_clock.h"
+#include <math.h>
 
 static const char* TAG = "Mixer";
 
@@ -28,87 +38,156 @@ sample_t* sample_bank[SAMPLE_NUM];
 // volume of master buffer
 float volume = 0.5f;
 
-#pragma region Apply fuctions
-/*
-@brief apply the bit crusher effect to the audio bufer.
-@param bc bit crusher parameters.
-@param out audio buffer where the effect will be applied.
-*/
-static inline void apply_bitcrusher_mono(bitcrusher_params_t* bc, int16_t *out) {
+// per-voice decode caches for compressed samples (static, so they live in internal RAM)
+static mixer_decode_cache_t decode_cache[SAMPLE_NUM];
 
-    if(!bc->enabled) return; //exit if the effect is not enabled
+// audio of every voice, read once per block so it can't change under a voice in the middle of it
+static const unsigned char *voice_data[SAMPLE_NUM];
 
-    // DOWNSAMPLING (reduce sample_rate)
-    bc->counter++;
+// engine hold: the holders, the last hold asked for and the last one the mixer saw at a block boundary
+static volatile uint32_t hold_count = 0;
+static volatile uint32_t hold_seq = 0;
+static volatile uint32_t hold_ack = 0;
+static TaskHandle_t mixer_task_handle = NULL;
 
-    // if the counter is less than the downsample value, repeat the same value as before
-    if (bc->counter < bc->downsample) {
-        *out = bc->last_frame;
-        return;
-    }
+// loop region of every voice, with its crossfade (rebuilt by the mixer at the block boundary)
+static mixer_loop_t voice_loop[SAMPLE_NUM];
+static int16_t voice_xfade[SAMPLE_NUM][MIXER_XFADE_MAX_FRAMES];
 
-    // update the sample
-    bc->counter = 0;
+// crossfade length requested for every bank, in frames
+static uint16_t loop_xfade_frames[SAMPLE_NUM] = {0};
 
-    // BIT CRUSHING (reduce "resolution")
-    if (bc->bit_depth < 16) {
-        // how much bit do we need to "cut"
-        int shift_amount = 16 - bc->bit_depth;
+// bumped every time the audio of a bank changes (in place or with a new block), see mixer_audio_changed()
+static volatile uint32_t audio_gen[SAMPLE_NUM] = {0};
 
-        // left shift in order to set to zero least significant bits, and right shift to bring the other bits back
-        *out = (*out >> shift_amount) << shift_amount;
-    }
+// what the loop region of a voice was built from
+typedef struct {
+    const unsigned char *data;
+    sample_encoding_t encoding;
+    uint32_t start;
+    uint32_t end_ptr;
+    uint16_t xfade_frames;
+    bool enabled;
+    uint32_t audio_gen;
+} mixer_loop_key_t;
+static mixer_loop_key_t voice_loop_key[SAMPLE_NUM];
 
-    // update last sample
-    bc->last_frame = *out;
-}
+/*
+@brief rebuilds the loop region of a voice if its pointers, audio, mode or crossfade changed.
+@param bank_index index of the sample.
+@param force rebuild anyway (the audio was changed in place).
+*/
+static void mixer_update_loop(int bank_index, bool force);
+
+// parameter locks of the last sequencer step of every voice, dropped when the pad is played by hand
+static float voice_pitch_lock[SAMPLE_NUM];    // pitch multiplier, 1 if not locked
+static float voice_volume_lock[SAMPLE_NUM];   // volume, negative if not locked
+
+// choke fade of every voice (1 = not choked), bit n: voice n is fading out, it stops at the end of the fade
+static float voice_choke_gain[SAMPLE_NUM];
+static sample_bitmask voice_choking = 0;
+
+// mute fade of every voice, it moves toward the target of its mute group (read at every block)
+static float voice_mute_gain[SAMPLE_NUM];
+static float voice_mute_target[SAMPLE_NUM];
+
+// bit n: voice n starts or stops on its next launch grid point, bit n of voice_launch_play tells which
+static sample_bitmask voice_launch_pending = 0;
+static sample_bitmask voice_launch_play = 0;
+
+// length of every note repeat rate (note_repeat_t), in clock ticks
+static const uint8_t repeat_ticks[] = {
+    0,                  // REPEAT_OFF
+    CLOCK_PPQN / 2,     // REPEAT_8TH
+    CLOCK_PPQN / 4,     // REPEAT_16TH
+    CLOCK_PPQN / 8,     // REPEAT_32ND
+    CLOCK_PPQN / 3,     // REPEAT_8TH_TRIPLET
+    CLOCK_PPQN / 6,     // REPEAT_16TH_TRIPLET
+};
+
+// bit n: voice n is held with note repeat on, retriggered on its repeat grid
+static sample_bitmask voice_repeat_held = 0;
+static uint8_t voice_repeat_hits[SAMPLE_NUM];       // hits since the press (0 = the press), for the volume ramp
+static uint32_t voice_repeat_press[SAMPLE_NUM];     // frame of the press
+static int voice_repeat_frame[SAMPLE_NUM];          // frame of the block on which the voice repeats, -1 if none
 
 /*
-@brief apply the distrotion effect to the audio bufer.
-@param dst_params distortion parameters.
-@param out audio buffer where the effect will be applied.
+@brief sets the volume of a note repeat hit, following the ramp of the sample.
+@param bank_index index of the sample.
 */
-static inline void apply_distortion_mono(distortion_params_t* dst_params, int16_t *out){
+static void mixer_apply_repeat_ramp(int bank_index);
 
-    if(dst_params == NULL) return;
-    if(!dst_params->enabled) return;
+/*
+@brief restarts a held voice on its repeat grid.
+@param bank_index index of the sample.
+*/
+static void mixer_fire_repeat(int bank_index);
 
-    //calculate gain
-    int32_t temp = *out * dst_params->gain;
+/*
+@brief starts or stops a voice waiting for its launch grid point.
+@param bank_index index of the sample.
+*/
+static void mixer_fire_launch(int bank_index);
+
+/*
+@brief a voice that (re)starts is not being choked anymore.
+@param bank_index index of the sample.
+*/
+static void mixer_cancel_choke(int bank_index);
 
-    temp = (int16_t)temp;
+/*
+@brief steps the choke and mute fades of a voice by a frame.
+@param bank_index index of the sample.
+@return the gain of the voice for the frame.
+*/
+static inline float mixer_step_fades(int bank_index);
 
-    //calculate threshold
-    int16_t threshold = dst_params->threshold;
+/*
+@brief restarts the voice of a sequencer step, with the locks of the step.
+@param trigger the step.
+*/
+static void mixer_fire_trigger(const seq_trigger_t *trigger);
 
-    if(temp > threshold){
-        temp = threshold;
-    }
-    else if(temp < -threshold){
-        temp = -threshold;
-    }
+// playback events for the mixer: many producers (pad ISR, mixer), one consumer (mixer)
+static mixer_event_slot_t event_ring[MIXER_EVENT_QUEUE_LEN];
+static volatile uint32_t event_head = 0;
+static uint32_t event_tail = 0;
 
-    *out = temp;
-} 
+// events dropped because the ring was full
+static volatile uint32_t event_overflows = 0;
 
-#pragma endregion
+/*
+@brief takes the events out of the ring and places each one on a frame of the block about to be rendered,
+at the same distance from the block start as the event from the start of the previous block (events without
+a timestamp go on the first frame).
+@param out the events of the block, ordered by frame.
+@param max size of out, the events past it stay in the ring for the next block.
+@param prev_block_us start time of the previous block.
+@param block_us start time of this block.
+*/
+static size_t mixer_collect_events(mixer_event_t *out, size_t max, int64_t prev_block_us, int64_t block_us);
 
 #pragma region SAMPLE_ACTION
 
+// the actions run in the mixer task, on the frame of their event, and from the menus (i.e. a sample is replaced),
+// so the bitmask is changed atomically and they only log at debug level
+
 void action_start_or_stop_sample(int bank_index){
 
     if (g_recorder.state == REC_WAITING_PAD){
         return;
     }
 
-    ESP_LOGI(TAG, "play/pause event was triggered from %i\n", bank_index);
+    ESP_LOGD(TAG, "play/pause event was triggered from %i", bank_index);
     if(sample_bank[bank_index] != NULL){
         //either stop or play the sample
-        now_playing ^= (1 << bank_index);
+        sample_bitmask prev = __atomic_fetch_xor(&now_playing, 1 << bank_index, __ATOMIC_RELAXED);
         //reset the playback pointer if the sample was stopped
-        if ((now_playing & (1 << bank_index)) == 0){
+        if ((prev & (1 << bank_index)) != 0){
             sample_bank[bank_index]->playback_ptr = sample_bank[bank_index]->start_ptr;
             sample_bank[bank_index]->playback_finished = false;
+        } else {
+            mixer_cancel_choke(bank_index);
         }
     } else {
         ESP_LOGW(TAG, "sample %i is set to NULL!", bank_index);
@@ -121,20 +200,21 @@ void action_start_sample(int bank_index){
         return;
     }
 
-    printf("play event was triggered from %i\n", bank_index);
+    ESP_LOGD(TAG, "play event was triggered from %i", bank_index);
     if(sample_bank[bank_index] != NULL){
 	    //add the sample from the nowplaying bitmask
-        now_playing |= (1 << bank_index);
+        __atomic_fetch_or(&now_playing, 1 << bank_index, __ATOMIC_RELAXED);
+        mixer_cancel_choke(bank_index);
     } else {
         ESP_LOGW(TAG, "sample %i is set to NULL!", bank_index);
     }
 }
 
 void action_stop_sample(int bank_index){
-    printf("pause event was triggered from %i\n", bank_index);
+    ESP_LOGD(TAG, "pause event was triggered from %i", bank_index);
     if(sample_bank[bank_index] != NULL){
         //remove the sample from the nowplaying bitmask
-        now_playing &= ~(1 << bank_index);
+        __atomic_fetch_and(&now_playing, ~(1 << bank_index), __ATOMIC_RELAXED);
         //reset the playback pointer to the start value
         sample_bank[bank_index]->playback_ptr = sample_bank[bank_index]->start_ptr;
         //set the playing state to "not finished" (for future iterations)
@@ -145,10 +225,11 @@ void action_stop_sample(int bank_index){
 }
 
 void action_restart_sample(int bank_index){
-    printf("restart event was triggered from %i\n", bank_index);
+    ESP_LOGD(TAG, "restart event was triggered from %i", bank_index);
     if(sample_bank[bank_index] != NULL){
         //add the sample to the nowplaying bitmask
-        now_playing |= (1 << bank_index);
+        __atomic_fetch_or(&now_playing, 1 << bank_index, __ATOMIC_RELAXED);
+        mixer_cancel_choke(bank_index);
         //reset the playback pointer to the start value
         sample_bank[bank_index]->playback_ptr = sample_bank[bank_index]->start_ptr;
         //set the playing state to "not finished" (for future iterations)
@@ -158,41 +239,245 @@ void action_restart_sample(int bank_index){
     }
 }
 
+void action_choke_sample(int bank_index){
+    ESP_LOGD(TAG, "choke event was triggered from %i", bank_index);
+    if(sample_bank[bank_index] != NULL && (now_playing & (1 << bank_index)) != 0){
+        // the voice fades out in the render loop, and stops at the end of the fade
+        voice_choking |= 1 << bank_index;
+    }
+}
+
 void action_ignore(int pad_id){
 	// nothing
 }
 
-#pragma endregion
+void mixer_launch_sample(int bank_index, bool play){
+    if(sample_bank[bank_index] == NULL) return;
 
+    sample_bitmask bit = 1 << bank_index;
+    bool playing = (now_playing & bit) != 0;
+    if(play == playing){
+        // back to the state it's in, nothing to launch
+        voice_launch_pending &= ~bit;
+    } else {
+        voice_launch_pending |= bit;
+        voice_launch_play = play ? voice_launch_play | bit : voice_launch_play & ~bit;
+    }
+}
 
-static inline void get_sample_interpolated_mono(sample_t *smp, int16_t *out, uint32_t total_frames) {
-    float pos = smp->playback_ptr;
+bool mixer_get_launch_state(int bank_index){
+    sample_bitmask bit = 1 << bank_index;
+    if((voice_launch_pending & bit) != 0) return (voice_launch_play & bit) != 0;
+    return (now_playing & bit) != 0;
+}
 
-    //first frame
-    int frame_a = (int)pos;    
-    float frac = pos - frame_a; 
+static void mixer_fire_launch(int bank_index){
+    voice_launch_pending &= ~(1 << bank_index);
+    if((voice_launch_play & (1 << bank_index)) != 0){
+        action_restart_sample(bank_index);
+        playback_choke(bank_index);
+    } else {
+        action_stop_sample(bank_index);
+    }
+}
 
-    //second frame 
-    int frame_b = frame_a + 1;
-    
-    //loop handling
-    if (frame_b >= total_frames) {
-        pb_mode_t playback_mode = get_playback_mode(smp->bank_index);
-        if (playback_mode == LOOP || playback_mode == ONESHOT_LOOP) {
-            frame_b = 0; //return to first sample
+void mixer_repeat_sample(int bank_index, bool held){
+    if(!held){
+        voice_repeat_held &= ~(1 << bank_index);
+        return;
+    }
+    if(g_recorder.state == REC_WAITING_PAD || sample_bank[bank_index] == NULL) return;
+
+    voice_repeat_held |= 1 << bank_index;
+    voice_repeat_hits[bank_index] = 0;
+    // the press is the first hit of the ramp
+    mixer_apply_repeat_ramp(bank_index);
+}
+
+static void mixer_apply_repeat_ramp(int bank_index){
+    repeat_ramp_t ramp = get_repeat_ramp(bank_index);
+    if(ramp == REPEAT_RAMP_OFF || sample_bank[bank_index] == NULL) return;
+
+    // position in the ramp, it stays at the end after the last hit
+    uint8_t hit = voice_repeat_hits[bank_index] < MIXER_REPEAT_RAMP_HITS - 1 ? voice_repeat_hits[bank_index] : MIXER_REPEAT_RAMP_HITS - 1;
+    float pos = (float)hit / (MIXER_REPEAT_RAMP_HITS - 1);
+    if(ramp == REPEAT_RAMP_DOWN) pos = 1.0f - pos;
+
+    voice_volume_lock[bank_index] = sample_bank[bank_index]->volume * (MIXER_REPEAT_RAMP_MIN + (1.0f - MIXER_REPEAT_RAMP_MIN) * pos);
+}
+
+static void mixer_fire_repeat(int bank_index){
+    if(voice_repeat_hits[bank_index] < UINT8_MAX) voice_repeat_hits[bank_index]++;
+
+    action_restart_sample(bank_index);
+    mixer_apply_repeat_ramp(bank_index);
+    playback_choke(bank_index);
+}
+
+static void mixer_cancel_choke(int bank_index){
+    voice_choking &= ~(1 << bank_index);
+    voice_choke_gain[bank_index] = 1.0f;
+}
+
+static inline float mixer_step_fades(int bank_index){
+    float mute = voice_mute_gain[bank_index];
+    float target = voice_mute_target[bank_index];
+    if (mute < target) {
+        mute += 1.0f / MIXER_MUTE_FRAMES;
+        if (mute > target) mute = target;
+    } else if (mute > target) {
+        mute -= 1.0f / MIXER_MUTE_FRAMES;
+        if (mute < target) mute = target;
+    }
+    voice_mute_gain[bank_index] = mute;
+
+    if ((voice_choking & (1 << bank_index)) != 0) {
+        voice_choke_gain[bank_index] -= 1.0f / MIXER_CHOKE_FRAMES;
+        if (voice_choke_gain[bank_index] < 0.0f) voice_choke_gain[bank_index] = 0.0f;
+    }
+    return mute * voice_choke_gain[bank_index];
+}
+
+// the turn of a slot plus its index is the position it's waiting for: free for pos (turn + index == pos),
+// published (pos + 1), consumed (pos + MIXER_EVENT_QUEUE_LEN, free for the next lap). Zero is a valid start,
+// so the pads can post before the mixer exists.
+bool IRAM_ATTR mixer_post_event(uint8_t bank_index, enum evt_type_t event_type, int64_t timestamp_us){
+    uint32_t pos = __atomic_load_n(&event_head, __ATOMIC_RELAXED);
+    mixer_event_slot_t *slot;
+
+    // claim a position
+    for(;;){
+        uint32_t index = pos & (MIXER_EVENT_QUEUE_LEN - 1);
+        slot = &event_ring[index];
+        int32_t diff = (int32_t)(__atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE) + index - pos);
+
+        if(diff == 0){
+            if(__atomic_compare_exchange_n(&event_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if(diff < 0){
+            // the mixer hasn't consumed the previous lap yet
+            __atomic_fetch_add(&event_overflows, 1, __ATOMIC_RELAXED);
+            return false;
         } else {
-            frame_b = frame_a; //stay in the same sample
+            // another producer took it
+            pos = __atomic_load_n(&event_head, __ATOMIC_RELAXED);
         }
     }
 
-    // raw data
-    int16_t *raw_data = (int16_t*)smp->raw_data;
+    slot->event.timestamp_us = timestamp_us;
+    slot->event.bank_index = bank_index;
+    slot->event.event_type = event_type;
+    __atomic_store_n(&slot->turn, pos + 1 - (pos & (MIXER_EVENT_QUEUE_LEN - 1)), __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t mixer_get_dropped_events(void){
+    return __atomic_load_n(&event_overflows, __ATOMIC_RELAXED);
+}
+
+static void mixer_fire_trigger(const seq_trigger_t *trigger){
+    sample_t *smp = sample_bank[trigger->track];
+    if (smp == NULL || smp->raw_data == NULL) return;
+
+    voice_pitch_lock[trigger->track] = (trigger->flags & SEQ_LOCK_PITCH) != 0 ? powf(2.0f, trigger->semitones / 12.0f) : 1.0f;
+    voice_volume_lock[trigger->track] = (trigger->flags & SEQ_LOCK_VOLUME) != 0 ? trigger->volume / 100.0f * VOLUME_THRESHOLD_UP : -1.0f;
+
+    action_restart_sample(trigger->track);
+    playback_choke(trigger->track);
+
+    // the start offset is a point of the region between the pointers
+    if ((trigger->flags & SEQ_LOCK_START) != 0) {
+        smp->playback_ptr = smp->start_ptr + (smp->end_ptr - smp->start_ptr) * (trigger->start / 1000.0f);
+    }
+}
+
+static size_t mixer_collect_events(mixer_event_t *out, size_t max, int64_t prev_block_us, int64_t block_us){
+    size_t count = 0;
+    uint32_t last_frame = 0;
+
+    // the ISR can keep publishing during the drain, out is never overrun
+    for(; count < max; event_tail++){
+        uint32_t index = event_tail & (MIXER_EVENT_QUEUE_LEN - 1);
+        mixer_event_slot_t *slot = &event_ring[index];
+
+        // the next event is not published yet
+        if(__atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE) + index != event_tail + 1) break;
+
+        mixer_event_t evt = slot->event;
+        __atomic_store_n(&slot->turn, event_tail + MIXER_EVENT_QUEUE_LEN - index, __ATOMIC_RELEASE);
+
+        // late events (i.e. the first block, the finish events) go on the first frame, the ones after the block start on the last
+        int64_t elapsed_us = evt.timestamp_us - prev_block_us;
+        if(elapsed_us < 0) elapsed_us = 0;
+        if(elapsed_us > block_us - prev_block_us) elapsed_us = block_us - prev_block_us;
+        uint32_t frame = (uint32_t)(elapsed_us * GRVCHP_SAMPLE_FREQ / 1000000);
+        if(frame >= BUFF_SIZE) frame = BUFF_SIZE - 1;
+
+        // the events keep their order
+        if(frame < last_frame) frame = last_frame;
+        last_frame = frame;
+
+        evt.frame = frame;
+        out[count++] = evt;
+    }
+
+    return count;
+}
+
+#pragma endregion
+
+
+/*
+@brief reads the sample at the voice playback pointer, interpolating between the two nearest frames.
+@param smp the sample to read from.
+@param out the frame read.
+@param total_frames frames of the sample.
+*/
+static inline void get_sample_interpolated_mono(sample_t *smp, int16_t *out, uint32_t total_frames) {
+    *out = mixer_dsp_interpolate(voice_data[smp->bank_index], smp->encoding, total_frames, smp->playback_ptr, &voice_loop[smp->bank_index], &decode_cache[smp->bank_index]);
+}
+
+static void mixer_update_loop(int bank_index, bool force) {
+    sample_t *smp = sample_bank[bank_index];
+    if (smp == NULL || voice_data[bank_index] == NULL) return;
+
+    pb_mode_t playback_mode = get_playback_mode(bank_index);
+    mixer_loop_key_t key = {
+        .data = voice_data[bank_index],
+        .encoding = smp->encoding,
+        .start = (uint32_t)smp->start_ptr,
+        .end_ptr = smp->end_ptr,
+        .xfade_frames = loop_xfade_frames[bank_index],
+        .enabled = playback_mode == LOOP || playback_mode == ONESHOT_LOOP,
+        .audio_gen = __atomic_load_n(&audio_gen[bank_index], __ATOMIC_ACQUIRE),
+    };
+    mixer_loop_key_t *prev = &voice_loop_key[bank_index];
+    if (!force && key.data == prev->data && key.encoding == prev->encoding && key.start == prev->start
+        && key.end_ptr == prev->end_ptr && key.xfade_frames == prev->xfade_frames && key.enabled == prev->enabled
+        && key.audio_gen == prev->audio_gen) return;
+
+    // new audio (possibly at the address of the old one): the decoded block is stale too
+    if (key.data != prev->data || key.encoding != prev->encoding || key.audio_gen != prev->audio_gen) {
+        decode_cache[bank_index].block = NULL;
+    }
+
+    voice_loop_key[bank_index] = key;
+    mixer_dsp_build_loop(voice_data[bank_index], smp->encoding, smp->total_frames, key.start, key.end_ptr, key.enabled,
+                         key.xfade_frames, voice_xfade[bank_index], &decode_cache[bank_index], &voice_loop[bank_index]);
+}
+
+void mixer_audio_changed(int bank_index){
+    if(bank_index < 0 || bank_index >= SAMPLE_NUM) return;
+    __atomic_add_fetch(&audio_gen[bank_index], 1, __ATOMIC_RELEASE);
+}
 
-    //interpolation
-    float la = raw_data[frame_a];
-    float lb = raw_data[frame_b];
-    *out = la * (1.0f - frac) + lb * frac;
+void set_loop_crossfade(uint8_t bank_index, uint16_t frames){
+    if(bank_index >= SAMPLE_NUM) return;
+    loop_xfade_frames[bank_index] = frames > MIXER_XFADE_MAX_FRAMES ? MIXER_XFADE_MAX_FRAMES : frames;
+}
 
+uint16_t get_loop_crossfade(uint8_t bank_index){
+    if(bank_index >= SAMPLE_NUM) return 0;
+    return loop_xfade_frames[bank_index];
 }
 
 #pragma region VOLUME
@@ -271,6 +556,146 @@ void set_chopping_precision(uint8_t precision){
 }
 #pragma endregion
 
+#pragma region SAMPLE STORAGE
+
+sample_encoding_t get_sample_encoding(uint8_t bank_index){
+    if(bank_index < SAMPLE_NUM && sample_bank[bank_index] != NULL){
+        return sample_bank[bank_index]->encoding;
+    }
+    return SAMPLE_PCM16;
+}
+
+esp_err_t set_sample_encoding(uint8_t bank_index, sample_encoding_t encoding){
+    if(bank_index >= SAMPLE_NUM || sample_bank[bank_index] == NULL) return ESP_ERR_INVALID_ARG;
+
+    sample_t *smp = sample_bank[bank_index];
+    if(smp->encoding == encoding) return ESP_OK;
+
+    // the mixer reads raw_data without locks, so it can't be swapped under a playing voice
+    if((now_playing & (1 << bank_index)) != 0){
+        ESP_LOGW(TAG, "sample %i is playing, stop it before changing its storage", bank_index);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    size_t new_size = encoding == SAMPLE_ADPCM ? adpcm_encoded_size(smp->total_frames) : smp->total_frames * sizeof(int16_t);
+    unsigned char *new_data;
+    arena_handle_t new_handle = arena_alloc(new_size, (void**)&new_data);
+    if(new_handle == ARENA_INVALID_HANDLE) return ESP_ERR_NO_MEM;
+
+    // keep the compaction away from both buffers while converting
+    arena_pin(new_handle);
+    arena_pin(smp->data_handle);
+
+    if(encoding == SAMPLE_ADPCM){
+        adpcm_encode((int16_t*)smp->raw_data, smp->total_frames, new_data);
+    } else {
+        // the decode cache belongs to the mixer, the blocks go through a buffer of this task
+        int16_t block[ADPCM_BLOCK_FRAMES];
+        int16_t *pcm = (int16_t*)new_data;
+        for(uint32_t first = 0; first < smp->total_frames; first += ADPCM_BLOCK_FRAMES){
+            // the last block may be partial
+            adpcm_decode_block(smp->raw_data + (first / ADPCM_BLOCK_FRAMES) * ADPCM_BLOCK_BYTES, block);
+            uint32_t count = smp->total_frames - first < ADPCM_BLOCK_FRAMES ? smp->total_frames - first : ADPCM_BLOCK_FRAMES;
+            memcpy(pcm + first, block, count * sizeof(int16_t));
+        }
+    }
+
+    arena_unpin(smp->data_handle);
+
+    // the swap happens with the engine held, and only if the bank didn't start playing while converting
+    bool held = mixer_hold();
+    if(!held || (now_playing & (1 << bank_index)) != 0){
+        ESP_LOGW(TAG, "sample %i started playing, its storage is not changed", bank_index);
+        if(held) mixer_release();
+        arena_unpin(new_handle);
+        arena_free(new_handle);
+        return ESP_ERR_INVALID_STATE;
+    }
+    arena_free(smp->data_handle);
+
+    smp->encoding = encoding;
+    smp->dirty |= SAMPLE_DIRTY_AUDIO; // the ADPCM round trip changes the audio
+    smp->data_handle = new_handle;
+    arena_set_owner(new_handle, (void**)&smp->raw_data);
+    arena_unpin(new_handle);
+    mixer_audio_changed(bank_index);
+    mixer_release();
+
+    ESP_LOGI(TAG, "sample %i stored as %s", bank_index, encoding == SAMPLE_ADPCM ? "ADPCM" : "PCM");
+    return ESP_OK;
+}
+
+esp_err_t sample_replace_audio(int bank_index, arena_handle_t new_handle, size_t bytes){
+    if(bank_index < 0 || bank_index >= SAMPLE_NUM){
+        arena_unpin(new_handle);
+        arena_free(new_handle);
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    sample_t *target = sample_bank[bank_index];
+    bool created = target == NULL;
+
+    // if not in memory allocate space, it's published only once it's ready
+    if(created){
+
+        //logging action
+        ESP_LOGI(TAG, "Creating new sample_t for bank %d", bank_index);
+
+        target = heap_caps_calloc(1, sizeof(sample_t), MALLOC_CAP_SPIRAM);
+
+        // logging action + free memory + return
+        if(target == NULL){
+            ESP_LOGE(TAG, "Cannot allocate sample_t structure");
+            arena_unpin(new_handle);
+            arena_free(new_handle);
+            return ESP_ERR_NO_MEM;
+        }
+
+        target->data_handle = ARENA_INVALID_HANDLE;
+    }
+
+    // the engine is held for the whole swap, so no press or step can start the voice halfway
+    if(!mixer_hold()){
+        if(created) heap_caps_free(target);
+        arena_unpin(new_handle);
+        arena_free(new_handle);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if(!created){
+        // the old audio is going away, the voice can't keep reading it (the block being rendered may still do)
+        action_stop_sample(bank_index);
+        if(!mixer_sync()){
+            mixer_release();
+            arena_unpin(new_handle);
+            arena_free(new_handle);
+            return ESP_ERR_TIMEOUT;
+        }
+    }
+
+    // if there is already a sample bound to that bank_index free it
+    if(target->data_handle != ARENA_INVALID_HANDLE){
+
+        //logging action
+        ESP_LOGI(TAG, "Replacing the previous audio of bank %d", bank_index);
+
+        arena_free(target->data_handle);
+    }
+
+    // hand the block over to the sample
+    target->data_handle = new_handle;
+    arena_set_owner(new_handle, (void**)&target->raw_data);
+    arena_unpin(new_handle);
+
+    sample_init(target, bytes, bank_index);
+    sample_bank[bank_index] = target;
+    mixer_audio_changed(bank_index);
+    mixer_release();
+    return ESP_OK;
+}
+
+#pragma endregion
+
 void print_wav_header(const wav_header_t *h)
 {
     if (h == NULL) {
@@ -312,17 +737,21 @@ esp_err_t ld_sample_debug(int bank_index, const uint8_t* wav_data, const char* d
     memcpy(&smp->header, wav_data, sizeof(wav_header_t));
 
     // 3. Allocate memory for the raw data and copy it
-    smp->raw_data = malloc(smp->header.data_size);
-    if (smp->raw_data == NULL) {
+    smp->data_handle = arena_alloc(smp->header.data_size, (void**)&smp->raw_data);
+    if (smp->data_handle == ARENA_INVALID_HANDLE) {
         heap_caps_free(smp);
         sample_bank[bank_index] = NULL;
         return ESP_ERR_NO_MEM;
     }
     
     // Copy the audio part (skipping the header)
+    arena_pin(smp->data_handle);
     memcpy(smp->raw_data, wav_data + sizeof(wav_header_t), smp->header.data_size);
+    arena_unpin(smp->data_handle);
 
     // 4. Set the metadata
+    smp->encoding = SAMPLE_PCM16;
+    smp->dirty = SAMPLE_DIRTY_AUDIO; // not on the card
     smp->bank_index = bank_index;
     smp->total_frames = smp->header.data_size / 2;
     smp->start_ptr = 0.0f;
@@ -340,8 +769,9 @@ static void mixer_task(void *args)
     i2s_chan_handle_t out_channel = (i2s_chan_handle_t)args;
     assert(out_channel);
     
-    //initialize the metronome
+    //initialize the metronome and the sequencer (they follow the master clock)
     init_metronome();
+    sequencer_init();
 
     //initialize the recording struct
     recorder_init();
@@ -352,40 +782,199 @@ static void mixer_task(void *args)
     int16_t *master_buf = malloc(BUFF_SIZE * sizeof(int16_t));
     assert(master_buf);
 
+    // the voices selected as capture source, when the recorder doesn't take the master
+    int16_t *capture_buf = malloc(BUFF_SIZE * sizeof(int16_t));
+    assert(capture_buf);
+
+    // metronome clicks, kept apart so they don't end up in the recordings
+    int16_t *click_buf = malloc(BUFF_SIZE * sizeof(int16_t));
+    assert(click_buf);
+
+    // overdub: frame of the looped sample played at every output frame, and what is summed into it
+    uint32_t *od_frames = malloc(BUFF_SIZE * sizeof(uint32_t));
+    int16_t *od_input = malloc(BUFF_SIZE * sizeof(int16_t));
+    assert(od_frames && od_input);
+
+    // the latency meter counts the frames sent by the DMA
+    ESP_ERROR_CHECK(latency_attach(out_channel));
+
     ESP_ERROR_CHECK(i2s_channel_enable(out_channel));
 
-    // for the metronome: counts how many samples have been played since the last tick
-    int16_t sample_lookahead = 0;
+    // frames written to the channel so far (wraps around)
+    uint32_t stream_frames = 0;
+
+    // steps of the sequencer that fire in the block
+    seq_trigger_t block_triggers[SEQ_MAX_TRIGGERS];
+
+    for (int j = 0; j < SAMPLE_NUM; j++) {
+        voice_pitch_lock[j] = 1.0f;
+        voice_volume_lock[j] = -1.0f;
+        voice_choke_gain[j] = 1.0f;
+        voice_mute_gain[j] = 1.0f;
+        voice_mute_target[j] = 1.0f;
+    }
+
+    // pad events of the block, and the start time of the previous one
+    mixer_event_t block_events[MIXER_EVENT_QUEUE_LEN];
+    int64_t prev_block_us = esp_timer_get_time();
+
+    // events dropped by the ISR (ring full) already reported
+    uint32_t reported_overflows = 0;
 
     while (1) {
+        // a hold is acknowledged here, between two blocks: while it lasts no voice starts (the count is read before
+        // the sequence, so a hold seen in the sequence is on for the whole block)
+        bool engine_held = __atomic_load_n(&hold_count, __ATOMIC_ACQUIRE) > 0;
+        if (engine_held) {
+            __atomic_store_n(&hold_ack, __atomic_load_n(&hold_seq, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        }
+
+        // the events of the last block period are replayed with the same spacing in this block
+        // (during a hold they stay in the ring, and go on the first frame of the block after it)
+        int64_t block_us = esp_timer_get_time();
+        size_t event_count = engine_held ? 0 : mixer_collect_events(block_events, MIXER_EVENT_QUEUE_LEN, prev_block_us, block_us);
+        size_t next_event = 0;
+        prev_block_us = block_us;
+
+        // logging action, only when new events were dropped
+        uint32_t overflows = mixer_get_dropped_events();
+        if (overflows != reported_overflows) {
+            ESP_LOGW(TAG, "%lu pad events dropped, the event ring was full", overflows - reported_overflows);
+            reported_overflows = overflows;
+        }
+
+        // the master clock places its ticks in the block, and its clients (metronome, sequencer) take theirs
+        const clock_block_t *clock_block = clock_advance(BUFF_SIZE);
+
+        // frames of the block on which the launch grids fall, -1 if none
+        int launch_beat_frame = clock_block_grid_frame(clock_block, CLOCK_PPQN);
+        int launch_bar_frame = clock_block_grid_frame(clock_block, CLOCK_PPQN * PLAYBACK_BEATS_PER_BAR);
+
+        // frame of the block on which every held voice repeats (the shortest repeat, a 32nd at MAX_METRONOME_BPM,
+        // is longer than a block, so there's one at most)
+        for (int j = 0; j < SAMPLE_NUM; j++) {
+            voice_repeat_frame[j] = (voice_repeat_held & (1 << j)) != 0
+                                    ? clock_block_grid_frame(clock_block, repeat_ticks[get_note_repeat(j)]) : -1;
+        }
+
+        // frame of the block on which the metronome ticks, -1 if none (a subdivision is always longer than a block)
+        int tick_offset = get_metronome_block_tick();
+
+        // the sequencer steps of the block
+        size_t trigger_count = sequencer_render_block(block_triggers, SEQ_MAX_TRIGGERS);
+        size_t next_trigger = 0;
+        if (engine_held) trigger_count = 0;
+
+        // the looper target and source are read once per block
+        int od_target = looper_get_target();
+        int od_source = looper_get_source();
+        size_t od_count = 0;
+
+        // voices captured by the recorder, read once per block (0 = master)
+        uint8_t capture_mask = recorder_get_source();
+
+        // the layer is played back through the volume of the looped sample, so it's stored without it
+        float od_gain = 1.0f;
+        if (od_target >= 0 && sample_bank[od_target] != NULL && sample_bank[od_target]->volume > 0.0f) {
+            od_gain = 1.0f / sample_bank[od_target]->volume;
+        }
+
+        // the loop regions follow the pointers, the modes and the crossfades set since the last block
+        for (int j = 0; j < SAMPLE_NUM; j++) {
+            voice_data[j] = sample_bank[j] != NULL ? sample_bank[j]->raw_data : NULL;
+            mixer_update_loop(j, false);
+
+            // the mute groups are read once per block, a voice that isn't playing takes the new state right away
+            voice_mute_target[j] = is_sample_muted(j) ? 0.0f : 1.0f;
+            if ((now_playing & (1 << j)) == 0) {
+                voice_mute_gain[j] = voice_mute_target[j];
+            }
+        }
+
         for (int i = 0; i < BUFF_SIZE; i++) {
+            // contributions of the looped sample and of the looper source to this frame
+            int16_t od_target_out = 0;
+            int16_t od_source_out = 0;
+            bool od_target_played = false;
+
+            // the pad events of this frame
+            while (next_event < event_count && block_events[next_event].frame <= i) {
+                mixer_event_t *evt = &block_events[next_event++];
+
+                // played by hand, the voice goes back to its own parameters (and the press goes in the pattern, if recording)
+                if (evt->event_type == EVT_PRESS && evt->bank_index < SAMPLE_NUM) {
+                    voice_pitch_lock[evt->bank_index] = 1.0f;
+                    voice_volume_lock[evt->bank_index] = -1.0f;
+                    sequencer_record_press(evt->bank_index, i);
+                }
+
+                playback_dispatch_event(evt->bank_index, evt->event_type);
+
+                // the repeats of a held voice are counted from the press
+                if (evt->event_type == EVT_PRESS && evt->bank_index < SAMPLE_NUM && (voice_repeat_held & (1 << evt->bank_index)) != 0) {
+                    voice_repeat_press[evt->bank_index] = stream_frames + i;
+                }
 
-            sample_lookahead += 1;
+                // a press that started the voice from the top is measured until its first frame leaves the DMA
+                sample_t *smp = evt->bank_index < SAMPLE_NUM ? sample_bank[evt->bank_index] : NULL;
+                if (evt->event_type == EVT_PRESS && smp != NULL && (now_playing & (1 << evt->bank_index)) != 0 && smp->playback_ptr == smp->start_ptr) {
+                    latency_mark_voice_start(evt->timestamp_us, stream_frames + i);
+                }
+            }
+
+            // the sequencer steps of this frame
+            while (next_trigger < trigger_count && block_triggers[next_trigger].frame <= i) {
+                mixer_fire_trigger(&block_triggers[next_trigger++]);
+            }
 
-            if (sample_lookahead >= get_samples_per_subdiv()) {
+            // the held voices repeating on this frame, a grid point less than half a repeat after the press is skipped so it doesn't flam
+            for (int j = 0; !engine_held && voice_repeat_held != 0 && j < SAMPLE_NUM; j++) {
+                if (i != voice_repeat_frame[j] || (voice_repeat_held & (1 << j)) == 0) continue;
+
+                float half_repeat = repeat_ticks[get_note_repeat(j)] * clock_get_frames_per_tick() / 2.0f;
+                if ((float)(stream_frames + i - voice_repeat_press[j]) >= half_repeat) {
+                    mixer_fire_repeat(j);
+                }
+            }
+
+            // the loop samples waiting for this point of their launch grid (a grid turned off fires right away)
+            for (int j = 0; !engine_held && voice_launch_pending != 0 && j < SAMPLE_NUM; j++) {
+                if ((voice_launch_pending & (1 << j)) == 0) continue;
+
+                launch_quantize_t grid = get_launch_quantize(j);
+                if (grid == LAUNCH_QUANTIZE_OFF
+                    || (grid == LAUNCH_QUANTIZE_BEAT && i == launch_beat_frame)
+                    || (grid == LAUNCH_QUANTIZE_BAR && i == launch_bar_frame)) {
+                    mixer_fire_launch(j);
+                }
+            }
+
+            if (i == tick_offset) {
                 // unlock_metronome
                 set_metronome_playback(true);
                 //reset the metronome audio, in case the sample is too long for each tick
                 reset_mtrn();
-                sample_lookahead = 0;
+
+                advance_metronome_tick();
             }
 
             //fill the buffer with 0 in case no samples are playing
             master_buf[i] = 0x00;
+            capture_buf[i] = 0x00;
 
             //look at all playing samples
             for (int j = 0; j < SAMPLE_NUM; j++){
 
                 //check play status via bit masking
-                if (sample_bank[j] != NULL && (now_playing & (1 << j)) != 0  && !sample_bank[j]->playback_finished){
+                if (sample_bank[j] != NULL && (now_playing & (1 << j)) != 0  && !sample_bank[j]->playback_finished && voice_data[j] != NULL){
 
                     //single audio sample as contained in the WAV file
                     int16_t sample_to_play;
                     
                     get_sample_interpolated_mono(sample_bank[j], &sample_to_play, sample_bank[j]->total_frames);
                     
-                    //volume adjustment
-                    sample_to_play *= sample_bank[j]->volume;
+                    //volume adjustment (a sequencer step can lock it)
+                    sample_to_play *= voice_volume_lock[j] >= 0.0f ? voice_volume_lock[j] : sample_bank[j]->volume;
 
                     //apply distortion
                     distortion_params_t *dst_params = &get_sample_effect(j)->distortion;
@@ -395,15 +984,41 @@ static void mixer_task(void *args)
                     bitcrusher_params_t *bc_params = &get_sample_effect(j)->bitcrusher;
                     apply_bitcrusher_mono(bc_params, &sample_to_play);
 
+                    // choke and mute fades, after the effects so the distortion doesn't reshape them
+                    sample_to_play *= mixer_step_fades(j);
+
+                    if (j == od_target) {
+                        od_frames[od_count] = (uint32_t)sample_bank[j]->playback_ptr;
+                        od_target_out = sample_to_play;
+                        od_target_played = true;
+                    }
+                    if (j == od_source) {
+                        od_source_out = sample_to_play;
+                    }
+
+                    // the voice is captured after its own effects
+                    if ((capture_mask & (1 << j)) != 0) {
+                        capture_buf[i] += sample_to_play;
+                    }
+
                     // writes the WAV data to the buffer post volume adjustment and effects pipeline
                     master_buf[i] += sample_to_play;
 
                     // add the pitch factor to the pointer
-                    sample_bank[j]->playback_ptr += get_pitch_factor(j);
+                    sample_bank[j]->playback_ptr += get_pitch_factor(j) * voice_pitch_lock[j];
                     //printf("PLAYBACK PTR: %f\nEND_PTR: %ld\n", sample_bank[j]->playback_ptr, sample_bank[j]->end_ptr);
 
+                    // a choked voice stops at the end of its fade
+                    if ((voice_choking & (1 << j)) != 0 && voice_choke_gain[j] <= 0.0f) {
+                        action_stop_sample(j);
+                        mixer_cancel_choke(j);
+                    }
+                    // the loop modes wrap here, on the same frame and with the fractional part carried over
+                    else if (voice_loop[j].enabled) {
+                        mixer_dsp_wrap(&sample_bank[j]->playback_ptr, &voice_loop[j]);
+                    }
                     // case: playback pointer has reached EOF or the end_ptr
-                    if (sample_bank[j]->playback_ptr > sample_bank[j]->end_ptr || sample_bank[j]->playback_ptr >= sample_bank[j]->total_frames) {
+                    else if (sample_bank[j]->playback_ptr > sample_bank[j]->end_ptr || sample_bank[j]->playback_ptr >= sample_bank[j]->total_frames) {
                         if (!sample_bank[j]->playback_finished) {
                             //flag the sample as "done playing"
                             sample_bank[j]->playback_finished = true;
@@ -415,15 +1030,20 @@ static void mixer_task(void *args)
                 }
             }
 
+            // the layer gets the master output without the loop itself, or the selected voice
+            if (od_target_played) {
+                int32_t od_in = (od_source == LOOPER_SOURCE_MASTER ? master_buf[i] - od_target_out : od_source_out) * od_gain;
+                if (od_in > MAX_CLIPPING) od_in = MAX_CLIPPING;
+                if (od_in < MIN_CLIPPING) od_in = MIN_CLIPPING;
+                od_input[od_count++] = od_in;
+            }
+
             // apply volume to master buffer
             master_buf[i] *= (volume * 2);
 
-            // capture the master frame for the recorded sample
-            if (recorder_is_recording()){
-                recorder_capture_frame(master_buf[i]);
-            }
-
-            if (get_metronome_playback() && get_metronome_state()) {
+            click_buf[i] = 0;
+            // the count-in of a recording clicks even if the metronome is off
+            if (get_metronome_playback() && (get_metronome_state() || recorder_wants_clicks())) {
                 // if the metronome is playing, but the sound has finished
                 if (is_metronome_tick()) {
                     //lock the metronome again
@@ -433,7 +1053,7 @@ static void mixer_task(void *args)
                     // otherwise, keep on playing!
                     int16_t mtrn_audio  = advance_metronome_audio();
 
-                    master_buf[i] += mtrn_audio * 0.1;
+                    click_buf[i] = mtrn_audio * 0.1;
 
                     advance_metronome_ptr();
                 }
@@ -443,24 +1063,90 @@ static void mixer_task(void *args)
         }
         
 
+        // the overdubbed frames are written after the block, the loop plays them on the next pass
+        if (od_count > 0) {
+            looper_write_block(od_target, od_frames, od_input, od_count);
+
+            // the crossfade holds a copy of the audio around the loop point
+            mixer_update_loop(od_target, true);
+        }
+
+        // the finished block goes to the recorder (before the clicks are added)
+        recorder_tap_block(capture_mask == RECORD_SOURCE_MASTER ? master_buf : capture_buf, BUFF_SIZE, tick_offset);
+
+        for (int i = 0; i < BUFF_SIZE; i++) {
+            master_buf[i] += click_buf[i];
+        }
+
         // Write full buffer (1024 bytes)
         ESP_ERROR_CHECK(i2s_channel_write(out_channel, master_buf,
                                           BUFF_SIZE * sizeof(int16_t),
                                           &w_bytes,
                                           portMAX_DELAY));
+        stream_frames += BUFF_SIZE;
         vTaskDelay(pdMS_TO_TICKS(10));
     }
     free(master_buf);
+    free(click_buf);
+    free(capture_buf);
+    free(od_frames);
+    free(od_input);
     vTaskDelete(NULL);
 }
 
+bool mixer_is_idle(void){
+    // the sequencer would have its steps dropped by a hold
+    return now_playing == 0 && !recorder_is_recording() && !sequencer_get_playing();
+}
+
+bool mixer_hold(void){
+    __atomic_fetch_add(&hold_count, 1, __ATOMIC_ACQ_REL);
+    uint32_t seq = __atomic_add_fetch(&hold_seq, 1, __ATOMIC_ACQ_REL);
+
+    // before the mixer starts nothing reads the samples
+    if (mixer_task_handle == NULL) return true;
+
+    // the mixer can't wait for its own block boundary
+    if (xTaskGetCurrentTaskHandle() == mixer_task_handle) {
+        mixer_release();
+        return false;
+    }
+
+    TickType_t start = xTaskGetTickCount();
+    while ((int32_t)(__atomic_load_n(&hold_ack, __ATOMIC_ACQUIRE) - seq) < 0) {
+        // logging action + give up
+        if (xTaskGetTickCount() - start > pdMS_TO_TICKS(MIXER_HOLD_TIMEOUT_MS)) {
+            ESP_LOGW(TAG, "the mixer didn't reach the block boundary");
+            mixer_release();
+            return false;
+        }
+        vTaskDelay(1);
+    }
+    return true;
+}
+
+void mixer_release(void){
+    __atomic_fetch_sub(&hold_count, 1, __ATOMIC_ACQ_REL);
+}
+
+bool mixer_sync(void){
+    // a hold is acknowledged only at a block boundary
+    if (!mixer_hold()) return false;
+    mixer_release();
+    return true;
+}
+
 void create_mixer(i2s_chan_handle_t channel){
 
     for (int i = 0; i < SAMPLE_NUM; i++) {
         sample_bank[i] = NULL;
     }
 
-    xTaskCreate(&mixer_task, "Mixer task", 8192, (void*)channel, 5, NULL);
+    // samples can be moved around in PSRAM only while nothing is reading them, with the engine held
+    sample_arena_set_idle_check(mixer_is_idle);
+    sample_arena_set_engine_hold(mixer_hold, mixer_release);
+
+    xTaskCreate(&mixer_task, "Mixer task", 8192, (void*)channel, 5, &mixer_task_handle);
 }
 
 void sample_init (sample_t* in_sample, int size, int bank_index) {
@@ -484,6 +1170,8 @@ void sample_init (sample_t* in_sample, int size, int bank_index) {
     memcpy(in_sample->header.data_id, "data", 4);
     in_sample->header.data_size = size;
     
+    in_sample->encoding = SAMPLE_PCM16;
+    in_sample->dirty = SAMPLE_DIRTY_AUDIO;
     in_sample->total_frames = size / sizeof(uint16_t); 
     in_sample->start_ptr = 0.0f;
     in_sample->end_ptr = (float)in_sample->total_frames - 1.0f;
@@ -57,8 +57,8 @@ static void IRAM_ATTR gpio_isr_handler(void *arg){
 		send_message_to_fsm_queue_from_ISR(PAD, pad_id);
 	}
 
-	// send the event on the sample task
-	send_pad_event(pad_id, event_type);
+	// post the event to the mixer event ring, the mixer applies it at the next block
+	send_pad_event(pad_id, event_type, current_time);
 } 
 
 #pragma endregion
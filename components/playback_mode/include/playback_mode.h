@@ -2,6 +2,7 @@
 #define PLAYBACK_MODE_H_
 #define NOT_DEFINED GPIO_NUM_MAX
 
+#include <stdbool.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
@@ -10,13 +11,6 @@
 //type of press/release/finish handlers
 typedef void (*event_handler)(int pad_id);
 
-// the playback event can be sent from pad_section or from the mixer (ON_FINISH event).
-// This enum distinguish this two cases
-typedef enum{
-	SRC_PAD_SECTION,
-	SRC_MIXER
-} event_source_t;
-
 // enum for sample event type
 enum evt_type_t {
 	EVT_PRESS,
@@ -24,33 +18,27 @@ enum evt_type_t {
 	EVT_FINISH
 };
 
-// associate the pad_id to the event_type 
-typedef struct {
-	event_source_t source;
-	enum evt_type_t event_type;
-
-	union{
-		uint8_t pad_id;
-		uint8_t bank_index;
-	} payload;
-
-} playback_msg_t;
-
 /*
-@brief send pad message to the playback queue, setting the source to `SRC_PAD_SECTION`.
+@brief send a pad event straight to the mixer (from the pad ISR). Pads without a sample are ignored.
 @param pad_id pad_id the pad_id of the pad that send the message.
 @param event_type specify te `event_type` (`EVT_PRESS`/`RELEASE`)
+@param timestamp_us time of the press/release, taken in the ISR with esp_timer_get_time().
 */
-void send_pad_event(uint8_t pad_id, enum evt_type_t event_type);
+void send_pad_event(uint8_t pad_id, enum evt_type_t event_type, int64_t timestamp_us);
 
 /*
-@brief send pad message to the playback queue, setting the source to `SRC_MIXER`.
+@brief send a sample event to the mixer, played at the start of the next block.
 @param pad_id bank_index the bank_index of the sample that send the message.
 @param event_type specify te `event_type` (`EVT_FINISH`)
 */
 void send_mixer_event(uint8_t bank_index, enum evt_type_t event_type);
 
 void map_pad_to_sample(uint8_t pad_id, uint8_t bank_index);
+
+/*
+@brief removes every pad to sample mapping.
+*/
+void unmap_all_pads();
 uint8_t get_sample_bank_index(uint8_t pad_id);
 
 #pragma endregion
@@ -94,6 +82,150 @@ pb_mode_t get_playback_mode(uint8_t bank_index);
 */
 void set_playback_mode(uint8_t bank_index, const pb_mode_t mode);
 
+/*
+@brief runs the handler of the sample mode for an event (i.e. on_press for EVT_PRESS).
+Called by the mixer, on the frame the event belongs to.
+@param bank_index index of the sample.
+@param event_type the event.
+*/
+void playback_dispatch_event(uint8_t bank_index, enum evt_type_t event_type);
+
+#pragma endregion
+
+#pragma region CHOKE AND MUTE GROUPS
+
+// a sample that is in no group
+#define PLAYBACK_GROUP_NONE 0
+
+// groups available, numbered from 1
+#define PLAYBACK_CHOKE_GROUPS 4
+#define PLAYBACK_MUTE_GROUPS 4
+
+/*
+@brief set the choke group of a sample: starting it fades out the other samples of the group.
+@param bank_index index of the sample.
+@param group the group, PLAYBACK_GROUP_NONE to leave it.
+*/
+void set_choke_group(uint8_t bank_index, uint8_t group);
+
+/*
+@brief get the choke group of a sample, PLAYBACK_GROUP_NONE if it has none.
+@param bank_index index of the sample.
+*/
+uint8_t get_choke_group(uint8_t bank_index);
+
+/*
+@brief set the mute group of a sample: the samples of a group are muted and unmuted together.
+@param bank_index index of the sample.
+@param group the group, PLAYBACK_GROUP_NONE to leave it.
+*/
+void set_mute_group(uint8_t bank_index, uint8_t group);
+
+/*
+@brief get the mute group of a sample, PLAYBACK_GROUP_NONE if it has none.
+@param bank_index index of the sample.
+*/
+uint8_t get_mute_group(uint8_t bank_index);
+
+/*
+@brief mute or unmute a group. The samples keep playing, silent.
+@param group the group.
+@param muted new state.
+*/
+void set_mute_group_state(uint8_t group, bool muted);
+
+/*
+@brief get the state of a mute group.
+@param group the group.
+*/
+bool get_mute_group_state(uint8_t group);
+
+/*
+@brief tells whether a sample is muted by its group. Read by the mixer at every block.
+@param bank_index index of the sample.
+*/
+bool is_sample_muted(uint8_t bank_index);
+
+/*
+@brief fades out the other playing samples of the choke group of a sample. Called by the mixer when the sample starts.
+@param bank_index index of the sample that started.
+*/
+void playback_choke(uint8_t bank_index);
+
+#pragma endregion
+
+#pragma region LAUNCH QUANTIZATION
+
+// grid on which a loop sample (LOOP and ONESHOT_LOOP) starts and stops
+typedef enum {
+	LAUNCH_QUANTIZE_OFF,	// on the press
+	LAUNCH_QUANTIZE_BEAT,	// on the next beat of the master clock
+	LAUNCH_QUANTIZE_BAR,	// on the next bar of the master clock
+} launch_quantize_t;
+
+// beats in a bar of the launch grid
+#define PLAYBACK_BEATS_PER_BAR 4
+
+/*
+@brief set the launch grid of a sample. Only the loop modes use it, the others always start on the press.
+@param bank_index index of the sample.
+@param quantize the grid.
+*/
+void set_launch_quantize(uint8_t bank_index, launch_quantize_t quantize);
+
+/*
+@brief get the launch grid of a sample.
+@param bank_index index of the sample.
+*/
+launch_quantize_t get_launch_quantize(uint8_t bank_index);
+
+#pragma endregion
+
+#pragma region NOTE REPEAT
+
+// rate at which a held HOLD sample is retriggered, on the grid of the master clock
+typedef enum {
+	REPEAT_OFF,
+	REPEAT_8TH,
+	REPEAT_16TH,
+	REPEAT_32ND,
+	REPEAT_8TH_TRIPLET,
+	REPEAT_16TH_TRIPLET,
+} note_repeat_t;
+
+// volume of the repeats of a held sample
+typedef enum {
+	REPEAT_RAMP_OFF,	// every hit at the sample volume
+	REPEAT_RAMP_UP,		// from a quarter of the volume to the full volume
+	REPEAT_RAMP_DOWN,	// from the full volume to a quarter of it
+} repeat_ramp_t;
+
+/*
+@brief set the note repeat rate of a sample. Only the HOLD mode uses it: the sample is retriggered while the pad is held.
+@param bank_index index of the sample.
+@param rate the rate, REPEAT_OFF to play it once.
+*/
+void set_note_repeat(uint8_t bank_index, note_repeat_t rate);
+
+/*
+@brief get the note repeat rate of a sample.
+@param bank_index index of the sample.
+*/
+note_repeat_t get_note_repeat(uint8_t bank_index);
+
+/*
+@brief set the volume ramp of the repeats of a sample.
+@param bank_index index of the sample.
+@param ramp the ramp.
+*/
+void set_repeat_ramp(uint8_t bank_index, repeat_ramp_t ramp);
+
+/*
+@brief get the volume ramp of the repeats of a sample.
+@param bank_index index of the sample.
+*/
+repeat_ramp_t get_repeat_ramp(uint8_t bank_index);
+
 #pragma endregion
 
 /*
@@ -6,14 +6,12 @@
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "esp_timer.h"
+#include "esp_attr.h"
 
 const char* TAG_PM = "PlaybackMode";
 
 #pragma region PAYBACK MODES
 
-// init queue
-QueueHandle_t playback_evt_queue = NULL;
-
 const playback_mode_t MODE_HOLD = {
 	.mode 		= HOLD,
     .on_press   = action_start_sample,
@@ -52,6 +50,26 @@ const playback_mode_t* PLAYBACK_MODES[] = {
 static const playback_mode_t* samples_config[SAMPLE_NUM];
 static int pad_to_sample_map[GPIO_NUM_MAX];
 
+// choke and mute group of every sample (PLAYBACK_GROUP_NONE = none), set by the SD reader when the samples are loaded
+static uint8_t choke_groups[SAMPLE_NUM];
+static uint8_t mute_groups[SAMPLE_NUM];
+
+// bit n: mute group n is muted
+static volatile uint8_t muted_groups = 0;
+
+// launch grid of every sample (LAUNCH_QUANTIZE_OFF = on the press)
+static launch_quantize_t launch_quantize[SAMPLE_NUM];
+
+// note repeat rate and volume ramp of every sample
+static note_repeat_t note_repeat[SAMPLE_NUM];
+static repeat_ramp_t repeat_ramp[SAMPLE_NUM];
+
+/*
+@brief hands the press or release of a loop sample with a launch grid to the mixer, which starts or stops it on the grid.
+@return false if the sample has no launch grid, and the event is handled by its mode.
+*/
+static bool playback_launch_event(uint8_t bank_index, enum evt_type_t event_type);
+
 void get_mode_stringify(pb_mode_t mode, char* out){
 	switch (mode)
 	{
@@ -72,7 +90,7 @@ void get_mode_stringify(pb_mode_t mode, char* out){
 	}
 }
 
-uint8_t get_sample_bank_index(uint8_t pad_id){
+uint8_t IRAM_ATTR get_sample_bank_index(uint8_t pad_id){
 	if(pad_id < GPIO_NUM_MAX){
 		return pad_to_sample_map[pad_id];
 	}
@@ -115,74 +133,157 @@ void map_pad_to_sample(uint8_t pad_id, uint8_t bank_index){
 		pad_to_sample_map[pad_id] = bank_index;
 }
 
-// send messages into playback_evt_queue from the pad section
-void IRAM_ATTR send_pad_event(uint8_t pad_id, enum evt_type_t type) {
-    playback_msg_t msg;
-    msg.source = SRC_PAD_SECTION;
-    msg.event_type = type;
-    msg.payload.pad_id = pad_id;
-    
-    xQueueSendFromISR(playback_evt_queue, &msg, NULL);
+// exposed function to clear the pad mapping (i.e. when a new kit is loaded)
+void unmap_all_pads(){
+	for(int i = 0; i  < GPIO_NUM_MAX; i++){
+        pad_to_sample_map[i] = NOT_DEFINED;
+	}
+}
+
+// pad events go straight to the mixer, it runs the handlers at the block boundary
+void IRAM_ATTR send_pad_event(uint8_t pad_id, enum evt_type_t type, int64_t timestamp_us) {
+	uint8_t bank_index = get_sample_bank_index(pad_id);
+
+	// there is no associated sample to this pad
+	if (bank_index == NOT_DEFINED) return;
+
+	mixer_post_event(bank_index, type, timestamp_us);
 }
 
-// send messages into playback_evt_queue from the mixer section
+// finish events from the mixer, played at the start of the next block
 void IRAM_ATTR send_mixer_event(uint8_t bank_index, enum evt_type_t type) {
-    playback_msg_t msg;
-    msg.source = SRC_MIXER;
-    msg.event_type = type;
-    msg.payload.bank_index = bank_index;
+	mixer_post_event(bank_index, type, 0);
+}
 
-	xQueueSendFromISR(playback_evt_queue, &msg, NULL);
+void playback_dispatch_event(uint8_t bank_index, enum evt_type_t event_type){
+	if (bank_index >= SAMPLE_NUM) return;
+
+	// a loop sample with a launch grid starts and stops on the grid
+	if (playback_launch_event(bank_index, event_type)) return;
+
+	switch (event_type)
+	{
+	case EVT_PRESS:
+		samples_config[bank_index]->on_press(bank_index);
+		// the press started the sample: the rest of its group is cut
+		if ((now_playing & (1 << bank_index)) != 0){
+			playback_choke(bank_index);
+		}
+		// a held HOLD sample with note repeat is retriggered by the mixer on the repeat grid
+		if (samples_config[bank_index]->mode == HOLD && note_repeat[bank_index] != REPEAT_OFF){
+			mixer_repeat_sample(bank_index, true);
+		}
+		break;
+	case EVT_RELEASE:
+		mixer_repeat_sample(bank_index, false);
+		samples_config[bank_index]->on_release(bank_index);
+		break;
+	case EVT_FINISH:
+		samples_config[bank_index]->on_finish(bank_index);
+		break;
+	default:
+		break;
+	}
 }
-void sample_task(void *pvParameter){
-	playback_msg_t queue_msg;
 
-	for (;;)
+static bool playback_launch_event(uint8_t bank_index, enum evt_type_t event_type){
+	if (launch_quantize[bank_index] == LAUNCH_QUANTIZE_OFF) return false;
+
+	pb_mode_t mode = samples_config[bank_index]->mode;
+	if (mode != LOOP && mode != ONESHOT_LOOP) return false;
+
+	switch (event_type)
 	{
-		if (xQueueReceive(playback_evt_queue, &queue_msg, portMAX_DELAY) == pdPASS)
-		{
-			uint8_t bank_index = NOT_DEFINED;
-
-			// retrieve bank_index based on the source
-			switch (queue_msg.source)
-			{
-			case SRC_PAD_SECTION:
-				//the message came from PAD_SECTION, get the associated bank_index
-				if (queue_msg.payload.pad_id < GPIO_NUM_MAX) {
-                    bank_index = get_sample_bank_index(queue_msg.payload.pad_id);
-                }
-				break;
-			case SRC_MIXER:
-				// the message came from the mixer, so we already have the bank_index
-                bank_index = queue_msg.payload.bank_index;
-				break;
-			default:
-				break;
-			}
-
-            if(bank_index == NOT_DEFINED){
-                // there is no associated sample to this pad
-                ESP_LOGW(TAG_PM,"sample id was NOT defined");
-                fflush(stdout);
-                continue;
-            }
-
-            fflush(stdout);
-
-			switch (queue_msg.event_type)
-			{
-			case EVT_PRESS:
-				samples_config[bank_index]->on_press(bank_index);
-				break;
-			case EVT_RELEASE:
-				samples_config[bank_index]->on_release(bank_index);
-				break;
-			case EVT_FINISH:
-				samples_config[bank_index]->on_finish(bank_index);
-				break;
-			default:
-				break;
-			}
+	case EVT_PRESS:
+		// LOOP plays while held, ONESHOT_LOOP toggles (a second press before the grid point cancels the first)
+		mixer_launch_sample(bank_index, mode == LOOP ? true : !mixer_get_launch_state(bank_index));
+		return true;
+	case EVT_RELEASE:
+		if (mode == LOOP){
+			mixer_launch_sample(bank_index, false);
+		}
+		return true;
+	default:
+		// the loop wraps as usual
+		return false;
+	}
+}
+
+void set_launch_quantize(uint8_t bank_index, launch_quantize_t quantize){
+	if (bank_index < SAMPLE_NUM && quantize <= LAUNCH_QUANTIZE_BAR){
+		launch_quantize[bank_index] = quantize;
+	}
+}
+
+launch_quantize_t get_launch_quantize(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM ? launch_quantize[bank_index] : LAUNCH_QUANTIZE_OFF;
+}
+
+void set_note_repeat(uint8_t bank_index, note_repeat_t rate){
+	if (bank_index < SAMPLE_NUM && rate <= REPEAT_16TH_TRIPLET){
+		note_repeat[bank_index] = rate;
+	}
+}
+
+note_repeat_t get_note_repeat(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM ? note_repeat[bank_index] : REPEAT_OFF;
+}
+
+void set_repeat_ramp(uint8_t bank_index, repeat_ramp_t ramp){
+	if (bank_index < SAMPLE_NUM && ramp <= REPEAT_RAMP_DOWN){
+		repeat_ramp[bank_index] = ramp;
+	}
+}
+
+repeat_ramp_t get_repeat_ramp(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM ? repeat_ramp[bank_index] : REPEAT_RAMP_OFF;
+}
+
+void set_choke_group(uint8_t bank_index, uint8_t group){
+	if (bank_index < SAMPLE_NUM && group <= PLAYBACK_CHOKE_GROUPS){
+		choke_groups[bank_index] = group;
+	}
+}
+
+uint8_t get_choke_group(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM ? choke_groups[bank_index] : PLAYBACK_GROUP_NONE;
+}
+
+void set_mute_group(uint8_t bank_index, uint8_t group){
+	if (bank_index < SAMPLE_NUM && group <= PLAYBACK_MUTE_GROUPS){
+		mute_groups[bank_index] = group;
+	}
+}
+
+uint8_t get_mute_group(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM ? mute_groups[bank_index] : PLAYBACK_GROUP_NONE;
+}
+
+void set_mute_group_state(uint8_t group, bool muted){
+	if (group == PLAYBACK_GROUP_NONE || group > PLAYBACK_MUTE_GROUPS) return;
+
+	if (muted){
+		__atomic_fetch_or(&muted_groups, 1 << group, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_and(&muted_groups, ~(1 << group), __ATOMIC_RELAXED);
+	}
+	ESP_LOGI(TAG_PM, "mute group %u %s", group, muted ? "muted" : "unmuted");
+}
+
+bool get_mute_group_state(uint8_t group){
+	return group != PLAYBACK_GROUP_NONE && (muted_groups & (1 << group)) != 0;
+}
+
+bool is_sample_muted(uint8_t bank_index){
+	return bank_index < SAMPLE_NUM && get_mute_group_state(mute_groups[bank_index]);
+}
+
+void playback_choke(uint8_t bank_index){
+	if (bank_index >= SAMPLE_NUM || choke_groups[bank_index] == PLAYBACK_GROUP_NONE) return;
+
+	for (int i = 0; i < SAMPLE_NUM; i++){
+		if (i != bank_index && choke_groups[i] == choke_groups[bank_index] && (now_playing & (1 << i)) != 0){
+			action_choke_sample(i);
 		}
 	}
 }
@@ -196,14 +297,8 @@ void playback_mode_init(){
 	}
 
 	// init pad to sample to NOT_DEFINED
-	for(int i = 0; i  < GPIO_NUM_MAX; i++){
-        pad_to_sample_map[i] = NOT_DEFINED;
-	}
+	unmap_all_pads();
 
-	// init queue
-	playback_evt_queue = xQueueCreate(10, sizeof(playback_msg_t));
-	
-    xTaskCreate(sample_task, "sample_task", 4096, NULL, 5, NULL);
     printf("[Sample] Ready\n");
 }
 
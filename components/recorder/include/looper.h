@@ -0,0 +1,122 @@
+#ifndef LOOPER_H_
+#define LOOPER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sample_arena.h"
+#include "recorder.h"
+
+// the layer records the master output (minus the looped sample itself)
+#define LOOPER_SOURCE_MASTER -1
+
+// frames of original audio the undo log can hold, at least a full-length layer
+#define LOOPER_UNDO_FRAMES RECORD_MAX_FRAMES
+
+// contiguous runs of frames in the undo log (a layer usually needs two: before and after the loop point)
+#define LOOPER_UNDO_SPANS 64
+
+// layers that can be undone, the oldest one is forgotten first
+#define LOOPER_UNDO_LAYERS 8
+
+// default feedback: the previous layers are kept as they are
+#define LOOPER_DEFAULT_FEEDBACK 1.0f
+
+// run of frames of a sample, with their values before the layer (stored in the log at offset)
+typedef struct {
+    uint32_t start;             // first frame of the sample
+    uint32_t count;             // number of frames
+    uint32_t offset;            // position of the original values in the log
+} looper_span_t;
+
+// a layer that can be undone
+typedef struct {
+    int bank_index;             // the sample that was overdubbed
+    arena_handle_t handle;      // its audio block, the layer can't be undone if the audio was replaced
+    uint16_t first_span;        // first span of the layer
+    uint16_t span_count;        // number of spans of the layer
+} looper_layer_t;
+
+// looper struct
+typedef struct {
+    volatile int target_bank_index;   // sample being overdubbed, -1 if none (read by the mixer)
+    volatile int source;              // bank index of the recorded voice, or LOOPER_SOURCE_MASTER
+    volatile float feedback;          // how much of the previous layers is kept (0-1)
+
+    int16_t *data;              // audio of the target, pinned while overdubbing
+    uint32_t total_frames;      // frames of the target
+    arena_handle_t handle;      // arena block of the target
+
+    uint8_t *touched;           // one bit per frame: already saved in the log by the current layer
+    bool log_overflow;          // the current layer didn't fit in the log, the history is dropped when it ends
+    volatile bool writing;      // the mixer is inside looper_write_block()
+
+    int16_t *log;               // original values of the overdubbed frames, PSRAM
+    uint32_t log_used;          // frames used in the log
+    looper_span_t spans[LOOPER_UNDO_SPANS];
+    uint16_t span_count;
+    looper_layer_t layers[LOOPER_UNDO_LAYERS];
+    uint8_t layer_count;
+} looper_t;
+
+/*
+@brief function that starts a new layer on a sample: while the sample plays, the source is summed
+into its audio in place. ADPCM samples are converted to PCM first.
+@param bank_index index of the sample to overdub.
+*/
+esp_err_t looper_start(int bank_index);
+
+/*
+@brief function that ends the current layer, which can then be undone.
+*/
+void looper_stop(void);
+
+/*
+@brief function that restores the audio as it was before the last layer.
+*/
+esp_err_t looper_undo(void);
+
+/*
+@brief function called by the mixer once per block with the frames of the target it played.
+It never blocks, allocates or logs.
+@param bank_index the target the frames were collected for, they're dropped if it changed meanwhile.
+@param frames frame of the target played at every output frame.
+@param input what has to be summed into each of those frames.
+@param count number of frames.
+*/
+void looper_write_block(int bank_index, const uint32_t *frames, const int16_t *input, size_t count);
+
+/*
+@brief getter function for the overdubbed sample, -1 if the looper is not overdubbing.
+*/
+int looper_get_target(void);
+
+/*
+@brief function that sets what is recorded into the layers.
+@param source bank index of the voice, or LOOPER_SOURCE_MASTER.
+*/
+void looper_set_source(int source);
+
+/*
+@brief getter function for the looper source.
+*/
+int looper_get_source(void);
+
+/*
+@brief function that sets how much of the previous layers is kept when a new one is summed.
+@param feedback from 0 (replace) to 1 (keep everything).
+*/
+void looper_set_feedback(float feedback);
+
+/*
+@brief getter function for the looper feedback.
+*/
+float looper_get_feedback(void);
+
+/*
+@brief function that tells how many layers can be undone.
+*/
+uint8_t looper_get_undo_count(void);
+
+#endif
@@ -6,6 +6,8 @@
 #include <stddef.h>
 #include "fsm.h"
 #include "lcd.h"
+#include "sample_arena.h"
+#include "frame_ring.h"
 
 // sample rate in kHz
 #define RECORD_SAMPLE_RATE 16000
@@ -16,25 +18,117 @@
 // max number of frames that can be sampled
 #define RECORD_MAX_FRAMES (RECORD_SAMPLE_RATE * RECORD_MAX_DURATION_SEC)
 
-// size of the new sample buffer (differs between stereo and mono)
-#define RECORD_BUFFER_SIZE (RECORD_MAX_FRAMES * 2)  // 2 for stereo
+// size (in frames) of the capture buffer, reserved once at boot (the master buffer is mono)
+#define RECORD_BUFFER_SIZE RECORD_MAX_FRAMES
+
+// ring between the mixer and the recorder task (about 2 seconds at 16 kHz),
+// it absorbs the write latency spikes of the SD card
+#define RECORD_RING_FRAMES 32768
+
+// frames moved out of the ring at once (and written to the card with a single fwrite)
+#define RECORD_CHUNK_FRAMES 2048
+
+// how often the recorder task empties the ring while recording
+#define RECORD_POLL_MS 20
+
+// task that consumes the recorded blocks: buffering, length checks, streaming and state transitions
+#define RECORD_TASK_STACK 4096
+#define RECORD_TASK_PRIORITY 3
+
+// pre-roll ring, always holding the last seconds of master output (about 8 seconds at 16 kHz)
+// it must be a power of two and fit the capture buffer
+#define RECORD_PREROLL_FRAMES 131072
+
+// frames the mixer can write while a capture copies the pre-roll ring (8 blocks),
+// they are left out of the capture so the copy never reads frames being overwritten
+#define RECORD_PREROLL_GUARD_FRAMES 2048
+
+// beats in a bar, for the bar quantization and the count-in
+#define RECORD_BEATS_PER_BAR 4
+
+// grid on which a quantized recording starts and stops
+typedef enum {
+    REC_QUANTIZE_OFF,      // starts and stops on the presses
+    REC_QUANTIZE_BEAT,     // starts and stops on a beat, the length is a multiple of the beat
+    REC_QUANTIZE_BAR,      // starts and stops on a bar, the length is a multiple of the bar
+} record_quantize_t;
+
+// post-capture analysis: frames scanned at once when looking for the start and the end
+#define RECORD_ANALYSIS_BLOCK 256
+
+// frames quieter than this are silence (about -40 dBFS)
+#define RECORD_TRIM_THRESHOLD 328
+
+// frames kept before the start and after the end, so the attack and the tail are not cut (5 ms)
+#define RECORD_TRIM_MARGIN_FRAMES 80
+
+// the peak is normalized to about -1 dBFS, with a limited boost so the noise isn't raised too much
+#define RECORD_NORMALIZE_PEAK 29204
+#define RECORD_NORMALIZE_MAX_GAIN 8.0f
+
+// a take quieter than this (RMS, about -50 dBFS) is only noise, it's not normalized
+#define RECORD_MIN_RMS 104
+
+// result of the post-capture analysis
+typedef struct {
+    uint32_t start;             // first frame above the threshold (margin included)
+    uint32_t end;               // last frame above the threshold (margin included)
+    uint16_t peak;              // peak level between start and end
+    uint16_t rms;               // RMS level between start and end
+    float gain;                 // gain that normalizes the peak
+} record_analysis_t;
+
+// capture source: the master output (after the master volume)
+#define RECORD_SOURCE_MASTER 0x00
+
+// capture source: the bus of all the voices (before the master volume)
+#define RECORD_SOURCE_ALL_VOICES 0xFF
+
+// capture source: a single voice, after its volume and effects
+#define RECORD_SOURCE_VOICE(bank_index) (1 << (bank_index))
+
+// where the recorded audio goes
+typedef enum {
+    REC_TO_MEMORY,         // into a sample, up to RECORD_MAX_DURATION_SEC
+    REC_TO_SD,             // into a new WAV file on the SD card, no length limit
+} record_destination_t;
 
 // recorder states
 typedef enum {
     REC_IDLE,              // idle state = not in the recorder fsm (before/after recording)
     REC_WAITING_PAD,       // waiting for the user to choose the pad
+    REC_ARMED,             // waiting for the metronome grid (and the count-in) to start recording
     REC_RECORDING,         // currently recording
+    REC_SAVING,            // the recorded frames are being copied into the sample, the buffer is busy
 } recorder_state_t;
 
+// ring keeping the last RECORD_PREROLL_FRAMES frames of the master buffer
+typedef struct {
+    int16_t *frames;            // PSRAM storage, allocated the first time the pre-roll is enabled
+    uint32_t mask;              // RECORD_PREROLL_FRAMES - 1
+    volatile uint32_t head;     // frames written since the pre-roll was enabled, only the mixer writes it
+    volatile bool enabled;      // the mixer writes the ring only when enabled
+} preroll_t;
+
 // recorder struct
 typedef struct {
     recorder_state_t state;     // state of the fsm
     
-    int16_t *buffer;            // pointer to the recorder buffer
+    int16_t *buffer;            // pointer to the capture buffer, reserved once and reused by every recording
     size_t buffer_capacity;     // max capacity of the buffer
     size_t buffer_used;         // size of the buffer is used
     
     int target_bank_index;      // target bank index for the new sample
+    record_destination_t destination; // memory or SD card
+    bool retroactive;           // the frames come from the pre-roll ring and are already in the buffer
+    bool auto_trim;             // the silence is trimmed and the peak normalized when a take is committed
+    volatile uint8_t source_mask; // voices summed into the recording (bit = bank index), RECORD_SOURCE_MASTER for the master
+
+    record_quantize_t quantize; // grid of the start and the stop
+    bool count_in;              // a bar of clicks before a quantized recording starts
+    volatile int32_t countdown; // ticks left before the start, -1 while waiting for the first grid point
+    volatile bool stop_pending; // the recording stops on the next grid point
+    uint32_t grid_frames;       // recorded frames up to the last grid point, a full buffer is cut there
     
     uint32_t start_time_ms;     // timestamp of the start (for debug purpose)
     uint32_t duration_ms;       // duration of the sample (for debug purpose)
@@ -45,7 +139,8 @@ typedef struct {
 extern recorder_t g_recorder;
 
 /*
-@brief function that initializes the recorder struct.
+@brief function that initializes the recorder struct, reserves the capture buffer
+and starts the task that stores the recordings.
 */
 void recorder_init(void);
 
@@ -61,17 +156,18 @@ void recorder_start_pad_selection(void);
 void recorder_select_pad(int gpio);
 
 /*
-@brief function that sets the recording state to REC_RECORDING, 
-resets the useful recording parameters and sets the timestamp.
+@brief function that sets the recording state to REC_RECORDING (REC_ARMED if quantized,
+the mixer starts it on the grid), resets the useful recording parameters and sets the timestamp.
 */
 void recorder_start_recording(void);
 
 /*
 @brief 
 function that stops the recording of the actual record buffer by 
-setting the recording state to IDLE, resetting all the useful recording
-parameters and saving the recorded sample in PSRAM 
-(freeing the previous sample PSRAM space if necessary).
+setting the recording state to REC_SAVING. A quantized recording keeps going
+until the next grid point, an armed one is dropped. The recorded frames are copied
+into a right-sized block of the sample arena in background (freeing the
+previous sample PSRAM space if necessary), then the state goes back to IDLE.
 */
 void recorder_stop_recording(void);
 
@@ -80,14 +176,104 @@ void recorder_stop_recording(void);
 */
 void recorder_cancel(void);
 
+/*
+@brief function called by the mixer with every finished block of the capture source (see recorder_set_source()).
+The block is copied into the pre-roll ring when enabled and, while recording, queued for the recorder task:
+it never blocks, allocates or logs. Quantized recordings start and stop here, on the metronome tick.
+@param block frames of the capture source.
+@param frames number of frames.
+@param tick_offset frame of the block on which the metronome ticks, -1 if none.
+*/
+void recorder_tap_block(const int16_t *block, size_t frames, int tick_offset);
+
+/*
+@brief function that enables or disables the silence trimming and the normalization of the new takes.
+@param enabled new state.
+*/
+void recorder_set_auto_trim(bool enabled);
+
+/*
+@brief getter function for the auto trim state.
+*/
+bool recorder_get_auto_trim(void);
+
+/*
+@brief function that scans a take for its start and end (threshold based), its peak and its RMS.
+The frames are read two at a time, a 32 bit word per read.
+@param frames the take, 4 byte aligned.
+@param count number of frames.
+@param out_analysis the result.
+*/
+void recorder_analyse(const int16_t *frames, size_t count, record_analysis_t *out_analysis);
+
+/*
+@brief function that sets what the next recordings capture: the master output, a single voice
+after its effects (to freeze it into a new sample) or a bus of voices.
+@param source_mask RECORD_SOURCE_MASTER, RECORD_SOURCE_VOICE(bank_index), RECORD_SOURCE_ALL_VOICES
+or any set of voices (bit = bank index).
+*/
+void recorder_set_source(uint8_t source_mask);
+
+/*
+@brief getter function for the capture source.
+*/
+uint8_t recorder_get_source(void);
+
+/*
+@brief function that sets the grid of the next recordings.
+@param quantize off, beat or bar.
+*/
+void recorder_set_quantize(record_quantize_t quantize);
+
+/*
+@brief getter function for the recording grid.
+*/
+record_quantize_t recorder_get_quantize(void);
+
+/*
+@brief function that enables or disables the count-in of the quantized recordings.
+@param enabled new state of the count-in.
+*/
+void recorder_set_count_in(bool enabled);
+
+/*
+@brief getter function for the count-in state.
+*/
+bool recorder_get_count_in(void);
+
+/*
+@brief function that tells if the recorder needs the metronome clicks even if the metronome is off:
+during the count-in and the recording that follows it.
+*/
+bool recorder_wants_clicks(void);
+
+/*
+@brief function that enables or disables the pre-roll ring. The ring is allocated the first time and then kept.
+@param enabled new state of the pre-roll.
+*/
+esp_err_t recorder_set_preroll(bool enabled);
+
+/*
+@brief getter function for the pre-roll state.
+*/
+bool recorder_get_preroll(void);
+
+/*
+@brief function that commits what has just been played (the content of the pre-roll ring) to a pad,
+chosen by the user, or to a new file on the SD card, following the recording destination.
+*/
+void recorder_capture(void);
+
+/*
+@brief function that sets where the next recordings go.
+@param destination memory or SD card.
+*/
+void recorder_set_destination(record_destination_t destination);
 
 /*
-@brief function that sets the new frame of the recording buffer using the
-buffer used parameter of the recording struct.
-@param frame frame from the master buffer that has to be copied into the
-recording buffer.
+@brief getter function for the recording destination.
 */
-void recorder_capture_frame(int16_t sample);
+record_destination_t recorder_get_destination(void);
 
 /*
 @brief getter function for the recording state.
@@ -0,0 +1,308 @@
+#include "looper.h"
+#include "mixer.h"
+#include "effects.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+const char* TAG_LOOP = "LOOPER";
+
+static looper_t looper = {
+    .target_bank_index = -1,
+    .source = LOOPER_SOURCE_MASTER,
+    .feedback = LOOPER_DEFAULT_FEEDBACK,
+    .handle = ARENA_INVALID_HANDLE,
+};
+
+/*
+@brief forgets every layer.
+*/
+static void looper_clear_history(void);
+
+/*
+@brief forgets the oldest layer, making room for a new one.
+*/
+static void looper_drop_oldest_layer(void);
+
+/*
+@brief saves the original value of a frame in the log. Returns false if the log is full.
+*/
+static inline bool looper_log_frame(uint32_t frame, int16_t value);
+
+esp_err_t looper_start(int bank_index) {
+    if (bank_index < 0 || bank_index >= SAMPLE_NUM || sample_bank[bank_index] == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // logging action + skip if in wrong state
+    if (looper.target_bank_index >= 0) {
+        ESP_LOGE(TAG_LOOP, "Already overdubbing sample %d", looper.target_bank_index);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the layer follows the playback frame by frame, it can't be pitched
+    if (get_pitch_factor(bank_index) != 1.0f) {
+        ESP_LOGE(TAG_LOOP, "Cannot overdub a pitched sample");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the frames are written in place, so the sample can't stay compressed
+    if (set_sample_encoding(bank_index, SAMPLE_PCM16) != ESP_OK) {
+        ESP_LOGE(TAG_LOOP, "Cannot overdub sample %d, switch it to PCM first", bank_index);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // the log is allocated the first time and then kept
+    if (looper.log == NULL) {
+        looper.log = heap_caps_malloc(LOOPER_UNDO_FRAMES * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+        if (looper.log == NULL) {
+            ESP_LOGE(TAG_LOOP, "Cannot allocate the undo log");
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    sample_t *smp = sample_bank[bank_index];
+    looper.touched = heap_caps_calloc((smp->total_frames + 7) / 8, 1, MALLOC_CAP_SPIRAM);
+    if (looper.touched == NULL) {
+        ESP_LOGE(TAG_LOOP, "Cannot allocate the layer map");
+        return ESP_ERR_NO_MEM;
+    }
+
+    // the block can't move while the mixer writes into it
+    looper.handle = smp->data_handle;
+    arena_pin(looper.handle);
+    looper.data = (int16_t *)smp->raw_data;
+    looper.total_frames = smp->total_frames;
+
+    // the history of another sample (or of replaced audio) can't be undone anymore
+    if (looper.layer_count > 0 && looper.layers[looper.layer_count - 1].handle != looper.handle) {
+        looper_clear_history();
+    }
+    if (looper.layer_count == LOOPER_UNDO_LAYERS) {
+        looper_drop_oldest_layer();
+    }
+
+    // a layer logs each frame at most once: the oldest layers make room for a whole pass,
+    // so the new layer doesn't overflow the log and take the whole history with it
+    while (looper.layer_count > 0 && LOOPER_UNDO_FRAMES - looper.log_used < looper.total_frames) {
+        looper_drop_oldest_layer();
+    }
+
+    // the new layer starts with no spans
+    looper.layers[looper.layer_count] = (looper_layer_t){
+        .bank_index = bank_index,
+        .handle = looper.handle,
+        .first_span = looper.span_count,
+        .span_count = 0,
+    };
+    looper.log_overflow = false;
+
+    // from now on the mixer writes the layer
+    __atomic_store_n(&looper.target_bank_index, bank_index, __ATOMIC_SEQ_CST);
+
+    // logging action
+    ESP_LOGI(TAG_LOOP, "Overdubbing sample %d", bank_index);
+    return ESP_OK;
+}
+
+void looper_stop(void) {
+    int bank_index = looper.target_bank_index;
+    if (bank_index < 0) return;
+
+    // the mixer may be finishing a block
+    __atomic_store_n(&looper.target_bank_index, -1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&looper.writing, __ATOMIC_SEQ_CST)) {
+        vTaskDelay(1);
+    }
+
+    looper_layer_t *layer = &looper.layers[looper.layer_count];
+    layer->span_count = looper.span_count - layer->first_span;
+
+    if (looper.log_overflow) {
+        // the layer can't be undone, and the older ones can't be undone without it
+        ESP_LOGW(TAG_LOOP, "The layer didn't fit in the undo log, the history is dropped");
+        looper_clear_history();
+    } else if (layer->span_count > 0) {
+        looper.layer_count++;
+    }
+
+    // the audio differs from the copy on the SD card
+    if (layer->span_count > 0 || looper.log_overflow) {
+        if (sample_bank[bank_index] != NULL && sample_bank[bank_index]->data_handle == looper.handle) {
+            sample_bank[bank_index]->dirty |= SAMPLE_DIRTY_AUDIO;
+        }
+    }
+
+    arena_unpin(looper.handle);
+    looper.handle = ARENA_INVALID_HANDLE;
+    looper.data = NULL;
+
+    heap_caps_free(looper.touched);
+    looper.touched = NULL;
+
+    // logging action
+    ESP_LOGI(TAG_LOOP, "Overdub stopped, %u layers can be undone", looper.layer_count);
+}
+
+esp_err_t looper_undo(void) {
+    // logging action + skip if in wrong state
+    if (looper.target_bank_index >= 0) {
+        ESP_LOGE(TAG_LOOP, "Stop overdubbing before undoing");
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (looper.layer_count == 0) {
+        ESP_LOGW(TAG_LOOP, "Nothing to undo");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    looper_layer_t *layer = &looper.layers[looper.layer_count - 1];
+    sample_t *smp = sample_bank[layer->bank_index];
+
+    // the audio was replaced after the layer was recorded
+    if (smp == NULL || smp->data_handle != layer->handle) {
+        ESP_LOGW(TAG_LOOP, "The audio of sample %d changed, the history is dropped", layer->bank_index);
+        looper_clear_history();
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    arena_pin(layer->handle);
+    int16_t *data = (int16_t *)smp->raw_data;
+
+    // the spans are restored in reverse order, so the oldest values win
+    for (int i = layer->first_span + layer->span_count - 1; i >= layer->first_span; i--) {
+        looper_span_t *span = &looper.spans[i];
+        memcpy(data + span->start, looper.log + span->offset, span->count * sizeof(int16_t));
+    }
+
+    smp->dirty |= SAMPLE_DIRTY_AUDIO;
+    arena_unpin(layer->handle);
+
+    // the loop crossfade holds a copy of the undone layer
+    mixer_audio_changed(layer->bank_index);
+
+    // the log space of the layer is freed
+    if (layer->span_count > 0) {
+        looper.log_used = looper.spans[layer->first_span].offset;
+    }
+    looper.span_count = layer->first_span;
+    looper.layer_count--;
+
+    // logging action
+    ESP_LOGI(TAG_LOOP, "Layer undone on sample %d, %u left", layer->bank_index, looper.layer_count);
+    return ESP_OK;
+}
+
+static inline bool looper_log_frame(uint32_t frame, int16_t value) {
+    if (looper.log_used == LOOPER_UNDO_FRAMES) return false;
+
+    // the frame continues the last span of the layer, or opens a new one
+    looper_layer_t *layer = &looper.layers[looper.layer_count];
+    looper_span_t *span = looper.span_count > layer->first_span ? &looper.spans[looper.span_count - 1] : NULL;
+    if (span == NULL || span->start + span->count != frame) {
+        if (looper.span_count == LOOPER_UNDO_SPANS) return false;
+
+        span = &looper.spans[looper.span_count++];
+        span->start = frame;
+        span->count = 0;
+        span->offset = looper.log_used;
+    }
+
+    looper.log[looper.log_used++] = value;
+    span->count++;
+    return true;
+}
+
+void looper_write_block(int bank_index, const uint32_t *frames, const int16_t *input, size_t count) {
+    __atomic_store_n(&looper.writing, true, __ATOMIC_SEQ_CST);
+
+    // the layer may have been stopped while the block was rendered
+    if (__atomic_load_n(&looper.target_bank_index, __ATOMIC_SEQ_CST) != bank_index) {
+        __atomic_store_n(&looper.writing, false, __ATOMIC_SEQ_CST);
+        return;
+    }
+
+    float feedback = looper.feedback;
+
+    for (size_t i = 0; i < count; i++) {
+        uint32_t frame = frames[i];
+        if (frame >= looper.total_frames) continue;
+
+        int16_t old = looper.data[frame];
+
+        // the value before the layer is saved only the first time the layer writes the frame
+        uint8_t bit = 1 << (frame & 7);
+        if (!looper.log_overflow && (looper.touched[frame >> 3] & bit) == 0) {
+            if (looper_log_frame(frame, old)) {
+                looper.touched[frame >> 3] |= bit;
+            } else {
+                looper.log_overflow = true;
+            }
+        }
+
+        int32_t mixed = (int32_t)(old * feedback) + input[i];
+        if (mixed > MAX_CLIPPING) mixed = MAX_CLIPPING;
+        if (mixed < MIN_CLIPPING) mixed = MIN_CLIPPING;
+        looper.data[frame] = (int16_t)mixed;
+    }
+
+    __atomic_store_n(&looper.writing, false, __ATOMIC_SEQ_CST);
+}
+
+static void looper_clear_history(void) {
+    looper.layer_count = 0;
+    looper.span_count = 0;
+    looper.log_used = 0;
+}
+
+static void looper_drop_oldest_layer(void) {
+    looper_layer_t *oldest = &looper.layers[0];
+    uint16_t spans = oldest->span_count;
+    uint32_t frames = looper.span_count > spans ? looper.spans[spans].offset : looper.log_used;
+
+    // the log and the spans are shifted down
+    memmove(looper.log, looper.log + frames, (looper.log_used - frames) * sizeof(int16_t));
+    looper.log_used -= frames;
+
+    memmove(looper.spans, looper.spans + spans, (looper.span_count - spans) * sizeof(looper_span_t));
+    looper.span_count -= spans;
+    for (int i = 0; i < looper.span_count; i++) {
+        looper.spans[i].offset -= frames;
+    }
+
+    memmove(looper.layers, looper.layers + 1, (looper.layer_count - 1) * sizeof(looper_layer_t));
+    looper.layer_count--;
+    for (int i = 0; i < looper.layer_count; i++) {
+        looper.layers[i].first_span -= spans;
+    }
+}
+
+int looper_get_target(void) {
+    return looper.target_bank_index;
+}
+
+void looper_set_source(int source) {
+    if (source < LOOPER_SOURCE_MASTER || source >= SAMPLE_NUM) return;
+
+    looper.source = source;
+}
+
+int looper_get_source(void) {
+    return looper.source;
+}
+
+void looper_set_feedback(float feedback) {
+    if (feedback < 0.0f) feedback = 0.0f;
+    if (feedback > 1.0f) feedback = 1.0f;
+
+    looper.feedback = feedback;
+}
+
+float looper_get_feedback(void) {
+    return looper.feedback;
+}
+
+uint8_t looper_get_undo_count(void) {
+    return looper.layer_count;
+}
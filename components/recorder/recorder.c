@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
@@ -11,22 +12,115 @@
 #include "lcd.h"
 #include "sd_reader.h"
 #include "effects.h"
+#include "metronome.h"
+#include "esp_timer.h"
 
 const char* TAG_REC = "REC";
 
 recorder_t g_recorder = {0};
 
 
+// task that consumes the blocks published by the mixer
+static TaskHandle_t rec_task_handle = NULL;
+
+// blocks on their way from the mixer to the recorder task
+static frame_ring_t rec_ring;
+
+// last seconds of master output, for the retroactive captures
+static preroll_t preroll = {0};
+
+// frames queued by the mixer since the recording started, only the mixer uses it
+static uint32_t tap_frames = 0;
+
+/*
+@brief empties the ring into the capture buffer or the SD card. It stops the recording when the buffer is full
+and completes it (commit or end of the stream) once stopped.
+*/
+static void recorder_task(void *pvParameters);
+
+/*
+@brief moves the frames of the ring into the capture buffer. Returns false when the buffer is full.
+*/
+static bool recorder_drain_to_memory(void);
+
+/*
+@brief moves the frames of the ring to the SD card.
+@param chunk scratch buffer of RECORD_CHUNK_FRAMES frames.
+@param write_failed set when a write fails, the following frames are discarded.
+*/
+static void recorder_drain_to_sd(int16_t *chunk, bool *write_failed);
+
+/*
+@brief moves the recorded frames into the target sample, replacing its audio.
+*/
+static void recorder_commit(void);
+
+/*
+@brief sets the target bank of the recording to the one mapped to the pad, mapping a new one if needed.
+@param gpio the gpio of the button pressed.
+*/
+static void recorder_map_pad(int gpio);
+
+/*
+@brief switches a running recording to REC_SAVING and wakes up the recorder task.
+Returns false if the recording was already stopped (i.e. by the mixer, on the grid).
+*/
+static bool recorder_end_recording(void);
+
+/*
+@brief peak level of a run of frames, read a 32 bit word (two frames) at a time.
+@param frames the frames, 4 byte aligned.
+@param count number of frames.
+*/
+static uint16_t recorder_peak(const int16_t *frames, size_t count);
+
+/*
+@brief sum of the squares of a run of frames, read a 32 bit word (two frames) at a time.
+@param frames the frames, 4 byte aligned.
+@param count number of frames.
+*/
+static uint64_t recorder_energy(const int16_t *frames, size_t count);
+
+/*
+@brief number of metronome ticks between two grid points of a quantized recording.
+*/
+static uint32_t recorder_grid_ticks(void);
+
+/*
+@brief copies the content of the pre-roll ring, from the oldest frame up to head, into the capture buffer.
+Returns the number of frames copied.
+@param head position of the ring latched when the capture was asked.
+*/
+static size_t recorder_snapshot_preroll(uint32_t head);
+
 void recorder_init(void) {
     // set all the parameters
     g_recorder.buffer_capacity = RECORD_BUFFER_SIZE;
     g_recorder.buffer_used = 0;
     g_recorder.state = REC_IDLE;
     g_recorder.target_bank_index = -1;
+    g_recorder.destination = REC_TO_MEMORY;
+    g_recorder.quantize = REC_QUANTIZE_OFF;
+    g_recorder.count_in = false;
+    g_recorder.auto_trim = true;
+    g_recorder.source_mask = RECORD_SOURCE_MASTER;
+
+    if (frame_ring_init(&rec_ring, RECORD_RING_FRAMES, MALLOC_CAP_SPIRAM) != ESP_OK) {
+        ESP_LOGE(TAG_REC, "Cannot allocate the record ring, recording is disabled");
+        return;
+    }
+
+    // the capture buffer is reserved only once, so starting a recording never allocates
+    g_recorder.buffer = heap_caps_malloc(RECORD_BUFFER_SIZE * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (g_recorder.buffer == NULL) {
+        ESP_LOGE(TAG_REC, "Cannot reserve the record buffer, only recording to SD is available");
+    }
+
+    xTaskCreate(recorder_task, "rec_task", RECORD_TASK_STACK, NULL, RECORD_TASK_PRIORITY, &rec_task_handle);
     
     // logging action
     ESP_LOGI(TAG_REC, "Recorder initialized (buffer: %zu frames, %.1f sec max)",
-           RECORD_BUFFER_SIZE / 2,
+           (size_t)RECORD_BUFFER_SIZE,
            (float)RECORD_MAX_DURATION_SEC);
 
 }
@@ -55,6 +149,13 @@ void recorder_select_pad(int gpio) {
         return;
     }
     
+    recorder_map_pad(gpio);
+
+    // start recording
+    recorder_start_recording();
+}
+
+static void recorder_map_pad(int gpio) {
     // map pad to sample
     g_recorder.target_bank_index = get_sample_bank_index(gpio);
     if (g_recorder.target_bank_index == NOT_DEFINED){
@@ -64,9 +165,6 @@ void recorder_select_pad(int gpio) {
     
     // logging action
     ESP_LOGI(TAG_REC, "Sample slot: %d", g_recorder.target_bank_index);
-
-    // start recording
-    recorder_start_recording();
 }
 
 void recorder_start_recording(void) {
@@ -75,127 +173,271 @@ void recorder_start_recording(void) {
         ESP_LOGE(TAG_REC, "State not valid to start recording");
         return;
     }
-    
-    // allocate space for buffer
-    g_recorder.buffer = heap_caps_calloc(1, RECORD_BUFFER_SIZE * sizeof(int16_t), MALLOC_CAP_SPIRAM);
 
-    // logging action + don't start recording if there is no space in PSRAM
-    if (!g_recorder.buffer) {
-        ESP_LOGE(TAG_REC, "Cannot allocate record buffer");
+    // logging action + don't start recording if the recorder couldn't be initialized
+    if (rec_task_handle == NULL) {
+        ESP_LOGE(TAG_REC, "Recorder not available");
         return;
     }
     
+    // print on screen
+    bool quantized = g_recorder.quantize != REC_QUANTIZE_OFF;
+    char *line1 = quantized ? "Armed..." : "Recording...";
+    char line2[17] = "";
+
+    if (g_recorder.destination == REC_TO_SD) {
+        // logging action + don't start recording if the stream is not available
+        if (st_stream_open(NULL) != ESP_OK) {
+            ESP_LOGE(TAG_REC, "Cannot stream to the SD card");
+            return;
+        }
+        sprintf(line2, "To SD card");
+    } else {
+        // logging action + don't start recording if the buffer couldn't be reserved at boot
+        if (g_recorder.buffer == NULL) {
+            ESP_LOGE(TAG_REC, "No record buffer available");
+            return;
+        }
+        uint8_t pad_num = g_recorder.target_bank_index + 1;
+        sprintf(line2, "Pad %u", pad_num); //button is presset
+    }
+    
     // reset fields
+    frame_ring_reset(&rec_ring);
     g_recorder.buffer_capacity = RECORD_BUFFER_SIZE;
     g_recorder.buffer_used = 0;
     g_recorder.start_time_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
-
-    // print on screen
-    char line1[] = "Recording...";
-    char line2[17] = "";
-    
-    uint8_t pad_num = g_recorder.target_bank_index + 1;
-
-    sprintf(line2, "Pad %u", pad_num); //button is presset
+    g_recorder.countdown = -1;
+    g_recorder.stop_pending = false;
+    g_recorder.grid_frames = 0;
 
     print_double(line1, line2);
     
-    // change state
-    g_recorder.state = REC_RECORDING;
+    // change state and wake up the recorder task, a quantized recording is started by the mixer on the grid
+    g_recorder.state = quantized ? REC_ARMED : REC_RECORDING;
+    xTaskNotifyGive(rec_task_handle);
     
     // logging action
-    ESP_LOGI(TAG_REC, "Recording started on sample %d", g_recorder.target_bank_index);
+    ESP_LOGI(TAG_REC, "Recording %s on sample %d", quantized ? "armed" : "started", g_recorder.target_bank_index);
 }
 
 void recorder_stop_recording(void) {
+    // an armed recording that didn't start is dropped
+    recorder_state_t expected = REC_ARMED;
+    if (__atomic_compare_exchange_n(&g_recorder.state, &expected, REC_SAVING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        ESP_LOGI(TAG_REC, "Armed recording dropped");
+        xTaskNotifyGive(rec_task_handle);
+        return;
+    }
+
     // logging action + skip if in wrong state
     if (g_recorder.state != REC_RECORDING) {
         ESP_LOGE(TAG_REC, "Trying to stop a recording that did't start.");
         return;
     }
-    
-    // change state
-    g_recorder.state = REC_IDLE;
-    
-    // sets some fields
-    uint32_t frames_recorded = g_recorder.buffer_used;
-    g_recorder.duration_ms = (xTaskGetTickCount() * portTICK_PERIOD_MS) - g_recorder.start_time_ms;
-    float duration_sec = (float)frames_recorded / RECORD_SAMPLE_RATE;
-    
+
+    // a quantized recording is stopped by the mixer, on the next grid point
+    if (g_recorder.quantize != REC_QUANTIZE_OFF) {
+        g_recorder.stop_pending = true;
+        print_double("Stopping...", "On the grid");
+
+        // logging action
+        ESP_LOGI(TAG_REC, "Recording stops on the next grid point");
+        return;
+    }
+
+    recorder_end_recording();
+}
+
+static bool recorder_end_recording(void) {
+    // change state: the mixer stops publishing, the recorder task completes the recording
+    recorder_state_t expected = REC_RECORDING;
+    if (!__atomic_compare_exchange_n(&g_recorder.state, &expected, REC_SAVING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
     // logging action
-    ESP_LOGI(TAG_REC, "Recording stopped: %.2f seconds (%lu frames)", duration_sec, frames_recorded);
-    
-    // put the sample in sample_bank if possible, otherwise log error
-    if (g_recorder.target_bank_index >= 0 && g_recorder.target_bank_index < SAMPLE_NUM) {
-        sample_t *target = sample_bank[g_recorder.target_bank_index];
+    ESP_LOGI(TAG_REC, "Recording stopped after %lu ms", (xTaskGetTickCount() * portTICK_PERIOD_MS) - g_recorder.start_time_ms);
+
+    xTaskNotifyGive(rec_task_handle);
+    return true;
+}
 
-        // if not in memory allocate space
-        if (target == NULL){
+static uint32_t recorder_grid_ticks(void) {
+    uint32_t ticks = get_metronome_subdiv();
+    if (g_recorder.quantize == REC_QUANTIZE_BAR) ticks *= RECORD_BEATS_PER_BAR;
+    return ticks;
+}
 
-            //logging action
-            ESP_LOGI(TAG_REC, "Creating new sample_t for bank %d", g_recorder.target_bank_index);
+static void recorder_task(void *pvParameters) {
+    // the chunk is in internal RAM, so the card driver doesn't need a bounce buffer
+    int16_t *chunk = malloc(RECORD_CHUNK_FRAMES * sizeof(int16_t));
+    assert(chunk);
 
-            target = heap_caps_calloc(1, sizeof(sample_t), MALLOC_CAP_SPIRAM);
+    bool write_failed = false;
 
-            // logging action + free memory + return
-            if (target == NULL) {
-                ESP_LOGE(TAG_REC, "Cannot allocate sample_t structure");
-                if (g_recorder.buffer) {
-                    heap_caps_free(g_recorder.buffer);
-                    g_recorder.buffer = NULL;
-                }
-                return;
-            }
+    for (;;) {
+        recorder_state_t state = g_recorder.state;
+        bool active = state == REC_ARMED || state == REC_RECORDING || state == REC_SAVING;
 
-            // set some default values of the sample_t
-            sample_bank[g_recorder.target_bank_index] = target;
+        // sleeps until a recording starts, then wakes up periodically to empty the ring
+        ulTaskNotifyTake(pdTRUE, active ? pdMS_TO_TICKS(RECORD_POLL_MS) : portMAX_DELAY);
+        if (!active) {
+            write_failed = false;
+            continue;
         }
 
-        // if there is already a sample bound to that bank_index 
-        // and if it's not in flash memory then free it
-        if (target->raw_data != NULL) {
+        // the state is read before emptying the ring: once stopped, the mixer doesn't publish anymore
+        bool stopping = g_recorder.state == REC_SAVING;
+
+        if (g_recorder.destination == REC_TO_SD) {
+            recorder_drain_to_sd(chunk, &write_failed);
+        } else if (!recorder_drain_to_memory() && !stopping) {
+            // the buffer is full: the recording stops here, and the recorder fsm is woken up
+            ESP_LOGW(TAG_REC, "Buffer full!");
+
+            // if a stop is pending, the recorder fsm isn't waiting for the press anymore
+            if (recorder_end_recording() && !g_recorder.stop_pending) {
+                fsm_queue_msg_t msg = {
+                    .payload = PRESS,
+                    .source = JOYSTICK
+                };
+                xQueueSend(fsm_queue, &msg, 0);
+            }
+            continue;
+        }
 
-            //logging action
-            ESP_LOGE(TAG_REC, "Raw data is not NULL");
-            
-            // free memory
-            heap_caps_free((void *)(target->raw_data));
+        if (!stopping) continue;
+
+        // a quantized recording cut by the full buffer ends on its last grid point
+        if (g_recorder.quantize != REC_QUANTIZE_OFF && g_recorder.destination == REC_TO_MEMORY && !g_recorder.retroactive
+            && g_recorder.grid_frames > 0 && g_recorder.buffer_used > g_recorder.grid_frames) {
+            g_recorder.buffer_used = g_recorder.grid_frames;
         }
-        
-        // allocate space for the new sample in PSRAM
-        size_t bytes = g_recorder.buffer_used * sizeof(int16_t);
-        int16_t *final_buffer = heap_caps_realloc(g_recorder.buffer, bytes, MALLOC_CAP_SPIRAM);
-        
-        // if final buffer is allocated associate it to the target raw data
-        // otherwise it means that there is no free space, so associates 
-        // directly the g_recorder.buffer to the target raw data
-        if (final_buffer) {
-            target -> raw_data = (unsigned char *)final_buffer;
+        g_recorder.duration_ms = (uint64_t)g_recorder.buffer_used * 1000 / RECORD_SAMPLE_RATE;
+
+        if (rec_ring.overruns > 0) {
+            ESP_LOGW(TAG_REC, "%lu frames lost, the recorder was too slow", (unsigned long)rec_ring.overruns);
+        }
+        ESP_LOGI(TAG_REC, "Recorded %.2f seconds (%zu frames)", (float)g_recorder.buffer_used / RECORD_SAMPLE_RATE, g_recorder.buffer_used);
+
+        if (g_recorder.destination == REC_TO_SD) {
+            // a capture is written all at once, from the buffer
+            if (g_recorder.retroactive && st_stream_write(g_recorder.buffer, g_recorder.buffer_used) != ESP_OK) {
+                ESP_LOGE(TAG_REC, "Error while writing the capture to the SD card");
+            }
+            st_stream_close();
         } else {
-            target -> raw_data = (unsigned char *)g_recorder.buffer;
+            recorder_commit();
         }
 
-        sample_names_bank[g_recorder.target_bank_index] = NULL;
+        // the recorder can be used again
+        g_recorder.buffer_used = 0;
+        g_recorder.retroactive = false;
+        g_recorder.state = REC_IDLE;
+    }
+}
+
+static bool recorder_drain_to_memory(void) {
+    // the frames are copied straight into the capture buffer
+    while (g_recorder.buffer_used < g_recorder.buffer_capacity) {
+        size_t space = g_recorder.buffer_capacity - g_recorder.buffer_used;
+        size_t count = frame_ring_pop(&rec_ring, g_recorder.buffer + g_recorder.buffer_used,
+                                      space < RECORD_CHUNK_FRAMES ? space : RECORD_CHUNK_FRAMES);
+        if (count == 0) return true;
+
+        g_recorder.buffer_used += count;
+    }
+
+    // the buffer is full, what's left in the ring is dropped
+    int16_t discard[BUFF_SIZE];
+    while (frame_ring_pop(&rec_ring, discard, BUFF_SIZE) > 0);
+    return false;
+}
 
+static void recorder_drain_to_sd(int16_t *chunk, bool *write_failed) {
+    size_t count;
+    while ((count = frame_ring_pop(&rec_ring, chunk, RECORD_CHUNK_FRAMES)) > 0) {
+        g_recorder.buffer_used += count;
+        if (!*write_failed && st_stream_write(chunk, count) != ESP_OK) {
+            // i.e. the card is full: the rest of the recording is lost, but the file stays valid
+            ESP_LOGE(TAG_REC, "Error while streaming to the SD card");
+            *write_failed = true;
+        }
+    }
+}
+
+static void recorder_commit(void) {
+    // put the sample in sample_bank if possible, otherwise log error
+    if (g_recorder.target_bank_index < 0 || g_recorder.target_bank_index >= SAMPLE_NUM) {
         // logging action
-        ESP_LOGI(TAG_REC, "Buffer used: %d", g_recorder.buffer_used);
+        ESP_LOGE(TAG_REC, "Wrong bank index in record mode: %d.", g_recorder.target_bank_index);
+        return;
+    }
 
-        uint32_t actual_data_size = g_recorder.buffer_used * sizeof(int16_t);
+    if (g_recorder.buffer_used == 0) {
+        ESP_LOGW(TAG_REC, "Nothing was recorded");
+        return;
+    }
+
+    // the whole take is kept, with start and end pointers on the sound and a gain for the peak
+    record_analysis_t analysis = {
+        .start = 0,
+        .end = g_recorder.buffer_used - 1,
+        .gain = 1.0f,
+    };
+    if (g_recorder.auto_trim) {
+        int64_t analysis_start = esp_timer_get_time();
+        recorder_analyse(g_recorder.buffer, g_recorder.buffer_used, &analysis);
+
+        // a quantized take is already a whole number of beats, it's not trimmed
+        if (g_recorder.quantize != REC_QUANTIZE_OFF && !g_recorder.retroactive) {
+            analysis.start = 0;
+            analysis.end = g_recorder.buffer_used - 1;
+        }
 
-        sample_init(target, actual_data_size, g_recorder.target_bank_index);
-        
-        // reset the fields in the recording struct and free memory
-        g_recorder.buffer = NULL;
-        g_recorder.buffer_used = 0;
-        
         // logging action
-        ESP_LOGI(TAG_REC, "Sample %d updated.", g_recorder.target_bank_index);
+        ESP_LOGI(TAG_REC, "Analysed in %lld us: frames %lu-%lu, peak %u, rms %u, gain %.2f",
+                 esp_timer_get_time() - analysis_start, analysis.start, analysis.end, analysis.peak, analysis.rms, analysis.gain);
+    }
 
+    // right-sized block for the new audio
+    size_t bytes = g_recorder.buffer_used * sizeof(int16_t);
+    unsigned char *new_data = NULL;
+    arena_handle_t new_handle = arena_alloc(bytes, (void **)&new_data);
+    if (new_handle == ARENA_INVALID_HANDLE) {
+        ESP_LOGE(TAG_REC, "Cannot allocate %zu bytes for the recorded sample", bytes);
+        return;
+    }
+
+    arena_pin(new_handle);
+    if (analysis.gain == 1.0f) {
+        memcpy(new_data, g_recorder.buffer, bytes);
     } else {
+        // the gain is applied while copying, no extra pass
+        int16_t *dst = (int16_t *)new_data;
+        for (size_t i = 0; i < g_recorder.buffer_used; i++) {
+            int32_t value = g_recorder.buffer[i] * analysis.gain;
+            if (value > MAX_CLIPPING) value = MAX_CLIPPING;
+            if (value < MIN_CLIPPING) value = MIN_CLIPPING;
+            dst[i] = value;
+        }
+    }
 
-        // logging action
-        ESP_LOGE(TAG_REC, "Wrong bank index in record mode: %d.", g_recorder.target_bank_index);
+    // logging action
+    ESP_LOGI(TAG_REC, "Buffer used: %d", g_recorder.buffer_used);
+
+    if (sample_replace_audio(g_recorder.target_bank_index, new_handle, bytes) != ESP_OK) {
+        ESP_LOGE(TAG_REC, "Cannot store the recording in bank %d", g_recorder.target_bank_index);
+        return;
     }
+
+    // the silence is left out by the pointers, so it can still be recovered with the chopping menu
+    set_sample_end_ptr(g_recorder.target_bank_index, analysis.end);
+    set_sample_start_ptr(g_recorder.target_bank_index, (float)analysis.start);
+    
+    // logging action
+    ESP_LOGI(TAG_REC, "Sample %d updated.", g_recorder.target_bank_index);
 }
 
 void recorder_cancel(void) {
@@ -208,27 +450,325 @@ void recorder_cancel(void) {
     ESP_LOGI(TAG_REC, "Recording canceled.");
 }
 
-void recorder_capture_frame(int16_t sample) {
+void recorder_tap_block(const int16_t *block, size_t frames, int tick_offset) {
+    if (preroll.enabled) {
+        // the oldest frames are overwritten, at most two copies per block
+        uint32_t head = preroll.head;
+        uint32_t pos = head & preroll.mask;
+        size_t first = RECORD_PREROLL_FRAMES - pos;
+        if (first > frames) first = frames;
+
+        memcpy(preroll.frames + pos, block, first * sizeof(int16_t));
+        memcpy(preroll.frames, block + first, (frames - first) * sizeof(int16_t));
+
+        // publish the frames only after they are written
+        __atomic_store_n(&preroll.head, head + frames, __ATOMIC_RELEASE);
+    }
+
+    if (g_recorder.state == REC_ARMED) {
+        // the recording can only start on a tick
+        if (tick_offset < 0) return;
+
+        // the first grid point starts the count-in, or the recording
+        if (g_recorder.countdown < 0 && get_metronome_tick_count() % recorder_grid_ticks() == 0) {
+            g_recorder.countdown = g_recorder.count_in ? RECORD_BEATS_PER_BAR * get_metronome_subdiv() : 0;
+        }
+        if (g_recorder.countdown != 0) {
+            if (g_recorder.countdown > 0) g_recorder.countdown--;
+            return;
+        }
+
+        // it may have been stopped meanwhile
+        recorder_state_t expected = REC_ARMED;
+        if (!__atomic_compare_exchange_n(&g_recorder.state, &expected, REC_RECORDING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+
+        // the recording starts exactly on the tick
+        tap_frames = 0;
+        block += tick_offset;
+        frames -= tick_offset;
+        tick_offset = -1;
+    }
+
+    if (g_recorder.state != REC_RECORDING) return;
+
+    if (g_recorder.quantize != REC_QUANTIZE_OFF && tick_offset >= 0
+        && get_metronome_tick_count() % recorder_grid_ticks() == 0) {
+        // grid point: the recording so far is a whole number of beats (or bars)
+        g_recorder.grid_frames = tap_frames + tick_offset;
+
+        if (g_recorder.stop_pending) {
+            // the recording ends exactly on the tick
+            tap_frames += frame_ring_push(&rec_ring, block, tick_offset);
+
+            recorder_state_t expected = REC_RECORDING;
+            __atomic_compare_exchange_n(&g_recorder.state, &expected, REC_SAVING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            return;
+        }
+    }
+
+    // a full ring drops the block, it's counted in the overruns
+    tap_frames += frame_ring_push(&rec_ring, block, frames);
+}
+
+static uint16_t recorder_peak(const int16_t *frames, size_t count) {
+    uint32_t peak = 0;
+
+    for (size_t i = 0; i < count / 2; i++) {
+        // two frames per load, through memcpy so the int16 buffer is not read through a uint32 pointer
+        uint32_t word;
+        memcpy(&word, frames + 2 * i, sizeof(word));
+        int32_t a = (int16_t)(word & 0xFFFF);
+        int32_t b = (int16_t)(word >> 16);
+
+        // branchless absolute values
+        a = (a ^ (a >> 31)) - (a >> 31);
+        b = (b ^ (b >> 31)) - (b >> 31);
+        if ((uint32_t)a > peak) peak = a;
+        if ((uint32_t)b > peak) peak = b;
+    }
+    if (count & 1) {
+        int32_t a = frames[count - 1];
+        a = (a ^ (a >> 31)) - (a >> 31);
+        if ((uint32_t)a > peak) peak = a;
+    }
+
+    // |-32768| doesn't fit
+    return peak > MAX_CLIPPING ? MAX_CLIPPING : peak;
+}
+
+static uint64_t recorder_energy(const int16_t *frames, size_t count) {
+    uint64_t energy = 0;
+
+    for (size_t i = 0; i < count / 2; i++) {
+        uint32_t word;
+        memcpy(&word, frames + 2 * i, sizeof(word));
+        int32_t a = (int16_t)(word & 0xFFFF);
+        int32_t b = (int16_t)(word >> 16);
+
+        // both squares fit 31 bits, so their sum fits 32
+        energy += (uint32_t)(a * a) + (uint32_t)(b * b);
+    }
+    if (count & 1) {
+        int32_t a = frames[count - 1];
+        energy += (uint32_t)(a * a);
+    }
+
+    return energy;
+}
+
+void recorder_analyse(const int16_t *frames, size_t count, record_analysis_t *out_analysis) {
+    out_analysis->start = 0;
+    out_analysis->end = count > 0 ? count - 1 : 0;
+    out_analysis->peak = 0;
+    out_analysis->rms = 0;
+    out_analysis->gain = 1.0f;
+
+    // first block with sound
+    size_t first = count;
+    for (size_t block = 0; block < count; block += RECORD_ANALYSIS_BLOCK) {
+        size_t frames_num = count - block < RECORD_ANALYSIS_BLOCK ? count - block : RECORD_ANALYSIS_BLOCK;
+        if (recorder_peak(frames + block, frames_num) > RECORD_TRIM_THRESHOLD) {
+            first = block;
+            break;
+        }
+    }
+
+    // only silence: the take is left as it is
+    if (first == count) return;
+
+    // last block with sound, there's at least the first one
+    size_t last_block = (count - 1) / RECORD_ANALYSIS_BLOCK * RECORD_ANALYSIS_BLOCK;
+    size_t last_block_frames = count - last_block;
+    while (recorder_peak(frames + last_block, last_block_frames) <= RECORD_TRIM_THRESHOLD) {
+        last_block -= RECORD_ANALYSIS_BLOCK;
+        last_block_frames = RECORD_ANALYSIS_BLOCK;
+    }
+
+    // the level of the sound, measured on whole blocks
+    size_t sound_frames = last_block + last_block_frames - first;
+    out_analysis->peak = recorder_peak(frames + first, sound_frames);
+    out_analysis->rms = sqrtf((float)recorder_energy(frames + first, sound_frames) / sound_frames);
+
+    // the exact frames, inside the first and the last block
+    size_t last = last_block + last_block_frames - 1;
+    while (abs(frames[first]) <= RECORD_TRIM_THRESHOLD) first++;
+    while (abs(frames[last]) <= RECORD_TRIM_THRESHOLD) last--;
+
+    out_analysis->start = first > RECORD_TRIM_MARGIN_FRAMES ? first - RECORD_TRIM_MARGIN_FRAMES : 0;
+    out_analysis->end = last + RECORD_TRIM_MARGIN_FRAMES < count ? last + RECORD_TRIM_MARGIN_FRAMES : count - 1;
+
+    // a take that is only noise is not raised
+    if (out_analysis->rms >= RECORD_MIN_RMS) {
+        float gain = (float)RECORD_NORMALIZE_PEAK / out_analysis->peak;
+        out_analysis->gain = gain > RECORD_NORMALIZE_MAX_GAIN ? RECORD_NORMALIZE_MAX_GAIN : gain;
+    }
+}
+
+void recorder_set_source(uint8_t source_mask) {
+    // the source can't change during a recording
+    if (g_recorder.state != REC_IDLE) return;
+
+    g_recorder.source_mask = source_mask;
+}
+
+uint8_t recorder_get_source(void) {
+    return g_recorder.source_mask;
+}
+
+void recorder_set_auto_trim(bool enabled) {
+    g_recorder.auto_trim = enabled;
+}
+
+bool recorder_get_auto_trim(void) {
+    return g_recorder.auto_trim;
+}
+
+void recorder_set_quantize(record_quantize_t quantize) {
+    // the grid can't change during a recording
+    if (g_recorder.state != REC_IDLE) return;
+
+    g_recorder.quantize = quantize;
+}
+
+record_quantize_t recorder_get_quantize(void) {
+    return g_recorder.quantize;
+}
+
+void recorder_set_count_in(bool enabled) {
+    g_recorder.count_in = enabled;
+}
+
+bool recorder_get_count_in(void) {
+    return g_recorder.count_in;
+}
+
+bool recorder_wants_clicks(void) {
+    // the clicks go on after the count-in, so the recording can follow them
+    return g_recorder.count_in && (g_recorder.state == REC_ARMED || g_recorder.state == REC_RECORDING)
+        && g_recorder.quantize != REC_QUANTIZE_OFF;
+}
+
+esp_err_t recorder_set_preroll(bool enabled) {
+    if (enabled && preroll.frames == NULL) {
+        // allocated once, the mixer may still be reading the pointer after a disable
+        preroll.frames = heap_caps_malloc(RECORD_PREROLL_FRAMES * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+        if (preroll.frames == NULL) {
+            ESP_LOGE(TAG_REC, "Cannot allocate the pre-roll ring");
+            return ESP_ERR_NO_MEM;
+        }
+        preroll.mask = RECORD_PREROLL_FRAMES - 1;
+    }
+
+    if (enabled && !preroll.enabled) {
+        // what was played while disabled is not valid anymore
+        preroll.head = 0;
+    }
+    preroll.enabled = enabled;
+
+    ESP_LOGI(TAG_REC, "Pre-roll %s", enabled ? "enabled" : "disabled");
+    return ESP_OK;
+}
+
+bool recorder_get_preroll(void) {
+    return preroll.enabled;
+}
+
+static size_t recorder_snapshot_preroll(uint32_t head) {
+    // the oldest frames may be overwritten during the copy, they are left out
+    size_t count = RECORD_PREROLL_FRAMES - RECORD_PREROLL_GUARD_FRAMES;
+    if (head < count) count = head;
+
+    uint32_t pos = (head - count) & preroll.mask;
+    size_t first = RECORD_PREROLL_FRAMES - pos;
+    if (first > count) first = count;
+
+    memcpy(g_recorder.buffer, preroll.frames + pos, first * sizeof(int16_t));
+    memcpy(g_recorder.buffer + first, preroll.frames, (count - first) * sizeof(int16_t));
+
+    // the copy was slower than the guard: the first frames could be mixed with new ones
+    uint32_t written = __atomic_load_n(&preroll.head, __ATOMIC_ACQUIRE) - head;
+    if (written > RECORD_PREROLL_GUARD_FRAMES) {
+        size_t lost = written - RECORD_PREROLL_GUARD_FRAMES;
+        if (lost > count) lost = count;
+        ESP_LOGW(TAG_REC, "%zu frames overwritten during the capture", lost);
+
+        count -= lost;
+        memmove(g_recorder.buffer, g_recorder.buffer + lost, count * sizeof(int16_t));
+    }
+
+    return count;
+}
+
+void recorder_capture(void) {
     // logging action + skip if in wrong state
-    if (g_recorder.state != REC_RECORDING) {
-        ESP_LOGE(TAG_REC, "Trying to capture frame while not recording.");
+    if (g_recorder.state != REC_IDLE) {
+        ESP_LOGE(TAG_REC, "Trying to capture while not in REC_IDLE state.");
         return;
     }
-    
-    // check free space and stop recording if the buffer is full
-    if (g_recorder.buffer_used + 1 > g_recorder.buffer_capacity) {
-        ESP_LOGE(TAG_REC, "Buffer full!");
-        recorder_stop_recording();
-        fsm_queue_msg_t msg = {
-            .payload = PRESS,
-            .source = JOYSTICK
-        };
-        recorder_stop_recording();
-        xQueueSend(fsm_queue, &msg, 0);
+
+    // logging action + skip if there's nothing to capture
+    if (!preroll.enabled || preroll.head == 0) {
+        ESP_LOGW(TAG_REC, "Nothing to capture, the pre-roll is off");
+        print_double("Nothing to", "capture");
         return;
     }
-    
-    g_recorder.buffer[g_recorder.buffer_used++] = sample;
+
+    // logging action + skip if the buffer couldn't be reserved at boot
+    if (g_recorder.buffer == NULL || rec_task_handle == NULL) {
+        ESP_LOGE(TAG_REC, "Recorder not available");
+        return;
+    }
+
+    // the capture is what was played until now, not until the pad is chosen: the ring is latched
+    // and stops while the user picks the pad (at most the block being rendered still lands in it)
+    uint32_t head = __atomic_load_n(&preroll.head, __ATOMIC_ACQUIRE);
+    preroll.enabled = false;
+
+    if (g_recorder.destination == REC_TO_SD) {
+        // logging action + skip if the stream is not available
+        if (st_stream_open(NULL) != ESP_OK) {
+            ESP_LOGE(TAG_REC, "Cannot stream to the SD card");
+            preroll.enabled = true;
+            return;
+        }
+    } else {
+        recorder_start_pad_selection();
+
+        // wait for the pad to capture into
+        fsm_queue_msg_t msg;
+        while(xQueueReceive(fsm_queue, &msg, portMAX_DELAY) && msg.source != PAD);
+
+        recorder_map_pad(msg.payload);
+    }
+
+    g_recorder.buffer_used = recorder_snapshot_preroll(head);
+
+    // the ring goes on from where it stopped
+    preroll.enabled = true;
+    g_recorder.duration_ms = g_recorder.buffer_used * 1000 / RECORD_SAMPLE_RATE;
+    g_recorder.retroactive = true;
+
+    print_double("Captured", g_recorder.destination == REC_TO_SD ? "To SD card" : "Saving...");
+
+    // the recorder task stores the frames, as for a stopped recording
+    g_recorder.state = REC_SAVING;
+    xTaskNotifyGive(rec_task_handle);
+
+    // logging action
+    ESP_LOGI(TAG_REC, "Captured the last %lu ms", g_recorder.duration_ms);
+}
+
+void recorder_set_destination(record_destination_t destination) {
+    // the destination can't change during a recording
+    if (g_recorder.state != REC_IDLE) return;
+
+    g_recorder.destination = destination;
+}
+
+record_destination_t recorder_get_destination(void) {
+    return g_recorder.destination;
 }
 
 recorder_state_t recorder_get_state(void) {
@@ -261,29 +801,36 @@ void recorder_fsm(){
         return;
     }
 
-    // start pad selection
-    recorder_start_pad_selection();
+    fsm_queue_msg_t msg;
 
-    // logging action
-    ESP_LOGI(TAG_REC, "Recording state (expected 1 = WAITING FOR PAD): %d", g_recorder.state);
+    if (g_recorder.destination == REC_TO_SD) {
+        // the recording goes to a new file, there's no pad to choose
+        recorder_start_recording();
+        if (g_recorder.state != REC_RECORDING && g_recorder.state != REC_ARMED) return;
+    } else {
+        // start pad selection
+        recorder_start_pad_selection();
 
-    // wait for signal by the pressed button (which is the chosen pad)
-    fsm_queue_msg_t msg;
-    while(xQueueReceive(fsm_queue, &msg, portMAX_DELAY) && msg.source != PAD);
+        // logging action
+        ESP_LOGI(TAG_REC, "Recording state (expected 1 = WAITING FOR PAD): %d", g_recorder.state);
 
-    // select pad
-    recorder_select_pad(msg.payload);
+        // wait for signal by the pressed button (which is the chosen pad)
+        while(xQueueReceive(fsm_queue, &msg, portMAX_DELAY) && msg.source != PAD);
+
+        // select pad
+        recorder_select_pad(msg.payload);
+    }
 
     // logging action
-    ESP_LOGI(TAG_REC, "Recording state (expected 2 = RECORDING): %d", g_recorder.state);
+    ESP_LOGI(TAG_REC, "Recording state (expected 2 = ARMED or 3 = RECORDING): %d", g_recorder.state);
 
     // recording...
 
     // wait for signal by the recording button to stop recording
     while(xQueueReceive(fsm_queue, &msg, portMAX_DELAY) && msg.source != JOYSTICK && msg.payload != PRESS);
 
-    // stop recording
-    if (g_recorder.state != REC_IDLE){
+    // stop recording (it may have already stopped because the buffer is full)
+    if (g_recorder.state == REC_RECORDING || g_recorder.state == REC_ARMED){
         recorder_stop_recording();
     }
 
@@ -0,0 +1,129 @@
+/*********************************************************************************
+ *                                 SAMPLE ARENA                                  *
+ *   Dedicated PSRAM region for sample audio. Buffers are referenced through     *
+ *  handles: every block records the pointer that refers to it (its owner), so  *
+ *  the arena can slide blocks together while the engine is silent and held at  *
+ *  a block boundary, and patch the owner afterwards. This keeps large loads    *
+ *           from failing because of fragmentation in long sessions.             *
+ *********************************************************************************/
+#ifndef SAMPLE_ARENA_H_
+#define SAMPLE_ARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// max size of the arena, the actual size depends on the free PSRAM at boot
+#define ARENA_MAX_SIZE (3 * 1024 * 1024)
+
+// PSRAM left to the rest of the system when sizing the arena
+#define ARENA_RESERVE_SIZE (256 * 1024)
+
+// max number of blocks that can be allocated at the same time
+#define ARENA_MAX_HANDLES 32
+
+// alignment of every block (in bytes)
+#define ARENA_ALIGN 16
+
+// how often the arena checks if it should compact itself
+#define ARENA_COMPACT_PERIOD_MS 500
+
+// fragmentation above which the background compaction kicks in
+#define ARENA_COMPACT_THRESHOLD 0.2f
+
+#define ARENA_INVALID_HANDLE -1
+
+// handle of an allocated block
+typedef int16_t arena_handle_t;
+
+// callback telling whether it's safe to move unpinned blocks (nothing reads them)
+typedef bool (*arena_idle_check_t)(void);
+
+// callbacks that keep the engine from starting voices while a block moves, hold returns false if it can't be held
+typedef bool (*arena_hold_t)(void);
+typedef void (*arena_release_t)(void);
+
+// arena usage report
+typedef struct {
+    size_t total;           // size of the arena
+    size_t used;            // bytes allocated (including alignment)
+    size_t free;            // bytes available
+    size_t largest_free;    // largest contiguous free region
+    float fragmentation;    // 0 = all the free space is contiguous, 1 = completely scattered
+    int blocks;             // number of allocated blocks
+} arena_stats_t;
+
+/*
+@brief reserves the arena in PSRAM and starts the background compaction task.
+*/
+esp_err_t sample_arena_init(void);
+
+/*
+@brief registers the function used to know when the engine is silent.
+@param idle_check the callback, it must be cheap since it's polled.
+*/
+void sample_arena_set_idle_check(arena_idle_check_t idle_check);
+
+/*
+@brief registers the functions that hold the engine while a block is moved. A block is moved only
+if the engine could be held and is still idle once held.
+@param hold the engine stops starting voices, blocks until it's done.
+@param release the engine goes back to normal.
+*/
+void sample_arena_set_engine_hold(arena_hold_t hold, arena_release_t release);
+
+/*
+@brief allocates a block in the arena. If there is enough free space, but not contiguous, 
+the arena is compacted first (only if the engine is idle).
+@param size size in bytes of the block.
+@param owner pointer that will refer to the block, set on success and patched on every relocation.
+*/
+arena_handle_t arena_alloc(size_t size, void **owner);
+
+/*
+@brief releases a block. The owner pointer is set to NULL.
+@param handle handle of the block (ARENA_INVALID_HANDLE is ignored).
+*/
+void arena_free(arena_handle_t handle);
+
+/*
+@brief reduces the size of a block in place.
+@param handle handle of the block.
+@param new_size new size in bytes, must not be greater than the current one.
+*/
+esp_err_t arena_shrink(arena_handle_t handle, size_t new_size);
+
+/*
+@brief changes the pointer that refers to a block (i.e. when handing a buffer over to a sample).
+@param handle handle of the block.
+@param owner new owner pointer, set to the current address of the block.
+*/
+void arena_set_owner(arena_handle_t handle, void **owner);
+
+/*
+@brief prevents a block from being moved until arena_unpin() is called.
+Used while a buffer is read outside of the audio engine (i.e. writing to SD).
+@param handle handle of the block.
+*/
+void arena_pin(arena_handle_t handle);
+
+/*
+@brief allows a pinned block to be moved again.
+@param handle handle of the block.
+*/
+void arena_unpin(arena_handle_t handle);
+
+/*
+@brief moves every movable block towards the beginning of the arena, as long as the engine is idle.
+Returns the number of blocks moved.
+*/
+int arena_compact(void);
+
+/*
+@brief fills the usage report of the arena.
+@param out_stats the report.
+*/
+void arena_get_stats(arena_stats_t *out_stats);
+
+#endif
@@ -0,0 +1,366 @@
+#include "sample_arena.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char* TAG = "SampleArena";
+
+// bookkeeping of a single block
+typedef struct {
+    bool in_use;        // the slot refers to an allocated block
+    bool free_pending;  // arena_free() was called while the block was pinned
+    uint8_t pins;       // number of readers/writers that need the block to stay still
+    size_t offset;      // position of the block from the beginning of the arena
+    size_t size;        // size of the block (aligned)
+    void **owner;       // pointer to patch when the block is moved
+} arena_block_t;
+
+static uint8_t *arena_base = NULL;
+static size_t arena_size = 0;
+
+static arena_block_t blocks[ARENA_MAX_HANDLES];
+
+// protects the block table, compaction holds it while moving a single block
+static SemaphoreHandle_t arena_mutex = NULL;
+
+static arena_idle_check_t is_idle = NULL;
+static arena_hold_t engine_hold = NULL;
+static arena_release_t engine_release = NULL;
+
+static inline size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+}
+
+static inline bool is_valid(arena_handle_t handle) {
+    return handle >= 0 && handle < ARENA_MAX_HANDLES && blocks[handle].in_use;
+}
+
+/*
+@brief fills an array with the indexes of the allocated blocks, sorted by offset. Returns the number of blocks.
+@param order output array, at least ARENA_MAX_HANDLES long.
+*/
+static int get_sorted_blocks(int *order) {
+    int count = 0;
+    for (int i = 0; i < ARENA_MAX_HANDLES; i++) {
+        if (!blocks[i].in_use) continue;
+
+        // insertion sort, the table is tiny
+        int j = count++;
+        while (j > 0 && blocks[order[j - 1]].offset > blocks[i].offset) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    return count;
+}
+
+/*
+@brief returns the offset of the smallest free region that can hold the requested size, or SIZE_MAX.
+@param size aligned size of the block.
+*/
+static size_t find_free_region(size_t size) {
+    int order[ARENA_MAX_HANDLES];
+    int count = get_sorted_blocks(order);
+
+    size_t best_offset = SIZE_MAX;
+    size_t best_size = SIZE_MAX;
+    size_t cursor = 0;
+
+    // the last iteration checks the region between the last block and the end of the arena
+    for (int i = 0; i <= count; i++) {
+        size_t region_end = (i < count) ? blocks[order[i]].offset : arena_size;
+        size_t region_size = region_end - cursor;
+
+        if (region_size >= size && region_size < best_size) {
+            best_offset = cursor;
+            best_size = region_size;
+        }
+
+        if (i < count) {
+            cursor = blocks[order[i]].offset + blocks[order[i]].size;
+        }
+    }
+    return best_offset;
+}
+
+/*
+@brief computes the usage report, the mutex must be held.
+*/
+static void compute_stats(arena_stats_t *out_stats) {
+    int order[ARENA_MAX_HANDLES];
+    int count = get_sorted_blocks(order);
+
+    size_t used = 0;
+    size_t largest_free = 0;
+    size_t cursor = 0;
+
+    for (int i = 0; i <= count; i++) {
+        size_t region_end = (i < count) ? blocks[order[i]].offset : arena_size;
+        if (region_end - cursor > largest_free) {
+            largest_free = region_end - cursor;
+        }
+
+        if (i < count) {
+            used += blocks[order[i]].size;
+            cursor = blocks[order[i]].offset + blocks[order[i]].size;
+        }
+    }
+
+    out_stats->total = arena_size;
+    out_stats->used = used;
+    out_stats->free = arena_size - used;
+    out_stats->largest_free = largest_free;
+    out_stats->fragmentation = out_stats->free > 0 ? 1.0f - (float)largest_free / out_stats->free : 0.0f;
+    out_stats->blocks = count;
+}
+
+/*
+@brief moves the first block that has free space before it, the mutex must be held.
+Returns false if there is nothing to move or the engine is not idle.
+*/
+static bool compact_step(void) {
+    int order[ARENA_MAX_HANDLES];
+    int count = get_sorted_blocks(order);
+    size_t cursor = 0;
+
+    for (int i = 0; i < count; i++) {
+        arena_block_t *block = &blocks[order[i]];
+
+        if (block->offset > cursor && block->pins == 0) {
+            // the engine is held at a block boundary for the whole move, so no voice can start and read the block;
+            // it must still be idle once held, a voice may have started before the hold
+            if (is_idle == NULL || engine_hold == NULL || !engine_hold()) return false;
+            if (!is_idle()) {
+                engine_release();
+                return false;
+            }
+
+            uint8_t *dst = arena_base + cursor;
+            memmove(dst, arena_base + block->offset, block->size);
+            block->offset = cursor;
+            if (block->owner != NULL) *block->owner = dst;
+
+            engine_release();
+            return true;
+        }
+
+        // pinned blocks stay where they are, the following ones are packed after them
+        cursor = block->offset + block->size;
+    }
+    return false;
+}
+
+/*
+@brief releases a block, the mutex must be held.
+*/
+static void release_block(arena_block_t *block) {
+    block->in_use = false;
+    block->free_pending = false;
+    block->pins = 0;
+    block->owner = NULL;
+}
+
+static void arena_task(void *args) {
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(ARENA_COMPACT_PERIOD_MS));
+
+        arena_stats_t stats;
+        arena_get_stats(&stats);
+
+        // compact only when it's worth it and nothing is playing
+        if (stats.fragmentation < ARENA_COMPACT_THRESHOLD || is_idle == NULL || !is_idle()) continue;
+
+        int moved = arena_compact();
+        if (moved > 0) {
+            arena_get_stats(&stats);
+            ESP_LOGI(TAG, "Compacted %d blocks: %u bytes free, largest %u, fragmentation %.2f",
+                moved, stats.free, stats.largest_free, stats.fragmentation);
+        }
+    }
+}
+
+esp_err_t sample_arena_init(void) {
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_SPIRAM);
+    if (largest <= ARENA_RESERVE_SIZE) {
+        ESP_LOGE(TAG, "Not enough PSRAM for the sample arena");
+        return ESP_ERR_NO_MEM;
+    }
+
+    arena_size = largest - ARENA_RESERVE_SIZE;
+    if (arena_size > ARENA_MAX_SIZE) arena_size = ARENA_MAX_SIZE;
+    arena_size &= ~((size_t)ARENA_ALIGN - 1);
+
+    arena_base = heap_caps_malloc(arena_size, MALLOC_CAP_SPIRAM);
+    if (arena_base == NULL) {
+        ESP_LOGE(TAG, "Cannot reserve the sample arena");
+        return ESP_ERR_NO_MEM;
+    }
+
+    for (int i = 0; i < ARENA_MAX_HANDLES; i++) {
+        release_block(&blocks[i]);
+    }
+
+    arena_mutex = xSemaphoreCreateMutex();
+
+    // lowest priority: compaction only uses spare time
+    xTaskCreate(arena_task, "arena_task", 2048, NULL, 1, NULL);
+
+    ESP_LOGI(TAG, "Sample arena ready (%u bytes)", arena_size);
+    return ESP_OK;
+}
+
+void sample_arena_set_idle_check(arena_idle_check_t idle_check) {
+    is_idle = idle_check;
+}
+
+void sample_arena_set_engine_hold(arena_hold_t hold, arena_release_t release) {
+    engine_hold = hold;
+    engine_release = release;
+}
+
+arena_handle_t arena_alloc(size_t size, void **owner) {
+    if (arena_base == NULL) return ARENA_INVALID_HANDLE;
+
+    size = align_up(size);
+
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+
+    arena_handle_t handle = ARENA_INVALID_HANDLE;
+    for (int i = 0; i < ARENA_MAX_HANDLES; i++) {
+        if (!blocks[i].in_use) {
+            handle = i;
+            break;
+        }
+    }
+    if (handle == ARENA_INVALID_HANDLE) {
+        xSemaphoreGive(arena_mutex);
+        ESP_LOGE(TAG, "No free handles");
+        return ARENA_INVALID_HANDLE;
+    }
+
+    size_t offset = find_free_region(size);
+
+    // enough space, but scattered: pack the blocks and try again
+    if (offset == SIZE_MAX) {
+        arena_stats_t stats;
+        compute_stats(&stats);
+        if (stats.free >= size) {
+            while (compact_step());
+            offset = find_free_region(size);
+        }
+    }
+
+    if (offset == SIZE_MAX) {
+        xSemaphoreGive(arena_mutex);
+        ESP_LOGE(TAG, "Cannot allocate %u bytes", size);
+        return ARENA_INVALID_HANDLE;
+    }
+
+    blocks[handle].in_use = true;
+    blocks[handle].free_pending = false;
+    blocks[handle].pins = 0;
+    blocks[handle].offset = offset;
+    blocks[handle].size = size;
+    blocks[handle].owner = owner;
+    if (owner != NULL) *owner = arena_base + offset;
+
+    xSemaphoreGive(arena_mutex);
+    return handle;
+}
+
+void arena_free(arena_handle_t handle) {
+    if (arena_mutex == NULL) return;
+
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    if (is_valid(handle)) {
+        arena_block_t *block = &blocks[handle];
+
+        // the owner may be freed right after this call, forget it
+        if (block->owner != NULL) *block->owner = NULL;
+        block->owner = NULL;
+
+        // someone is still reading the block: release it on the last unpin
+        if (block->pins > 0) {
+            block->free_pending = true;
+        } else {
+            release_block(block);
+        }
+    }
+    xSemaphoreGive(arena_mutex);
+}
+
+esp_err_t arena_shrink(arena_handle_t handle, size_t new_size) {
+    esp_err_t res = ESP_OK;
+
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    if (!is_valid(handle)) {
+        res = ESP_ERR_INVALID_ARG;
+    } else if (align_up(new_size) > blocks[handle].size) {
+        res = ESP_ERR_INVALID_SIZE;
+    } else {
+        blocks[handle].size = align_up(new_size);
+    }
+    xSemaphoreGive(arena_mutex);
+
+    return res;
+}
+
+void arena_set_owner(arena_handle_t handle, void **owner) {
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    if (is_valid(handle)) {
+        blocks[handle].owner = owner;
+        if (owner != NULL) *owner = arena_base + blocks[handle].offset;
+    }
+    xSemaphoreGive(arena_mutex);
+}
+
+void arena_pin(arena_handle_t handle) {
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    if (is_valid(handle)) {
+        blocks[handle].pins++;
+    }
+    xSemaphoreGive(arena_mutex);
+}
+
+void arena_unpin(arena_handle_t handle) {
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    if (is_valid(handle) && blocks[handle].pins > 0) {
+        blocks[handle].pins--;
+        if (blocks[handle].pins == 0 && blocks[handle].free_pending) {
+            release_block(&blocks[handle]);
+        }
+    }
+    xSemaphoreGive(arena_mutex);
+}
+
+int arena_compact(void) {
+    if (arena_mutex == NULL) return 0;
+
+    int moved = 0;
+    bool keep_going = true;
+
+    // one block per lock, so allocations don't wait for the whole pass
+    while (keep_going) {
+        xSemaphoreTake(arena_mutex, portMAX_DELAY);
+        keep_going = compact_step();
+        xSemaphoreGive(arena_mutex);
+
+        if (keep_going) moved++;
+    }
+    return moved;
+}
+
+void arena_get_stats(arena_stats_t *out_stats) {
+    if (arena_mutex == NULL) {
+        memset(out_stats, 0, sizeof(arena_stats_t));
+        return;
+    }
+
+    xSemaphoreTake(arena_mutex, portMAX_DELAY);
+    compute_stats(out_stats);
+    xSemaphoreGive(arena_mutex);
+}
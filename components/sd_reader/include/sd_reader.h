@@ -30,7 +30,8 @@ extern char* sample_names_bank[SAMPLE_NUM];
 #define GRVCHP_FAT_DRIVE_STR "0:"
 
 // maximum number of files that can be opened simultaneously
-#define GRVCHP_MAX_FILES 1
+// (one is reserved to the recording stream, the others are serialized by the card lock)
+#define GRVCHP_MAX_FILES 2
 
 // maximum size of the name that will be printed in the screen 
 #define MAX_SIZE 17
@@ -46,7 +47,115 @@ extern char* sample_names_bank[SAMPLE_NUM];
 #define JSON_EXTENSION_SIZE 5
 
 #define MAX_BUFF_SIZE 256
-#define MAX_JSON_SIZE 512
+
+// files are saved in a temporary copy first, then renamed
+#define TMP_EXTENSION ".tmp"
+
+// background saving
+#define SAVE_QUEUE_LEN 8
+#define SAVE_TASK_STACK 4096
+#define SAVE_TASK_PRIORITY 2
+
+// on-card index of the WAV directory, used to skip the scan of unchanged files at boot
+#define SAMPLE_INDEX_FILE "sample_index.bin"
+#define SAMPLE_INDEX_MAGIC 0x58444947 // "GIDX"
+#define SAMPLE_INDEX_VERSION 1
+
+// initial capacity of the sample names' array, it grows as needed
+#define SAMPLE_NAMES_INITIAL_CAPACITY 16
+
+// header of the index file
+typedef struct {
+    uint32_t magic;         // SAMPLE_INDEX_MAGIC
+    uint16_t version;       // SAMPLE_INDEX_VERSION
+    uint16_t entry_size;    // sizeof(sample_index_entry_t), guards against layout changes
+    uint32_t count;         // number of entries that follow
+} sample_index_hdr_t;
+
+// what the index remembers about a single WAV file
+typedef struct {
+    char name[MAX_SIZE];        // sample name, without extension (already normalized)
+    uint8_t has_json;           // the JSON metadata file exists
+    uint32_t file_size;         // size of the WAV file, to detect changes
+    uint32_t mtime;             // last modification time of the WAV file, to detect changes
+    uint32_t data_size;         // from the WAV header
+    uint32_t sample_rate;       // from the WAV header
+    uint16_t num_channels;      // from the WAV header
+    uint16_t bits_per_sample;   // from the WAV header
+} sample_index_entry_t;
+
+// binary table holding the metadata (effects and pointers) of every sample on the card
+// it replaces the JSON files when loading, the JSON files are kept only for import/export
+#define SAMPLE_META_FILE "sample_meta.bin"
+#define SAMPLE_META_TMP_FILE "sample_meta.tmp"
+#define SAMPLE_META_MAGIC 0x4154454D // "META"
+#define SAMPLE_META_VERSION 1
+
+// sample_meta_t flags
+#define SAMPLE_META_BITCRUSHER (1 << 0)
+#define SAMPLE_META_DISTORTION (1 << 1)
+
+// header of the metadata table file
+typedef struct {
+    uint32_t magic;         // SAMPLE_META_MAGIC
+    uint16_t version;       // SAMPLE_META_VERSION
+    uint16_t record_size;   // sizeof(sample_meta_t), guards against layout changes
+    uint32_t count;         // number of records that follow
+} sample_meta_hdr_t;
+
+// metadata of a single sample, one fixed-size record in the table
+typedef struct {
+    char name[MAX_SIZE];        // sample name, without extension
+    uint8_t flags;              // enabled effects (SAMPLE_META_*)
+    uint8_t downsample;         // bitcrusher downsample
+    uint8_t bit_depth;          // bitcrusher bit depth
+    uint16_t threshold;         // distortion threshold
+    float gain;                 // distortion gain
+    float pitch_factor;         // pitch factor
+    float start_ptr;            // playback start frame
+    uint32_t end_ptr;           // playback end frame
+    uint8_t choke_group;        // choke group, 0 if none (older tables have 0 here)
+    uint8_t mute_group;         // mute group, 0 if none
+    uint8_t launch_quantize;    // launch grid of the loop modes (launch_quantize_t), 0 = off
+    uint8_t note_repeat;        // note repeat rate of the HOLD mode (note_repeat_t), 0 = off
+    uint8_t repeat_ramp;        // volume ramp of the repeats (repeat_ramp_t), 0 = off
+    uint8_t reserved[3];        // room for new fields without changing the record size
+} sample_meta_t;
+
+// directory containing the kit packs, one file per slot (kit_<slot>.kit)
+#define KIT_FILES_DIR "kit_files"
+#define KIT_SLOTS 10
+#define KIT_MAGIC 0x54494B47 // "GKIT"
+#define KIT_VERSION 1
+
+// every block of a kit pack starts on a sector boundary, so it's read with whole sector transfers
+#define KIT_SECTOR_SIZE 512
+#define KIT_ALIGN(x) (((x) + KIT_SECTOR_SIZE - 1) & ~(KIT_SECTOR_SIZE - 1))
+
+// bank of a kit pack, the audio is stored as it is in memory (PCM or ADPCM)
+typedef struct {
+    uint8_t used;               // the bank holds a sample
+    uint8_t pad_id;             // pad mapped to the bank, NOT_DEFINED if none
+    uint8_t mode;               // pb_mode_t of the bank
+    uint8_t encoding;           // sample_encoding_t of the audio block
+    float volume;               // bank volume
+    sample_meta_t meta;         // effects and pointers, meta.name is the sample name
+    wav_header_t header;        // describes the PCM audio
+    uint32_t total_frames;      // number of frames
+    uint32_t data_offset;       // position of the audio block in the file (sector aligned)
+    uint32_t data_size;         // size of the audio block
+} kit_bank_t;
+
+// header of a kit pack, followed by the audio blocks in bank order
+typedef struct {
+    uint32_t magic;             // KIT_MAGIC
+    uint16_t version;           // KIT_VERSION
+    uint16_t bank_size;         // sizeof(kit_bank_t), guards against layout changes
+    uint32_t bank_num;          // SAMPLE_NUM
+    kit_bank_t banks[SAMPLE_NUM];
+} kit_hdr_t;
+
+#define KIT_HDR_SIZE KIT_ALIGN(sizeof(kit_hdr_t))
 
 #define FORMAT(S) "%" #S "[^.]"
 #define RESOLVE(S) FORMAT(S)
@@ -65,10 +174,68 @@ esp_err_t sd_reader_init();
 esp_err_t ld_sample(int in_bank_index, char* sample_name, sample_t** out_sample_ptr);
 
 /*
-@brief copies the sample's info into memory. It generates the sample's WAV file if new
+@brief queues the save of a sample on the SD card, the write happens in background.
+Only what changed is written: the WAV file if the audio is dirty (or new), the metadata if they differ from the stored ones
 @param index that refers to sample_bank. Indicates where the sample is located
-@param sample_name name of the sample
+@param sample_name name of the sample, NULL to generate a new one
 */
 esp_err_t st_sample(int in_bank_index, char *sample_name);
 
+/*
+@brief reads the metadata of a sample from the metadata table
+@param sample_name name of the sample
+@param out_meta the sample's metadata
+*/
+esp_err_t get_sample_meta(const char* sample_name, sample_meta_t* out_meta);
+
+/*
+@brief writes the metadata of a sample in the metadata table. The record is added if new
+@param meta the sample's metadata, meta -> name identifies the sample
+*/
+esp_err_t set_sample_meta(const sample_meta_t* meta);
+
+/*
+@brief reads the metadata of a sample from its JSON file
+@param sample_name name of the sample
+@param out_meta the sample's metadata
+*/
+esp_err_t import_sample_meta_json(const char* sample_name, sample_meta_t* out_meta);
+
+/*
+@brief writes the metadata of a sample in its JSON file, to be read by other tools
+@param meta the sample's metadata
+*/
+esp_err_t export_sample_meta_json(const sample_meta_t* meta);
+
+/*
+@brief stores every bank (audio, metadata, playback mode and pad mapping) in a single kit pack
+@param slot kit slot, from 0 to KIT_SLOTS - 1
+*/
+esp_err_t st_kit(uint8_t slot);
+
+/*
+@brief replaces every bank with the content of a kit pack, read with a single sequential pass
+@param slot kit slot, from 0 to KIT_SLOTS - 1
+*/
+esp_err_t ld_kit(uint8_t slot);
+
+/*
+@brief creates a new WAV file for a recording streamed to the card. Its size is written when it's closed.
+Only one stream can be open at a time
+@param out_sample_name name generated for the new sample
+*/
+esp_err_t st_stream_open(char** out_sample_name);
+
+/*
+@brief appends frames to the stream
+@param frames 16 bit mono frames
+@param count number of frames
+*/
+esp_err_t st_stream_write(const int16_t* frames, size_t count);
+
+/*
+@brief completes the WAV header of the stream and closes it
+*/
+esp_err_t st_stream_close();
+
 #endif
\ No newline at end of file
@@ -11,22 +11,54 @@
 #include "diskio_sdmmc.h"
 #include "mixer.h"
 #include "effects.h"
+#include "playback_mode.h"
+#include "adpcm.h"
 #include "esp_psram.h"
 #include <sys/stat.h>
 #include "nvs.h"
 #include "nvs_flash.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 const char* TAG = "SdReader";
 
 char** sample_names = NULL;
 int sample_names_size = 0;
 
+// slots allocated in sample_names, grown by doubling. The list is only changed with the card lock held
+static int sample_names_capacity = 0;
+
 char *sample_names_bank[SAMPLE_NUM];
 
 static sdmmc_card_t sd_card;
 
 int record_number;
 
+// the card is accessed by the FSM and by the save task, but only one file can be open at a time
+static SemaphoreHandle_t sd_mutex = NULL;
+
+// pending saves, written in background by save_task
+static QueueHandle_t save_queue = NULL;
+
+// save request, it holds the state of the bank when the save was asked:
+// the bank can be replaced (i.e. new sample, kit or recording) before the job runs
+typedef struct {
+    int bank_index;
+    char sample_name[MAX_SIZE];
+    sample_t audio;             // copy of the sample, its audio block stays pinned until the job is done
+    bool audio_dirty;           // the audio changed since the last save
+    sample_meta_t meta;         // metadata of the bank
+} save_job_t;
+
+// recording streamed to the card, it has its own file slot
+static FILE* stream_fp = NULL;
+static uint32_t stream_frames = 0;
+
+// metadata table, mirrored in PSRAM so that loading a sample doesn't need to read it
+static sample_meta_t* meta_table = NULL;
+static int meta_count = 0;
+static int meta_capacity = 0;
+
 /*
 @brief initializes the SD filesystem, checking if there are any new downloaded samples. It includes name's truncation and JSON creation
 */
@@ -43,8 +75,13 @@ static esp_err_t sd_fs_init();
 @param threshold sample's threshold
 @param gain sample's gain
 @param start_ptr sample's playback start pointer
-@param end_ptr sample's playback end pointer*/
-static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downsample, uint8_t bit_depth, float pitch_factor, bool distortion_enabled, uint16_t threshold, float gain, float start_ptr, uint32_t end_ptr);
+@param end_ptr sample's playback end pointer
+@param choke_group sample's choke group
+@param mute_group sample's mute group
+@param launch_quantize sample's launch grid
+@param note_repeat sample's note repeat rate
+@param repeat_ramp sample's repeat volume ramp*/
+static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downsample, uint8_t bit_depth, float pitch_factor, bool distortion_enabled, uint16_t threshold, float gain, float start_ptr, uint32_t end_ptr, uint8_t choke_group, uint8_t mute_group, uint8_t launch_quantize, uint8_t note_repeat, uint8_t repeat_ramp);
 
 /*
 @brief extracts the informations about the sample from the JSON file.
@@ -58,8 +95,22 @@ static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downs
 @param gain sample's gain
 @param start_ptr sample's playback start pointer
 @param end_ptr sample's playback end pointer
+@param choke_group sample's choke group, left unchanged if missing (older files)
+@param mute_group sample's mute group, left unchanged if missing
+@param launch_quantize sample's launch grid, left unchanged if missing
+@param note_repeat sample's note repeat rate, left unchanged if missing
+@param repeat_ramp sample's repeat volume ramp, left unchanged if missing
 */
-static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* downsample, uint8_t* bit_depth, float* pitch_factor, bool* distortion_enabled, uint16_t* threshold, float* gain, float* start_ptr, uint32_t* end_ptr);
+static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* downsample, uint8_t* bit_depth, float* pitch_factor, bool* distortion_enabled, uint16_t* threshold, float* gain, float* start_ptr, uint32_t* end_ptr, uint8_t* choke_group, uint8_t* mute_group, uint8_t* launch_quantize, uint8_t* note_repeat, uint8_t* repeat_ramp);
+
+/*
+@brief reads an optional small number of a JSON object. A missing or out of range value leaves the output unchanged.
+@param object the JSON object
+@param name name of the field
+@param max highest valid value
+@param out the value
+*/
+static void get_json_optional_u8(const cJSON* object, const char* name, uint8_t max, uint8_t* out);
 
 /*
 @brief truncates the original name to MAX_SIZE characters (max characters accepted from the screen) and eventually renames the file 
@@ -71,32 +122,184 @@ static bool normalize_wav_file(const char* wav_path, const char* original_name,
 
 /*
 @brief checks whether the JSON associated to a sample exists or not. If not, it creates one with default values
-@param wav_path path to the folder containing the WAV files
 @param json_path path to the folder containing the JSON files 
 @param clean_name name of the sample we want to create the JSON of
+@param header WAV header of the sample, used for the default values
+*/
+static esp_err_t ensure_json_exists(const char* json_path, const char* clean_name, const wav_header_t* header);
+
+/*
+@brief loads the index of the WAV directory from the card. Returns the number of entries (0 if missing or not valid)
+@param out_entries array of entries, allocated in PSRAM. NULL if there are no entries
+*/
+static int load_sample_index(sample_index_entry_t** out_entries);
+
+/*
+@brief writes the index of the WAV directory on the card
+@param entries the entries to store
+@param count number of entries
 */
-static esp_err_t ensure_json_exists(const char* wav_path, const char* json_path, const char* clean_name);
+static esp_err_t save_sample_index(const sample_index_entry_t* entries, int count);
 
 /*
-@brief generates an array with all the samples' names
-@param dir pointer to the directory containing all the WAV files
-@param count array's size
+@brief searches a sample in the index. Returns its position or -1
+@param entries the index
+@param count number of entries
+@param name sample name (without extension)
+@param hint position where the entry is expected to be (the directory order rarely changes)
 */
-static esp_err_t populate_sample_names_array(DIR *dir, int count);
+static int find_index_entry(const sample_index_entry_t* entries, int count, const char* name, int hint);
 
 /*
-@brief generates a new name and adds it to the sample names' list
-@param out_sample_name pointer to the newly generated string
+@brief fully analyzes a WAV file: normalizes its name, creates its JSON if missing and fills its index entry
+@param wav_path path to the folder containing the WAV files
+@param json_path path to the folder containing the JSON files 
+@param original_name current file's name
+@param out_entry index entry of the file
+*/
+static esp_err_t scan_wav_file(const char* wav_path, const char* json_path, const char* original_name, sample_index_entry_t* out_entry);
+
+/*
+@brief appends a name to the samples' names array, growing it if needed. Called with the card lock held
+@param name name of the sample (without extension)
+*/
+static esp_err_t add_sample_name(const char* name);
+
+/*
+@brief generates a new name and adds it to the sample names' list. Called with the card lock held
+@param out_sample_name pointer to the newly generated string, owned by the list
 */
-static void add_new_rec_to_sample_names(char **out_sample_name);
+static esp_err_t add_new_rec_to_sample_names(char **out_sample_name);
 
 /*
 @brief extracts the record number from the flash memory
 */
 static esp_err_t rec_num_init();
 
+/*
+@brief loads the metadata table from the card. A missing or not valid table is left empty (the JSON files are imported lazily)
+*/
+static esp_err_t load_meta_table();
+
+/*
+@brief searches a sample in the metadata table. Returns its position or -1
+@param sample_name name of the sample
+*/
+static int find_meta(const char* sample_name);
+
+/*
+@brief fills a metadata record with the default values
+@param sample_name name of the sample
+@param data_size size of the sample's audio data, used as default end pointer
+@param out_meta the default metadata
+*/
+static void default_sample_meta(const char* sample_name, uint32_t data_size, sample_meta_t* out_meta);
+
+/*
+@brief applies the effects stored in a metadata record to a bank
+@param bank_index index of the bank
+@param meta the sample's metadata
+*/
+static void apply_sample_meta(int bank_index, const sample_meta_t* meta);
+
+/*
+@brief builds the metadata record of a bank from its current state
+@param bank_index index of the bank
+@param sample_name name of the sample in the bank
+@param out_meta the sample's metadata
+*/
+static void collect_sample_meta(int bank_index, const char* sample_name, sample_meta_t* out_meta);
+
+/*
+@brief returns the entry of sample_names matching a name, adding a new one if the sample is not on the card
+@param sample_name name of the sample
+*/
+static char* get_sample_name_entry(const char* sample_name);
+
+/*
+@brief body of ld_sample(), called with the card lock held
+*/
+static esp_err_t load_sample(int in_bank_index, char* sample_name, sample_t** out_sample_ptr);
+
+/*
+@brief body of set_sample_meta(), called with the card lock held
+*/
+static esp_err_t write_sample_meta(const sample_meta_t* meta);
+
+/*
+@brief body of st_kit(), called with the card lock held
+*/
+static esp_err_t store_kit(uint8_t slot);
+
+/*
+@brief body of ld_kit(), called with the card lock held
+*/
+static esp_err_t load_kit(uint8_t slot);
+
+/*
+@brief writes the pending saves, one at a time
+*/
+static void save_task(void* pvParameters);
+
+/*
+@brief saves only what changed in a bank: the WAV file if the audio is dirty, the metadata if they differ from the stored ones
+@param job the save request, with the state of the bank when it was queued
+*/
+static esp_err_t save_sample(const save_job_t* job);
+
+/*
+@brief writes a sample's WAV file in a temporary file, then replaces the old one. A power loss leaves either the old or the new file
+@param smp the sample, its audio block must be pinned
+@param wav_file_path path of the WAV file
+*/
+static esp_err_t write_wav_atomic(const sample_t* smp, const char* wav_file_path);
+
+/*
+@brief replaces a file with its complete temporary copy
+@param tmp_path path of the temporary file
+@param path path of the file
+*/
+static esp_err_t commit_tmp_file(const char* tmp_path, const char* path);
+
+/*
+@brief renames the complete kit files left as temporary by an interrupted save, and removes the others.
+*/
+static void recover_kit_files(void);
+
+/*
+@brief checks that the sizes and the format of a kit bank agree, so its audio block can be used by the mixer.
+@param bank the bank.
+*/
+static bool kit_bank_valid(const kit_bank_t* bank);
+
+/*
+@brief brings stored playback pointers back inside the sample, so a damaged record can't make the mixer read past the audio.
+@param start_ptr start pointer.
+@param end_ptr end pointer.
+@param total_frames frames of the sample.
+*/
+static void clamp_sample_ptrs(float* start_ptr, uint32_t* end_ptr, uint32_t total_frames);
+
+/*
+@brief fills the header of a 16 bit mono WAV file
+@param header the header
+@param data_size size of the audio data in bytes
+*/
+static void fill_wav_header(wav_header_t* header, uint32_t data_size);
+
+/*
+@brief decodes a compressed sample and writes its PCM frames to an already opened file
+@param fp file to write into, positioned right after the WAV header
+@param smp the compressed sample
+*/
+static esp_err_t write_adpcm_as_pcm(FILE* fp, sample_t* smp);
+
 esp_err_t sd_reader_init() {
     esp_err_t res;
+
+    sd_mutex = xSemaphoreCreateRecursiveMutex();
+    save_queue = xQueueCreate(SAVE_QUEUE_LEN, sizeof(save_job_t));
+    if (sd_mutex == NULL || save_queue == NULL) return ESP_ERR_NO_MEM;
     
     res = sdspi_driver_init(&sd_card);
     if (res != ESP_OK)
@@ -133,19 +336,25 @@ esp_err_t sd_reader_init() {
     if (rec_num_init() != ESP_OK) return ESP_ERR_NO_MEM;
 
     ESP_ERROR_CHECK_WITHOUT_ABORT(sd_fs_init());
+    ESP_ERROR_CHECK_WITHOUT_ABORT(load_meta_table());
+
+    xTaskCreate(save_task, "save_task", SAVE_TASK_STACK, NULL, SAVE_TASK_PRIORITY, NULL);
 
     return ESP_OK;
 }
 
 esp_err_t ld_sample(int in_bank_index, char* sample_name, sample_t** out_sample_ptr) {
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = load_sample(in_bank_index, sample_name, out_sample_ptr);
+    xSemaphoreGiveRecursive(sd_mutex);
+    return res;
+}
+
+static esp_err_t load_sample(int in_bank_index, char* sample_name, sample_t** out_sample_ptr) {
     ESP_LOGI(TAG, "ld_sample(): in_bank_index: %i, sample_name: %s", in_bank_index, sample_name);
     if (out_sample_ptr == NULL)
         return ESP_ERR_INVALID_ARG;
 
-    if (*out_sample_ptr != NULL) {
-        heap_caps_free((*out_sample_ptr) -> raw_data);
-        heap_caps_free((*out_sample_ptr));
-    }
     // defining the file path to read from
     char file_path[MAX_BUFF_SIZE];
     snprintf(file_path, sizeof(file_path),"%s/%s/%s.wav", GRVCHP_MNTPOINT, WAV_FILES_DIR, sample_name);
@@ -159,12 +368,12 @@ esp_err_t ld_sample(int in_bank_index, char* sample_name, sample_t** out_sample_
     }
     
     printf("Available size: %d\n", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
-    // allocating in the PSRAM the section of memory for the sample infos
-    // *out_sample_ptr = heap_caps_malloc(sizeof(sample_t), MALLOC_CAP_SPIRAM);
-    *out_sample_ptr = heap_caps_malloc(sizeof(sample_t), MALLOC_CAP_SPIRAM);
-    sample_t* out_sample = *out_sample_ptr;
-    if (out_sample_ptr == NULL) {
+    // allocating in the PSRAM the section of memory for the sample infos.
+    // The new sample is built aside, the bank keeps the old one until it's ready
+    sample_t* out_sample = heap_caps_malloc(sizeof(sample_t), MALLOC_CAP_SPIRAM);
+    if (out_sample == NULL) {
         ESP_LOGE(TAG, "Error in allocating the sample");
+        fclose(fp);
         return ESP_ERR_NO_MEM;
     }
 
@@ -175,160 +384,585 @@ esp_err_t ld_sample(int in_bank_index, char* sample_name, sample_t** out_sample_
     if (read_cnt != 1) {
         ESP_LOGE(TAG, "Error while reading the file\n");
 
-        free(out_sample);
-        out_sample_ptr = NULL;
+        heap_caps_free(out_sample);
+        fclose(fp);
         return ESP_FAIL;
     }
 
     
-    // allocating the section of memory for the actual sample (wav buffer)
-    // out_sample -> raw_data = heap_caps_malloc((out_sample -> header).data_size, MALLOC_CAP_SPIRAM);
-    out_sample->raw_data = heap_caps_malloc(out_sample -> header.data_size, MALLOC_CAP_SPIRAM);
-    if (out_sample->raw_data == NULL) {
+    // allocating the section of memory for the actual sample (wav buffer) in the sample arena
+    out_sample -> data_handle = arena_alloc(out_sample -> header.data_size, (void**)&(out_sample -> raw_data));
+    if (out_sample -> data_handle == ARENA_INVALID_HANDLE) {
         ESP_LOGE(TAG, "Failed to allocate SPIRAM for WAV data");
         heap_caps_free(out_sample);
-        *out_sample_ptr = NULL;
         fclose(fp);
         return ESP_ERR_NO_MEM;
     }
     
-    // reading the area of the file where the data is located
+    // reading the area of the file where the data is located (the block can't move while it's filled)
+    arena_pin(out_sample -> data_handle);
     read_cnt = fread(out_sample -> raw_data, 1, (out_sample -> header).data_size, fp);
+    arena_unpin(out_sample -> data_handle);
 
+    // closing the file
+    fclose(fp);
     
     if (read_cnt != (out_sample -> header).data_size) {
         ESP_LOGE(TAG, "Error while reading the file\n");
         ESP_LOGE(TAG, "Read data: %d\n", read_cnt);
         
-        heap_caps_free(out_sample -> raw_data);
+        arena_free(out_sample -> data_handle);
         heap_caps_free(out_sample);
         return ESP_FAIL;
     }
-    
-    // getting the json filename
-    char filename[MAX_BUFF_SIZE];
-    snprintf(filename, sizeof(filename), "%s/%s/%s.json", GRVCHP_MNTPOINT, JSON_FILES_DIR, sample_name);
-    
-    // closing the file
-    fclose(fp);
-
-    // declaring some useful variables for the json parsing
-    bool bitcrusher_enabled;
-    bool distortion_enabled;
-    uint8_t downsample;
-    uint8_t bit_depth;
-    float gain;
-    uint16_t threshold;
-    float pitch_factor;
 
     out_sample -> bank_index = in_bank_index;
 
-    // json parsing 
-    get_json(
-        filename,
-        &bitcrusher_enabled,
-        &downsample,
-        &bit_depth,
-        &pitch_factor,
-        &distortion_enabled,
-        &threshold,
-        &gain,
-        &(out_sample -> start_ptr),
-        &(out_sample -> end_ptr) 
-    );
+    // metadata lookup, the JSON file is read only the first time the sample is loaded
+    sample_meta_t meta;
+    if (get_sample_meta(sample_name, &meta) != ESP_OK) {
+        if (import_sample_meta_json(sample_name, &meta) != ESP_OK) {
+            ESP_LOGW(TAG, "No valid metadata for %s, using the default ones", sample_name);
+            default_sample_meta(sample_name, (out_sample -> header).data_size, &meta);
+        }
+        set_sample_meta(&meta);
+    }
+    clamp_sample_ptrs(&meta.start_ptr, &meta.end_ptr, (out_sample -> header).data_size / 2);
+    out_sample -> start_ptr = meta.start_ptr;
+    out_sample -> end_ptr = meta.end_ptr;
+    out_sample -> playback_finished = false;
+    out_sample -> dirty = 0;
 
     // setting default values
+    out_sample -> encoding = SAMPLE_PCM16;
     out_sample -> volume = 0.1f;
     out_sample -> playback_ptr = out_sample -> start_ptr;
     out_sample -> total_frames = (out_sample -> header).data_size / 2; 
 
-    // assigning bitcrusher values according to the infos in the json file
-    set_bit_crusher(in_bank_index, bitcrusher_enabled);
-    set_bit_crusher_bit_depth(in_bank_index, bit_depth);
-    set_bit_crusher_downsample(in_bank_index, downsample);
-
-    // same for distortion
-    set_distortion(in_bank_index, distortion_enabled);
-    set_distortion_gain(in_bank_index, gain);
-    set_distortion_threshold(in_bank_index, threshold);
+    // the swap happens with the engine held, so no press or step starts the voice halfway
+    if (!mixer_hold()) {
+        arena_free(out_sample -> data_handle);
+        heap_caps_free(out_sample);
+        return ESP_ERR_TIMEOUT;
+    }
 
-    // same for the pitch
-    set_pitch_factor(in_bank_index, pitch_factor);
+    sample_t* old = *out_sample_ptr;
+    if (old != NULL) action_stop_sample(in_bank_index);
+    *out_sample_ptr = out_sample;
+    apply_sample_meta(in_bank_index, &meta);
+    mixer_audio_changed(in_bank_index);
+
+    // the block being rendered may still use the old sample, it's freed after it
+    if (old != NULL) {
+        if (mixer_sync()) {
+            arena_free(old -> data_handle);
+            heap_caps_free(old);
+        } else {
+            ESP_LOGE(TAG, "The mixer is stuck, the previous sample is not freed");
+        }
+    }
+    mixer_release();
 
     return ESP_OK;
 }
 
 esp_err_t st_sample(int in_bank_index, char *sample_name) {
+    if (in_bank_index < 0 || in_bank_index >= SAMPLE_NUM || sample_bank[in_bank_index] == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
     if (sample_name == NULL) {
-        add_new_rec_to_sample_names(&sample_name);
+        xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+        esp_err_t res = add_new_rec_to_sample_names(&sample_name);
+        xSemaphoreGiveRecursive(sd_mutex);
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "Cannot name the new sample of bank %d", in_bank_index);
+            return res;
+        }
+        // the next saves of this bank update the same file
+        sample_names_bank[in_bank_index] = sample_name;
     }
-    sample_t* curr_sample = sample_bank[in_bank_index];
 
-    // defining the sample's file name, based on the id 
-    char wav_file_path[MAX_BUFF_SIZE];
-    snprintf(wav_file_path, sizeof(wav_file_path), "%s/%s/%s.wav", GRVCHP_MNTPOINT, WAV_FILES_DIR, sample_name);
+    save_job_t job = {
+        .bank_index = in_bank_index
+    };
+    snprintf(job.sample_name, MAX_SIZE, "%s", sample_name);
+
+    // the audio must stay in place until it's written. If it's replaced meanwhile
+    // (i.e. new recording), the old block is released only when it's unpinned
+    sample_t* smp = sample_bank[in_bank_index];
+    arena_handle_t handle;
+    do {
+        handle = smp -> data_handle;
+        arena_pin(handle);
+        if (handle == smp -> data_handle) break;
+        arena_unpin(handle);
+    } while (true);
+    job.audio = *smp;
+    collect_sample_meta(in_bank_index, job.sample_name, &job.meta);
+
+    // cleared when queued: a change after the request marks it again
+    job.audio_dirty = (smp -> dirty & SAMPLE_DIRTY_AUDIO) != 0;
+    smp -> dirty &= ~SAMPLE_DIRTY_AUDIO;
+
+    // the actual write happens in save_task, the caller (i.e. the FSM) is not blocked
+    if (xQueueSend(save_queue, &job, 0) != pdTRUE) {
+        ESP_LOGE(TAG, "Too many pending saves, %s not saved", sample_name);
+        if (job.audio_dirty) smp -> dirty |= SAMPLE_DIRTY_AUDIO;
+        arena_unpin(handle);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
 
-    char json_file_path[MAX_BUFF_SIZE];
-    snprintf(json_file_path, sizeof(json_file_path), "%s/%s/%s.json", GRVCHP_MNTPOINT, JSON_FILES_DIR, sample_name);
+esp_err_t get_sample_meta(const char* sample_name, sample_meta_t* out_meta) {
+    if (sample_name == NULL || out_meta == NULL) return ESP_ERR_INVALID_ARG;
 
-    printf("%s, %s\n", wav_file_path, json_file_path);
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    int idx = find_meta(sample_name);
+    if (idx >= 0) *out_meta = meta_table[idx];
+    xSemaphoreGiveRecursive(sd_mutex);
 
-    FILE* wav_fp;
-    // opening the file in write-or-create mode
-    // if there's no file containing that sample, it will create one 
-    if ((wav_fp = fopen(wav_file_path, "wb")) == NULL) {
-        ESP_LOGE(TAG, "Error in creating the new wav file");
+    return idx >= 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t set_sample_meta(const sample_meta_t* meta) {
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = write_sample_meta(meta);
+    xSemaphoreGiveRecursive(sd_mutex);
+    return res;
+}
+
+static esp_err_t write_sample_meta(const sample_meta_t* meta) {
+    if (meta == NULL) return ESP_ERR_INVALID_ARG;
+
+    int idx = find_meta(meta -> name);
+
+    if (idx < 0) {
+        // grow the table
+        if (meta_count == meta_capacity) {
+            int new_capacity = meta_capacity == 0 ? SAMPLE_NAMES_INITIAL_CAPACITY : 2 * meta_capacity;
+            sample_meta_t* grown = heap_caps_realloc(meta_table, new_capacity * sizeof(sample_meta_t), MALLOC_CAP_SPIRAM);
+            if (grown == NULL) return ESP_ERR_NO_MEM;
+
+            meta_table = grown;
+            meta_capacity = new_capacity;
+        }
+        idx = meta_count++;
+    }
+    meta_table[idx] = *meta;
+    meta_table[idx].name[MAX_SIZE - 1] = '\0';
+
+    char meta_path[MAX_BUFF_SIZE];
+    snprintf(meta_path, sizeof(meta_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_META_FILE);
+
+    sample_meta_hdr_t hdr = {
+        .magic = SAMPLE_META_MAGIC,
+        .version = SAMPLE_META_VERSION,
+        .record_size = sizeof(sample_meta_t),
+        .count = meta_count
+    };
+
+    // the whole table goes in a temporary file that replaces the old one, a power loss can't leave it half written
+    char tmp_path[MAX_BUFF_SIZE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_META_TMP_FILE);
+
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Cannot create the metadata table");
         return ESP_FAIL;
-    } 
-
-    wav_header_t local_header = curr_sample -> header;
-    // writing the sample inside the file
-    size_t write_cnt = fwrite(&local_header, sizeof(wav_header_t), 1, wav_fp);
-    if (write_cnt != 1) {
-        ESP_LOGE(TAG, "Error while writing the wav file's header");
-        fclose(wav_fp);
+    }
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+           && fwrite(meta_table, sizeof(sample_meta_t), meta_count, fp) == (size_t)meta_count;
+    fclose(fp);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Error while writing the metadata of %s", meta -> name);
+        remove(tmp_path);
         return ESP_FAIL;
     }
+    return commit_tmp_file(tmp_path, meta_path);
+}
 
-    size_t bytes_remaining = curr_sample->header.data_size;
-    uint8_t* data_ptr = curr_sample->raw_data;
-    size_t chunk_size = 4096; // 4KB is optimal for FATFS and internal RAM bouncing
+esp_err_t import_sample_meta_json(const char* sample_name, sample_meta_t* out_meta) {
+    if (sample_name == NULL || out_meta == NULL) return ESP_ERR_INVALID_ARG;
 
-    while (bytes_remaining > 0) {
-        size_t bytes_to_write = (bytes_remaining > chunk_size) ? chunk_size : bytes_remaining;
-        
-        // write the chunk
-        size_t written = fwrite(data_ptr, 1, bytes_to_write, wav_fp);
-        if (written != bytes_to_write) {
-            ESP_LOGE(TAG, "Error while writing the wav file data");
-            fclose(wav_fp);
+    char filename[MAX_BUFF_SIZE];
+    snprintf(filename, sizeof(filename), "%s/%s/%s.json", GRVCHP_MNTPOINT, JSON_FILES_DIR, sample_name);
+
+    // the defaults cover the fields missing from the JSON file
+    default_sample_meta(sample_name, 0, out_meta);
+
+    bool bitcrusher_enabled = false;
+    bool distortion_enabled = false;
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = get_json(
+        filename,
+        &bitcrusher_enabled,
+        &(out_meta -> downsample),
+        &(out_meta -> bit_depth),
+        &(out_meta -> pitch_factor),
+        &distortion_enabled,
+        &(out_meta -> threshold),
+        &(out_meta -> gain),
+        &(out_meta -> start_ptr),
+        &(out_meta -> end_ptr),
+        &(out_meta -> choke_group),
+        &(out_meta -> mute_group),
+        &(out_meta -> launch_quantize),
+        &(out_meta -> note_repeat),
+        &(out_meta -> repeat_ramp)
+    );
+    xSemaphoreGiveRecursive(sd_mutex);
+    if (res != ESP_OK) return res;
+
+    out_meta -> flags = (bitcrusher_enabled ? SAMPLE_META_BITCRUSHER : 0)
+                      | (distortion_enabled ? SAMPLE_META_DISTORTION : 0);
+    return ESP_OK;
+}
+
+esp_err_t export_sample_meta_json(const sample_meta_t* meta) {
+    if (meta == NULL) return ESP_ERR_INVALID_ARG;
+
+    char filename[MAX_BUFF_SIZE];
+    snprintf(filename, sizeof(filename), "%s/%s/%s.json", GRVCHP_MNTPOINT, JSON_FILES_DIR, meta -> name);
+
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = set_json(
+        filename,
+        (meta -> flags & SAMPLE_META_BITCRUSHER) != 0,
+        meta -> downsample,
+        meta -> bit_depth,
+        meta -> pitch_factor,
+        (meta -> flags & SAMPLE_META_DISTORTION) != 0,
+        meta -> threshold,
+        meta -> gain,
+        meta -> start_ptr,
+        meta -> end_ptr,
+        meta -> choke_group,
+        meta -> mute_group,
+        meta -> launch_quantize,
+        meta -> note_repeat,
+        meta -> repeat_ramp
+    );
+    xSemaphoreGiveRecursive(sd_mutex);
+
+    return res;
+}
+
+esp_err_t st_kit(uint8_t slot) {
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = store_kit(slot);
+    xSemaphoreGiveRecursive(sd_mutex);
+    return res;
+}
+
+esp_err_t ld_kit(uint8_t slot) {
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    esp_err_t res = load_kit(slot);
+    xSemaphoreGiveRecursive(sd_mutex);
+    return res;
+}
+
+static esp_err_t store_kit(uint8_t slot) {
+    if (slot >= KIT_SLOTS) return ESP_ERR_INVALID_ARG;
+
+    char kit_dir[MAX_BUFF_SIZE/2];
+    snprintf(kit_dir, sizeof(kit_dir), "%s/%s", GRVCHP_MNTPOINT, KIT_FILES_DIR);
+    mkdir(kit_dir, 0775); // fails harmlessly if the directory already exists
+
+    char kit_path[MAX_BUFF_SIZE], tmp_path[MAX_BUFF_SIZE];
+    snprintf(kit_path, sizeof(kit_path), "%s/kit_%u.kit", kit_dir, slot);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/kit_%u.tmp", kit_dir, slot);
+
+    kit_hdr_t* hdr = heap_caps_calloc(1, sizeof(kit_hdr_t), MALLOC_CAP_SPIRAM);
+    if (hdr == NULL) return ESP_ERR_NO_MEM;
+
+    hdr -> magic = KIT_MAGIC;
+    hdr -> version = KIT_VERSION;
+    hdr -> bank_size = sizeof(kit_bank_t);
+    hdr -> bank_num = SAMPLE_NUM;
+
+    // offsets table: every audio block follows the previous one, starting on a sector boundary
+    uint32_t offset = KIT_HDR_SIZE;
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        kit_bank_t* bank = &(hdr -> banks[i]);
+        bank -> pad_id = NOT_DEFINED;
+
+        sample_t* smp = sample_bank[i];
+        if (smp == NULL) continue;
+
+        bank -> used = 1;
+        bank -> mode = get_playback_mode(i);
+        bank -> encoding = smp -> encoding;
+        bank -> volume = smp -> volume;
+        bank -> header = smp -> header;
+        bank -> total_frames = smp -> total_frames;
+        bank -> data_size = smp -> encoding == SAMPLE_ADPCM ? adpcm_encoded_size(smp -> total_frames) : smp -> header.data_size;
+        bank -> data_offset = offset;
+        offset = KIT_ALIGN(offset + bank -> data_size);
+
+        collect_sample_meta(i, sample_names_bank[i] != NULL ? sample_names_bank[i] : "", &(bank -> meta));
+
+        for (int pad = 0; pad < GPIO_NUM_MAX; pad++) {
+            if (get_sample_bank_index(pad) == i) {
+                bank -> pad_id = pad;
+                break;
+            }
+        }
+    }
+
+    // the kit is written next to the old one and swapped in only when complete
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Cannot create the kit file %s", tmp_path);
+        heap_caps_free(hdr);
+        return ESP_FAIL;
+    }
+
+    static const uint8_t zeros[KIT_SECTOR_SIZE] = {0};
+    uint32_t written = 0;
+    bool ok = fwrite(hdr, sizeof(kit_hdr_t), 1, fp) == 1;
+    written += sizeof(kit_hdr_t);
+
+    for (int i = 0; ok && i < SAMPLE_NUM; i++) {
+        kit_bank_t* bank = &(hdr -> banks[i]);
+        if (!bank -> used) continue;
+
+        // padding up to the block's sector
+        uint32_t padding = bank -> data_offset - written;
+        ok = fwrite(zeros, 1, padding, fp) == padding;
+        written += padding;
+
+        // the audio must stay in place while it's written
+        arena_pin(sample_bank[i] -> data_handle);
+        ok = ok && fwrite(sample_bank[i] -> raw_data, 1, bank -> data_size, fp) == bank -> data_size;
+        arena_unpin(sample_bank[i] -> data_handle);
+        written += bank -> data_size;
+    }
+    fclose(fp);
+    heap_caps_free(hdr);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Error while writing the kit file %s", tmp_path);
+        remove(tmp_path);
+        return ESP_FAIL;
+    }
+
+    if (commit_tmp_file(tmp_path, kit_path) != ESP_OK) return ESP_FAIL;
+
+    ESP_LOGI(TAG, "Kit %u saved (%lu bytes)", slot, (unsigned long)written);
+    return ESP_OK;
+}
+
+static esp_err_t load_kit(uint8_t slot) {
+    if (slot >= KIT_SLOTS) return ESP_ERR_INVALID_ARG;
+
+    char kit_path[MAX_BUFF_SIZE];
+    snprintf(kit_path, sizeof(kit_path), "%s/%s/kit_%u.kit", GRVCHP_MNTPOINT, KIT_FILES_DIR, slot);
+
+    FILE* fp = fopen(kit_path, "rb");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Kit %u not found", slot);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    kit_hdr_t* hdr = heap_caps_malloc(sizeof(kit_hdr_t), MALLOC_CAP_SPIRAM);
+    if (hdr == NULL) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (fread(hdr, sizeof(kit_hdr_t), 1, fp) != 1
+        || hdr -> magic != KIT_MAGIC
+        || hdr -> version != KIT_VERSION
+        || hdr -> bank_size != sizeof(kit_bank_t)
+        || hdr -> bank_num != SAMPLE_NUM) {
+        ESP_LOGE(TAG, "Kit %u is not valid", slot);
+        heap_caps_free(hdr);
+        fclose(fp);
+        return ESP_FAIL;
+    }
+    uint32_t position = sizeof(kit_hdr_t);
+
+    // the whole kit is checked before the current one is dropped
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        if (hdr -> banks[i].used && !kit_bank_valid(&(hdr -> banks[i]))) {
+            ESP_LOGE(TAG, "Kit %u is not valid (bank %d)", slot, i);
+            heap_caps_free(hdr);
+            fclose(fp);
             return ESP_FAIL;
         }
-        
-        // move the pointer forward
-        data_ptr += bytes_to_write;
-        bytes_remaining -= bytes_to_write;
     }
-    
-    fclose(wav_fp);
 
-    set_json(
-        json_file_path,
-        get_bit_crusher_state(in_bank_index),
-        get_bit_crusher_downsample(in_bank_index),
-        get_bit_crusher_bit_depth(in_bank_index),
-        get_pitch_factor(in_bank_index),
-        get_distortion_state(in_bank_index),
-        get_distortion_threshold(in_bank_index),
-        get_distortion_gain(in_bank_index),
-        curr_sample -> start_ptr,
-        curr_sample -> end_ptr
-    );
+    // the current kit is dropped before reading the new one, so that both don't have to fit in memory.
+    // The engine is held first, so no voice starts again between the stop and the emptied banks
+    if (!mixer_hold()) {
+        heap_caps_free(hdr);
+        fclose(fp);
+        return ESP_ERR_TIMEOUT;
+    }
+
+    sample_t* old_bank[SAMPLE_NUM];
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        if (sample_bank[i] != NULL) action_stop_sample(i);
+        old_bank[i] = sample_bank[i];
+        sample_bank[i] = NULL;
+        sample_names_bank[i] = NULL;
+        set_playback_mode(i, HOLD);
+    }
+
+    // the block being rendered may still use the old samples, they're freed after it
+    if (mixer_sync()) {
+        for (int i = 0; i < SAMPLE_NUM; i++) {
+            if (old_bank[i] == NULL) continue;
+            arena_free(old_bank[i] -> data_handle);
+            heap_caps_free(old_bank[i]);
+        }
+    } else {
+        ESP_LOGE(TAG, "The mixer is stuck, the previous kit is not freed");
+    }
+    mixer_release();
+    unmap_all_pads();
+
+    esp_err_t res = ESP_OK;
+    for (int i = 0; i < SAMPLE_NUM; i++) {
+        kit_bank_t* bank = &(hdr -> banks[i]);
+        if (!bank -> used) continue;
+
+        // the blocks are in ascending order, so the file is read forward only
+        if (bank -> data_offset < position || fseek(fp, bank -> data_offset - position, SEEK_CUR) != 0) {
+            res = ESP_FAIL;
+            break;
+        }
+
+        sample_t* smp = heap_caps_malloc(sizeof(sample_t), MALLOC_CAP_SPIRAM);
+        if (smp == NULL) {
+            res = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        smp -> data_handle = arena_alloc(bank -> data_size, (void**)&(smp -> raw_data));
+        if (smp -> data_handle == ARENA_INVALID_HANDLE) {
+            heap_caps_free(smp);
+            res = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        arena_pin(smp -> data_handle);
+        size_t read_cnt = fread(smp -> raw_data, 1, bank -> data_size, fp);
+        arena_unpin(smp -> data_handle);
+        position = bank -> data_offset + read_cnt;
+
+        if (read_cnt != bank -> data_size) {
+            arena_free(smp -> data_handle);
+            heap_caps_free(smp);
+            res = ESP_FAIL;
+            break;
+        }
+
+        bank -> meta.name[MAX_SIZE - 1] = '\0';
+        clamp_sample_ptrs(&(bank -> meta.start_ptr), &(bank -> meta.end_ptr), bank -> total_frames);
+
+        smp -> encoding = bank -> encoding;
+        smp -> header = bank -> header;
+        smp -> total_frames = bank -> total_frames;
+        smp -> start_ptr = bank -> meta.start_ptr;
+        smp -> end_ptr = bank -> meta.end_ptr;
+        smp -> playback_ptr = smp -> start_ptr;
+        smp -> bank_index = i;
+        smp -> playback_finished = false;
+        smp -> volume = bank -> volume;
+
+        apply_sample_meta(i, &(bank -> meta));
+        set_playback_mode(i, bank -> mode < UNSET ? bank -> mode : HOLD);
+        if (bank -> pad_id < GPIO_NUM_MAX) map_pad_to_sample(bank -> pad_id, i);
 
+        sample_names_bank[i] = get_sample_name_entry(bank -> meta.name);
+
+        // a sample that exists only in the kit gets its WAV file on the first save
+        char wav_path[MAX_BUFF_SIZE];
+        snprintf(wav_path, sizeof(wav_path), "%s/%s/%s.wav", GRVCHP_MNTPOINT, WAV_FILES_DIR, bank -> meta.name);
+        struct stat st;
+        smp -> dirty = stat(wav_path, &st) == 0 ? 0 : SAMPLE_DIRTY_AUDIO;
+
+        sample_bank[i] = smp;
+
+        // the new block may sit at the offset of a freed one, with the same pointers
+        mixer_audio_changed(i);
+    }
+    fclose(fp);
+    heap_caps_free(hdr);
+
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error while reading kit %u, some banks are empty", slot);
+    } else {
+        ESP_LOGI(TAG, "Kit %u loaded", slot);
+    }
+    return res;
+}
+
+esp_err_t st_stream_open(char** out_sample_name) {
+    if (stream_fp != NULL) return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+    char* sample_name = NULL;
+    esp_err_t res = add_new_rec_to_sample_names(&sample_name);
+    xSemaphoreGiveRecursive(sd_mutex);
+    if (res != ESP_OK) return res;
+
+    char wav_file_path[MAX_BUFF_SIZE];
+    snprintf(wav_file_path, sizeof(wav_file_path), "%s/%s/%s.wav", GRVCHP_MNTPOINT, WAV_FILES_DIR, sample_name);
+
+    stream_fp = fopen(wav_file_path, "wb");
+    if (stream_fp == NULL) {
+        ESP_LOGE(TAG, "Cannot create the stream file %s", wav_file_path);
+        return ESP_FAIL;
+    }
+
+    // the sizes are patched when the stream is closed
+    wav_header_t header;
+    fill_wav_header(&header, 0);
+    if (fwrite(&header, sizeof(wav_header_t), 1, stream_fp) != 1) {
+        fclose(stream_fp);
+        stream_fp = NULL;
+        return ESP_FAIL;
+    }
+    stream_frames = 0;
+
+    if (out_sample_name != NULL) *out_sample_name = sample_name;
+    ESP_LOGI(TAG, "Streaming to %s", wav_file_path);
     return ESP_OK;
 }
 
+esp_err_t st_stream_write(const int16_t* frames, size_t count) {
+    if (stream_fp == NULL) return ESP_ERR_INVALID_STATE;
+
+    size_t written = fwrite(frames, sizeof(int16_t), count, stream_fp);
+    stream_frames += written;
+
+    return written == count ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t st_stream_close() {
+    if (stream_fp == NULL) return ESP_ERR_INVALID_STATE;
+
+    // now the size of the data is known
+    wav_header_t header;
+    fill_wav_header(&header, stream_frames * sizeof(int16_t));
+
+    bool ok = fseek(stream_fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(wav_header_t), 1, stream_fp) == 1;
+    ok = fclose(stream_fp) == 0 && ok;
+    stream_fp = NULL;
+
+    ESP_LOGI(TAG, "Stream closed (%lu frames)", (unsigned long)stream_frames);
+    return ok ? ESP_OK : ESP_FAIL;
+}
+
 static esp_err_t sd_fs_init() {
+    // a kit save interrupted between the remove and the rename left only the temporary file
+    recover_kit_files();
+
     char wav_path[MAX_BUFF_SIZE/2], json_path[MAX_BUFF_SIZE/2];
     snprintf(wav_path, sizeof(wav_path), "%s/%s", GRVCHP_MNTPOINT, WAV_FILES_DIR);
     snprintf(json_path, sizeof(json_path), "%s/%s", GRVCHP_MNTPOINT, JSON_FILES_DIR);
@@ -339,26 +973,108 @@ static esp_err_t sd_fs_init() {
         return ESP_ERR_NOT_FOUND;
     }
 
+    // what we knew about the directory at the previous boot
+    sample_index_entry_t* old_entries = NULL;
+    int old_count = load_sample_index(&old_entries);
+
+    // the new index is rebuilt while reading the directory
+    int new_capacity = old_count > SAMPLE_NAMES_INITIAL_CAPACITY ? old_count : SAMPLE_NAMES_INITIAL_CAPACITY;
+    sample_index_entry_t* new_entries = heap_caps_malloc(new_capacity * sizeof(sample_index_entry_t), MALLOC_CAP_SPIRAM);
+    if (new_entries == NULL) {
+        heap_caps_free(old_entries);
+        closedir(dir);
+        return ESP_ERR_NO_MEM;
+    }
+    int new_count = 0;
+
+    sample_names = NULL;
+    sample_names_size = 0;
+    sample_names_capacity = 0;
+
+    int rescanned = 0;
     struct dirent* entry;
-    int valid_wav_count = 0;
+    esp_err_t res = ESP_OK;
 
     while ((entry = readdir(dir)) != NULL) {
         if (entry->d_name[0] == '.') continue;
 
+        char *ext = strrchr(entry->d_name, '.');
+
+        // leftover of an interrupted save: it's complete only if the WAV file was already removed
+        if (ext && strcasecmp(ext, TMP_EXTENSION) == 0) {
+            char tmp_path[MAX_BUFF_SIZE], recovered_path[MAX_BUFF_SIZE];
+            snprintf(tmp_path, sizeof(tmp_path), "%s/%s", wav_path, entry->d_name);
+            snprintf(recovered_path, sizeof(recovered_path), "%s/%.*s.wav", wav_path, (int)(ext - entry->d_name), entry->d_name);
+
+            struct stat st;
+            if (stat(recovered_path, &st) == 0 || rename(tmp_path, recovered_path) != 0) {
+                remove(tmp_path);
+                continue;
+            }
+            ESP_LOGW(TAG, "Recovered %s from an interrupted save", recovered_path);
+            // the recovered file is analyzed right away, the index doesn't know it
+            if (scan_wav_file(wav_path, json_path, recovered_path + strlen(wav_path) + 1, &new_entries[new_count]) != ESP_OK) {
+                continue;
+            }
+            rescanned++;
+            goto add_entry;
+        }
+
+        if (!ext || (strcasecmp(ext, ".wav") != 0)) {
+            ESP_LOGW(TAG, "Analyzed file %s is not a WAV file, ignoring", entry->d_name);
+            continue;
+        }
+
+        // only files that have already been normalized can be in the index
         char clean_name[MAX_SIZE];
-        
-        if (!normalize_wav_file(wav_path, entry->d_name, clean_name)) {
-            continue; // skip if it's not a WAV or rename failed
+        snprintf(clean_name, MAX_SIZE, "%.*s", (int)(ext - entry->d_name), entry->d_name);
+        int found = strcmp(ext, ".wav") == 0 ? find_index_entry(old_entries, old_count, clean_name, new_count) : -1;
+
+        char full_path[MAX_BUFF_SIZE];
+        snprintf(full_path, sizeof(full_path), "%s/%s", wav_path, entry->d_name);
+
+        struct stat st;
+        if (found >= 0 && stat(full_path, &st) == 0
+            && old_entries[found].file_size == (uint32_t)st.st_size
+            && old_entries[found].mtime == (uint32_t)st.st_mtime
+            && old_entries[found].has_json) {
+            // unchanged since the last boot, nothing to do
+            new_entries[new_count] = old_entries[found];
+        } else {
+            if (scan_wav_file(wav_path, json_path, entry->d_name, &new_entries[new_count]) != ESP_OK) {
+                continue; // skip if the rename failed or the file is not readable
+            }
+            rescanned++;
         }
 
-        if (ensure_json_exists(wav_path, json_path, clean_name) == ESP_OK) {
-            valid_wav_count++; 
+add_entry:
+        res = add_sample_name(new_entries[new_count].name);
+        if (res != ESP_OK) break;
+
+        new_count++;
+
+        // grow the index
+        if (new_count == new_capacity) {
+            sample_index_entry_t* grown = heap_caps_realloc(new_entries, 2 * new_capacity * sizeof(sample_index_entry_t), MALLOC_CAP_SPIRAM);
+            if (grown == NULL) {
+                res = ESP_ERR_NO_MEM;
+                break;
+            }
+            new_entries = grown;
+            new_capacity *= 2;
         }
     }
-
-    esp_err_t res = populate_sample_names_array(dir, valid_wav_count);
-    
     closedir(dir);
+
+    // the index is rewritten only if something changed (new, modified or deleted files)
+    if (res == ESP_OK && (rescanned > 0 || new_count != old_count)) {
+        save_sample_index(new_entries, new_count);
+    }
+
+    ESP_LOGI(TAG, "Found %d samples, %d (re)scanned", new_count, rescanned);
+
+    heap_caps_free(old_entries);
+    heap_caps_free(new_entries);
     return res;
 }
 
@@ -378,11 +1094,18 @@ static esp_err_t sd_fs_init() {
         "gain" : <val>
     }
 },
+"pad" : {
+    "choke group" : <val>,
+    "mute group" : <val>,
+    "launch quantize" : <val>,
+    "note repeat" : <val>,
+    "repeat ramp" : <val>
+},
 "start_ptr" : <val>,
 "end_ptr" : <val>
 */
 
-static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downsample, uint8_t bit_depth, float pitch_factor, bool distortion_enabled, uint16_t threshold, float gain, float start_ptr, uint32_t end_ptr) {
+static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downsample, uint8_t bit_depth, float pitch_factor, bool distortion_enabled, uint16_t threshold, float gain, float start_ptr, uint32_t end_ptr, uint8_t choke_group, uint8_t mute_group, uint8_t launch_quantize, uint8_t note_repeat, uint8_t repeat_ramp) {
     printf("Start pointer: %f, End pointer: %ld\n", start_ptr, end_ptr);
     printf("Gain: %f\n", gain);
 
@@ -399,6 +1122,12 @@ static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downs
     char* start_ptr_str = "start_pointer";
     char* end_ptr_str = "end_pointer";
     char* enabled_str = "enabled";
+    char* pad_str = "pad";
+    char* choke_group_str = "choke group";
+    char* mute_group_str = "mute group";
+    char* launch_quantize_str = "launch quantize";
+    char* note_repeat_str = "note repeat";
+    char* repeat_ramp_str = "repeat ramp";
 
     // JSON setup, according to the structure defined above
     cJSON* distortion_json = cJSON_CreateObject();
@@ -421,8 +1150,16 @@ static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downs
     cJSON_AddItemToObject(effects_json, bitcrusher_str, bitcrusher_json);
     
 
+    cJSON* pad_json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(pad_json, choke_group_str, choke_group);
+    cJSON_AddNumberToObject(pad_json, mute_group_str, mute_group);
+    cJSON_AddNumberToObject(pad_json, launch_quantize_str, launch_quantize);
+    cJSON_AddNumberToObject(pad_json, note_repeat_str, note_repeat);
+    cJSON_AddNumberToObject(pad_json, repeat_ramp_str, repeat_ramp);
+
     cJSON* metadata_json = cJSON_CreateObject();
     cJSON_AddItemToObject(metadata_json, effects_str, effects_json);
+    cJSON_AddItemToObject(metadata_json, pad_str, pad_json);
     cJSON_AddNumberToObject(metadata_json, start_ptr_str, start_ptr);
     cJSON_AddNumberToObject(metadata_json, end_ptr_str, end_ptr);
 
@@ -430,21 +1167,34 @@ static esp_err_t set_json(char* filename, bool bitcrusher_enabled, uint8_t downs
     char* json_str = cJSON_Print(metadata_json);
     printf("%s\n", json_str);
 
-    FILE* fp = fopen(filename, "w");
-    if (fp == NULL) return ESP_FAIL;
+    // written in a temporary file first, so a power loss never leaves a truncated JSON
+    char tmp_path[MAX_BUFF_SIZE];
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", filename, TMP_EXTENSION);
+
+    FILE* fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        free(json_str);
+        cJSON_Delete(metadata_json);
+        return ESP_FAIL;
+    }
 
-    fputs(json_str, fp);
+    bool ok = fputs(json_str, fp) >= 0;
 
     fclose(fp);
     free(json_str);
     cJSON_Delete(metadata_json);
 
+    if (!ok || commit_tmp_file(tmp_path, filename) != ESP_OK) {
+        remove(tmp_path);
+        return ESP_FAIL;
+    }
+
     ESP_LOGI(TAG, "JSON creation completed");
 
     return ESP_OK;
 }
 
-static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* downsample, uint8_t* bit_depth, float* pitch_factor, bool* distortion_enabled, uint16_t* threshold, float* gain, float* start_ptr, uint32_t* end_ptr) {
+static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* downsample, uint8_t* bit_depth, float* pitch_factor, bool* distortion_enabled, uint16_t* threshold, float* gain, float* start_ptr, uint32_t* end_ptr, uint8_t* choke_group, uint8_t* mute_group, uint8_t* launch_quantize, uint8_t* note_repeat, uint8_t* repeat_ramp) {
     
     // fields in the JSON file
     char* bitcrusher_str = "bitcrusher";
@@ -459,23 +1209,48 @@ static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* dow
     char* start_ptr_str = "start_pointer";
     char* end_ptr_str = "end_pointer";
     char* enabled_str = "enabled";
+    char* pad_str = "pad";
+    char* choke_group_str = "choke group";
+    char* mute_group_str = "mute group";
+    char* launch_quantize_str = "launch quantize";
+    char* note_repeat_str = "note repeat";
+    char* repeat_ramp_str = "repeat ramp";
 
     // opening the json file
     FILE* fp = fopen(filename, "r");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Error opening JSON file %s: %s", filename, strerror(errno));
+        return ESP_FAIL;
+    }
 
-    // reading the content and store it in a buffer
-    char buffer[MAX_JSON_SIZE];
-    if (fread(buffer, 1, sizeof(buffer), fp) == 0) {
+    // reading the whole content and store it in a buffer
+    fseek(fp, 0, SEEK_END);
+    long json_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (json_size <= 0) {
         fclose(fp);
-        return ESP_FAIL;  
-    } 
-    
+        return ESP_FAIL;
+    }
+
+    char* buffer = heap_caps_malloc(json_size + 1, MALLOC_CAP_SPIRAM);
+    if (buffer == NULL) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    size_t read_cnt = fread(buffer, 1, json_size, fp);
     fclose(fp);
 
+    if (read_cnt == 0) {
+        heap_caps_free(buffer);
+        return ESP_FAIL;
+    }
+    buffer[read_cnt] = '\0';
+
     printf("%s\n", buffer);
 
     // parsing the document
     cJSON* metadata_json = cJSON_Parse(buffer);
+    heap_caps_free(buffer);
     if (metadata_json == NULL) {
         const char *error_ptr = cJSON_GetErrorPtr();
         if (error_ptr != NULL) {
@@ -602,10 +1377,33 @@ static esp_err_t get_json(char *filename, bool* bitcrusher_enabled, uint8_t* dow
         }
 
     }
+
+    // the pad settings were added later, files without them keep the defaults
+    cJSON* pad_json = cJSON_GetObjectItemCaseSensitive(metadata_json, pad_str);
+    if (cJSON_IsObject(pad_json)) {
+        get_json_optional_u8(pad_json, choke_group_str, PLAYBACK_CHOKE_GROUPS, choke_group);
+        get_json_optional_u8(pad_json, mute_group_str, PLAYBACK_MUTE_GROUPS, mute_group);
+        get_json_optional_u8(pad_json, launch_quantize_str, LAUNCH_QUANTIZE_BAR, launch_quantize);
+        get_json_optional_u8(pad_json, note_repeat_str, REPEAT_16TH_TRIPLET, note_repeat);
+        get_json_optional_u8(pad_json, repeat_ramp_str, REPEAT_RAMP_DOWN, repeat_ramp);
+    }
+
     cJSON_Delete(metadata_json);
     return ESP_OK;
 }
 
+static void get_json_optional_u8(const cJSON* object, const char* name, uint8_t max, uint8_t* out) {
+    cJSON* value_json = cJSON_GetObjectItemCaseSensitive(object, name);
+    if (value_json == NULL) return;
+
+    // type and range checking
+    if (!cJSON_IsNumber(value_json) || value_json -> valuedouble < 0 || value_json -> valuedouble > max) {
+        ESP_LOGW(TAG, "Wrong %s formatting, using the default", name);
+        return;
+    }
+    *out = (uint8_t) value_json -> valuedouble;
+}
+
 static bool normalize_wav_file(const char* wav_path, const char* original_name, char* out_clean_name) {
     char *ext = strrchr(original_name, '.');
     if (!ext || (strcasecmp(ext, ".wav") != 0)) {
@@ -634,11 +1432,8 @@ static bool normalize_wav_file(const char* wav_path, const char* original_name,
     return true;
 }
 
-static esp_err_t ensure_json_exists(const char* wav_path, const char* json_path, const char* clean_name) {
-    char full_wav_path[MAX_BUFF_SIZE];
+static esp_err_t ensure_json_exists(const char* json_path, const char* clean_name, const wav_header_t* header) {
     char full_json_path[MAX_BUFF_SIZE];
-    
-    snprintf(full_wav_path, sizeof(full_wav_path), "%s/%s.wav", wav_path, clean_name);
     snprintf(full_json_path, sizeof(full_json_path), "%s/%s.json", json_path, clean_name);
 
     // check if JSON already exists
@@ -648,19 +1443,10 @@ static esp_err_t ensure_json_exists(const char* wav_path, const char* json_path,
         return ESP_OK; // JSON exists, nothing to do
     }
 
-    // JSON is missing: read WAV header to determine data size
-    wav_header_t header;
-    FILE* fp = fopen(full_wav_path, "rb");
-    if (!fp) {
-        ESP_LOGE(TAG, "Error opening WAV file %s: %s", full_wav_path, strerror(errno));
-        return ESP_FAIL;
-    }
-    fread(&header, sizeof(wav_header_t), 1, fp);
-    fclose(fp);
-
     // generate the default JSON file
-    esp_err_t res = set_json(full_json_path, false, 1, BIT_DEPTH_MAX, 1.0, 
-                             false, DISTORTION_THRESHOLD_MAX, DISTORTION_GAIN_MAX, 0, header.data_size);
+    sample_meta_t meta;
+    default_sample_meta(clean_name, header -> data_size, &meta);
+    esp_err_t res = export_sample_meta_json(&meta);
     
     if (res == ESP_OK) {
         ESP_LOGI(TAG, "Created JSON file: %s", full_json_path);
@@ -668,44 +1454,158 @@ static esp_err_t ensure_json_exists(const char* wav_path, const char* json_path,
     return res;
 }
 
-static esp_err_t populate_sample_names_array(DIR *dir, int count) {
-    if (count == 0) {
-        sample_names = NULL;
-        sample_names_size = 0;
-        return ESP_OK;
+static int load_sample_index(sample_index_entry_t** out_entries) {
+    *out_entries = NULL;
+
+    char index_path[MAX_BUFF_SIZE];
+    snprintf(index_path, sizeof(index_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_INDEX_FILE);
+
+    FILE* fp = fopen(index_path, "rb");
+    if (fp == NULL) {
+        ESP_LOGI(TAG, "No sample index found, scanning the whole directory");
+        return 0;
     }
 
-    sample_names = heap_caps_malloc(count * sizeof(char*), MALLOC_CAP_SPIRAM);
-    if (!sample_names) {
-        return ESP_ERR_NO_MEM;
+    sample_index_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+        || hdr.magic != SAMPLE_INDEX_MAGIC
+        || hdr.version != SAMPLE_INDEX_VERSION
+        || hdr.entry_size != sizeof(sample_index_entry_t)
+        || hdr.count == 0) {
+        ESP_LOGW(TAG, "Sample index not valid, scanning the whole directory");
+        fclose(fp);
+        return 0;
     }
-    
-    sample_names_size = count;
 
-    // get back to the beginning of the directory
-    rewinddir(dir);
-    struct dirent* entry;
-    int idx = 0;
+    sample_index_entry_t* entries = heap_caps_malloc(hdr.count * sizeof(sample_index_entry_t), MALLOC_CAP_SPIRAM);
+    if (entries == NULL) {
+        fclose(fp);
+        return 0;
+    }
 
-    while ((entry = readdir(dir)) != NULL && idx < count) {
-        if (entry->d_name[0] == '.') continue;
-        
-        char *ext = strrchr(entry->d_name, '.');
-        if (ext && strcasecmp(ext, ".wav") == 0) {
-            sample_names[idx] = malloc(MAX_SIZE);
-            if (sample_names[idx]) {
-                snprintf(sample_names[idx], MAX_SIZE, "%.*s", (int)(ext - entry->d_name), entry->d_name);
-                idx++;
-            }
-        }
+    // a truncated index (i.e. power loss while writing it) is discarded
+    if (fread(entries, sizeof(sample_index_entry_t), hdr.count, fp) != hdr.count) {
+        ESP_LOGW(TAG, "Sample index truncated, scanning the whole directory");
+        heap_caps_free(entries);
+        fclose(fp);
+        return 0;
+    }
+    fclose(fp);
+
+    // names come from the card, make sure they are terminated
+    for (uint32_t i = 0; i < hdr.count; i++) {
+        entries[i].name[MAX_SIZE - 1] = '\0';
+    }
+
+    *out_entries = entries;
+    return hdr.count;
+}
+
+static esp_err_t save_sample_index(const sample_index_entry_t* entries, int count) {
+    char index_path[MAX_BUFF_SIZE];
+    snprintf(index_path, sizeof(index_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_INDEX_FILE);
+
+    FILE* fp = fopen(index_path, "wb");
+    if (fp == NULL) {
+        ESP_LOGE(TAG, "Cannot write the sample index");
+        return ESP_FAIL;
+    }
+
+    sample_index_hdr_t hdr = {
+        .magic = SAMPLE_INDEX_MAGIC,
+        .version = SAMPLE_INDEX_VERSION,
+        .entry_size = sizeof(sample_index_entry_t),
+        .count = count
+    };
+
+    esp_err_t res = ESP_OK;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || (count > 0 && fwrite(entries, sizeof(sample_index_entry_t), count, fp) != (size_t)count)) {
+        ESP_LOGE(TAG, "Error while writing the sample index");
+        res = ESP_FAIL;
+    }
+    fclose(fp);
+
+    // never leave a half-written index behind
+    if (res != ESP_OK) remove(index_path);
+
+    return res;
+}
+
+static int find_index_entry(const sample_index_entry_t* entries, int count, const char* name, int hint) {
+    if (hint < count && strcmp(entries[hint].name, name) == 0) return hint;
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static esp_err_t scan_wav_file(const char* wav_path, const char* json_path, const char* original_name, sample_index_entry_t* out_entry) {
+    memset(out_entry, 0, sizeof(sample_index_entry_t));
+
+    if (!normalize_wav_file(wav_path, original_name, out_entry -> name)) {
+        return ESP_FAIL;
+    }
+
+    char full_path[MAX_BUFF_SIZE];
+    snprintf(full_path, sizeof(full_path), "%s/%s.wav", wav_path, out_entry -> name);
+
+    // read the WAV header
+    wav_header_t header;
+    FILE* fp = fopen(full_path, "rb");
+    if (!fp) {
+        ESP_LOGE(TAG, "Error opening WAV file %s: %s", full_path, strerror(errno));
+        return ESP_FAIL;
+    }
+    size_t read_cnt = fread(&header, sizeof(wav_header_t), 1, fp);
+    fclose(fp);
+    if (read_cnt != 1) {
+        ESP_LOGE(TAG, "WAV file %s is too short", full_path);
+        return ESP_FAIL;
+    }
+
+    if (ensure_json_exists(json_path, out_entry -> name, &header) != ESP_OK) {
+        return ESP_FAIL;
+    }
+
+    struct stat st;
+    if (stat(full_path, &st) == 0) {
+        out_entry -> file_size = st.st_size;
+        out_entry -> mtime = st.st_mtime;
+    }
+
+    out_entry -> has_json = 1;
+    out_entry -> data_size = header.data_size;
+    out_entry -> sample_rate = header.sample_rate;
+    out_entry -> num_channels = header.num_channels;
+    out_entry -> bits_per_sample = header.bits_per_sample;
+
+    return ESP_OK;
+}
+
+static esp_err_t add_sample_name(const char* name) {
+    if (sample_names_size == sample_names_capacity) {
+        int new_capacity = sample_names_capacity == 0 ? SAMPLE_NAMES_INITIAL_CAPACITY : 2 * sample_names_capacity;
+        char** grown = heap_caps_realloc(sample_names, new_capacity * sizeof(char*), MALLOC_CAP_SPIRAM);
+        if (grown == NULL) return ESP_ERR_NO_MEM;
+
+        sample_names = grown;
+        sample_names_capacity = new_capacity;
     }
+
+    sample_names[sample_names_size] = malloc(MAX_SIZE);
+    if (sample_names[sample_names_size] == NULL) return ESP_ERR_NO_MEM;
+
+    snprintf(sample_names[sample_names_size], MAX_SIZE, "%s", name);
+    sample_names_size++;
     return ESP_OK;
 }
 
-static void add_new_rec_to_sample_names(char **out_sample_name) {
+static esp_err_t add_new_rec_to_sample_names(char **out_sample_name) {
     // sets sample name
-    *out_sample_name = heap_caps_calloc(1, MAX_SIZE, MALLOC_CAP_SPIRAM);
-    sprintf(*out_sample_name, "new_rec%d", record_number);
+    char name[MAX_SIZE];
+    snprintf(name, MAX_SIZE, "new_rec%d", record_number);
 
     record_number++;
     nvs_handle_t my_handle;
@@ -718,9 +1618,11 @@ static void add_new_rec_to_sample_names(char **out_sample_name) {
         ESP_LOGI(TAG, "Saved new record_number (%d) to flash", record_number);
     }
 
-    sample_names = heap_caps_realloc(sample_names, (++sample_names_size)*sizeof(char*), MALLOC_CAP_SPIRAM);
-    sample_names[sample_names_size - 1] = *sample_names;
+    esp_err_t res = add_sample_name(name);
+    if (res != ESP_OK) return res;
 
+    *out_sample_name = sample_names[sample_names_size - 1];
+    return ESP_OK;
 }
 
 static esp_err_t rec_num_init() {
@@ -741,3 +1643,340 @@ static esp_err_t rec_num_init() {
     return ESP_OK;
 }
 
+static esp_err_t write_adpcm_as_pcm(FILE* fp, sample_t* smp) {
+    // decode a few blocks at a time, so every fwrite is still 4KB
+    const uint32_t blocks_per_chunk = 8;
+    int16_t* chunk = heap_caps_malloc(blocks_per_chunk * ADPCM_BLOCK_FRAMES * sizeof(int16_t), MALLOC_CAP_INTERNAL);
+    if (chunk == NULL) return ESP_ERR_NO_MEM;
+
+    uint32_t frames_remaining = smp -> total_frames;
+    uint32_t block = 0;
+
+    while (frames_remaining > 0) {
+        uint32_t frames_in_chunk = 0;
+        for (uint32_t i = 0; i < blocks_per_chunk && frames_in_chunk < frames_remaining; i++, block++) {
+            adpcm_decode_block(smp -> raw_data + block * ADPCM_BLOCK_BYTES, chunk + frames_in_chunk);
+            frames_in_chunk += ADPCM_BLOCK_FRAMES;
+        }
+
+        // the last block is padded, don't write the padding
+        if (frames_in_chunk > frames_remaining) frames_in_chunk = frames_remaining;
+
+        if (fwrite(chunk, sizeof(int16_t), frames_in_chunk, fp) != frames_in_chunk) {
+            heap_caps_free(chunk);
+            return ESP_FAIL;
+        }
+        frames_remaining -= frames_in_chunk;
+    }
+
+    heap_caps_free(chunk);
+    return ESP_OK;
+}
+
+static esp_err_t load_meta_table() {
+    char meta_path[MAX_BUFF_SIZE], tmp_path[MAX_BUFF_SIZE];
+    snprintf(meta_path, sizeof(meta_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_META_FILE);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/%s", GRVCHP_MNTPOINT, SAMPLE_META_TMP_FILE);
+
+    // leftover of an interrupted write: it's complete only if the table was already removed
+    struct stat st;
+    if (stat(tmp_path, &st) == 0) {
+        if (stat(meta_path, &st) == 0 || rename(tmp_path, meta_path) != 0) {
+            remove(tmp_path);
+        } else {
+            ESP_LOGW(TAG, "Recovered %s from an interrupted save", meta_path);
+        }
+    }
+
+    FILE* fp = fopen(meta_path, "rb");
+    if (fp == NULL) {
+        ESP_LOGI(TAG, "No metadata table found, it will be built from the JSON files");
+        return ESP_OK;
+    }
+
+    sample_meta_hdr_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1
+        || hdr.magic != SAMPLE_META_MAGIC
+        || hdr.version != SAMPLE_META_VERSION
+        || hdr.record_size != sizeof(sample_meta_t)) {
+        // the table is rebuilt from the JSON files, starting from an empty file
+        ESP_LOGW(TAG, "Metadata table not valid, it will be rebuilt from the JSON files");
+        fclose(fp);
+        remove(meta_path);
+        return ESP_OK;
+    }
+
+    if (hdr.count == 0) {
+        fclose(fp);
+        return ESP_OK;
+    }
+
+    meta_table = heap_caps_malloc(hdr.count * sizeof(sample_meta_t), MALLOC_CAP_SPIRAM);
+    if (meta_table == NULL) {
+        fclose(fp);
+        return ESP_ERR_NO_MEM;
+    }
+    meta_capacity = hdr.count;
+
+    // a truncated table keeps only its complete records
+    meta_count = fread(meta_table, sizeof(sample_meta_t), hdr.count, fp);
+    fclose(fp);
+
+    // names come from the card, make sure they are terminated
+    for (int i = 0; i < meta_count; i++) {
+        meta_table[i].name[MAX_SIZE - 1] = '\0';
+        // the length of the sample isn't known here, only the order of the pointers can be checked
+        if (!(meta_table[i].start_ptr >= 0.0f) || meta_table[i].start_ptr >= meta_table[i].end_ptr) {
+            meta_table[i].start_ptr = 0.0f;
+        }
+    }
+
+    ESP_LOGI(TAG, "Loaded metadata of %d samples", meta_count);
+    return ESP_OK;
+}
+
+static int find_meta(const char* sample_name) {
+    for (int i = 0; i < meta_count; i++) {
+        if (strcmp(meta_table[i].name, sample_name) == 0) return i;
+    }
+    return -1;
+}
+
+static void default_sample_meta(const char* sample_name, uint32_t data_size, sample_meta_t* out_meta) {
+    memset(out_meta, 0, sizeof(sample_meta_t));
+    snprintf(out_meta -> name, MAX_SIZE, "%s", sample_name);
+
+    out_meta -> downsample = 1;
+    out_meta -> bit_depth = BIT_DEPTH_MAX;
+    out_meta -> threshold = DISTORTION_THRESHOLD_MAX;
+    out_meta -> gain = DISTORTION_GAIN_MAX;
+    out_meta -> pitch_factor = 1.0f;
+    out_meta -> start_ptr = 0;
+    out_meta -> end_ptr = data_size;
+}
+
+static void apply_sample_meta(int bank_index, const sample_meta_t* meta) {
+    // assigning bitcrusher values according to the metadata
+    set_bit_crusher(bank_index, (meta -> flags & SAMPLE_META_BITCRUSHER) != 0);
+    set_bit_crusher_bit_depth(bank_index, meta -> bit_depth);
+    set_bit_crusher_downsample(bank_index, meta -> downsample);
+
+    // same for distortion
+    set_distortion(bank_index, (meta -> flags & SAMPLE_META_DISTORTION) != 0);
+    set_distortion_gain(bank_index, meta -> gain);
+    set_distortion_threshold(bank_index, meta -> threshold);
+
+    // same for the pitch
+    set_pitch_factor(bank_index, meta -> pitch_factor);
+
+    // and for the groups of the pad
+    set_choke_group(bank_index, meta -> choke_group);
+    set_mute_group(bank_index, meta -> mute_group);
+    set_launch_quantize(bank_index, (launch_quantize_t)meta -> launch_quantize);
+    set_note_repeat(bank_index, (note_repeat_t)meta -> note_repeat);
+    set_repeat_ramp(bank_index, (repeat_ramp_t)meta -> repeat_ramp);
+}
+
+static void collect_sample_meta(int bank_index, const char* sample_name, sample_meta_t* out_meta) {
+    memset(out_meta, 0, sizeof(sample_meta_t));
+    snprintf(out_meta -> name, MAX_SIZE, "%s", sample_name);
+
+    out_meta -> flags = (get_bit_crusher_state(bank_index) ? SAMPLE_META_BITCRUSHER : 0)
+                      | (get_distortion_state(bank_index) ? SAMPLE_META_DISTORTION : 0);
+    out_meta -> downsample = get_bit_crusher_downsample(bank_index);
+    out_meta -> bit_depth = get_bit_crusher_bit_depth(bank_index);
+    out_meta -> threshold = get_distortion_threshold(bank_index);
+    out_meta -> gain = get_distortion_gain(bank_index);
+    out_meta -> pitch_factor = get_pitch_factor(bank_index);
+    out_meta -> start_ptr = sample_bank[bank_index] -> start_ptr;
+    out_meta -> end_ptr = sample_bank[bank_index] -> end_ptr;
+    out_meta -> choke_group = get_choke_group(bank_index);
+    out_meta -> mute_group = get_mute_group(bank_index);
+    out_meta -> launch_quantize = get_launch_quantize(bank_index);
+    out_meta -> note_repeat = get_note_repeat(bank_index);
+    out_meta -> repeat_ramp = get_repeat_ramp(bank_index);
+}
+
+static char* get_sample_name_entry(const char* sample_name) {
+    for (int i = 0; i < sample_names_size; i++) {
+        if (strcmp(sample_names[i], sample_name) == 0) return sample_names[i];
+    }
+
+    // the sample exists only inside the kit
+    if (add_sample_name(sample_name) != ESP_OK) return NULL;
+    return sample_names[sample_names_size - 1];
+}
+
+static void save_task(void* pvParameters) {
+    save_job_t job;
+
+    for (;;) {
+        if (xQueueReceive(save_queue, &job, portMAX_DELAY) != pdTRUE) continue;
+
+        xSemaphoreTakeRecursive(sd_mutex, portMAX_DELAY);
+        esp_err_t res = save_sample(&job);
+        xSemaphoreGiveRecursive(sd_mutex);
+
+        // pinned by st_sample()
+        arena_unpin(job.audio.data_handle);
+
+        if (res != ESP_OK) {
+            ESP_LOGE(TAG, "Error while saving %s", job.sample_name);
+        }
+    }
+}
+
+static esp_err_t save_sample(const save_job_t* job) {
+    char wav_file_path[MAX_BUFF_SIZE];
+    snprintf(wav_file_path, sizeof(wav_file_path), "%s/%s/%s.wav", GRVCHP_MNTPOINT, WAV_FILES_DIR, job -> sample_name);
+
+    // the audio is rewritten only if it changed or if it's a new file
+    struct stat st;
+    if (job -> audio_dirty || stat(wav_file_path, &st) != 0) {
+        if (write_wav_atomic(&(job -> audio), wav_file_path) != ESP_OK) {
+            // marked again only if the bank still holds the same audio
+            sample_t* smp = sample_bank[job -> bank_index];
+            if (job -> audio_dirty && smp != NULL && smp -> data_handle == job -> audio.data_handle) {
+                smp -> dirty |= SAMPLE_DIRTY_AUDIO;
+            }
+            return ESP_FAIL;
+        }
+        ESP_LOGI(TAG, "Audio of %s saved", job -> sample_name);
+    }
+
+    // same for the metadata, compared with the stored record
+    sample_meta_t stored_meta;
+    if (get_sample_meta(job -> sample_name, &stored_meta) == ESP_OK && memcmp(&(job -> meta), &stored_meta, sizeof(sample_meta_t)) == 0) {
+        return ESP_OK;
+    }
+
+    esp_err_t res = write_sample_meta(&(job -> meta));
+
+    // the JSON file is kept in sync for the tools that read it
+    export_sample_meta_json(&(job -> meta));
+
+    ESP_LOGI(TAG, "Metadata of %s saved", job -> sample_name);
+    return res;
+}
+
+static esp_err_t write_wav_atomic(const sample_t* smp, const char* wav_file_path) {
+    // the caller keeps the audio pinned, the copy can't change while it's written
+    sample_t snapshot = *smp;
+
+    char tmp_path[MAX_BUFF_SIZE];
+    snprintf(tmp_path, sizeof(tmp_path), "%.*s%s", (int)(strlen(wav_file_path) - WAV_EXTENSION_SIZE), wav_file_path, TMP_EXTENSION);
+
+    FILE* wav_fp = fopen(tmp_path, "wb");
+    if (wav_fp == NULL) {
+        ESP_LOGE(TAG, "Error in creating the new wav file");
+        return ESP_FAIL;
+    }
+
+    bool ok = snapshot.raw_data != NULL && fwrite(&snapshot.header, sizeof(wav_header_t), 1, wav_fp) == 1;
+
+    // compressed samples are always stored on the card as PCM
+    if (ok && snapshot.encoding == SAMPLE_ADPCM) {
+        ok = write_adpcm_as_pcm(wav_fp, &snapshot) == ESP_OK;
+    }
+
+    size_t bytes_remaining = snapshot.encoding == SAMPLE_PCM16 ? snapshot.header.data_size : 0;
+    uint8_t* data_ptr = snapshot.raw_data;
+    size_t chunk_size = 4096; // 4KB is optimal for FATFS and internal RAM bouncing
+
+    while (ok && bytes_remaining > 0) {
+        size_t bytes_to_write = (bytes_remaining > chunk_size) ? chunk_size : bytes_remaining;
+
+        ok = fwrite(data_ptr, 1, bytes_to_write, wav_fp) == bytes_to_write;
+
+        // move the pointer forward
+        data_ptr += bytes_to_write;
+        bytes_remaining -= bytes_to_write;
+    }
+
+    fclose(wav_fp);
+
+    if (!ok) {
+        ESP_LOGE(TAG, "Error while writing the wav file data");
+        remove(tmp_path);
+        return ESP_FAIL;
+    }
+
+    return commit_tmp_file(tmp_path, wav_file_path);
+}
+
+static void recover_kit_files(void) {
+    char kit_dir[MAX_BUFF_SIZE/2];
+    snprintf(kit_dir, sizeof(kit_dir), "%s/%s", GRVCHP_MNTPOINT, KIT_FILES_DIR);
+
+    DIR* dir = opendir(kit_dir);
+    if (dir == NULL) return; // no kit saved yet
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char* ext = strrchr(entry -> d_name, '.');
+        if (ext == NULL || strcasecmp(ext, TMP_EXTENSION) != 0) continue;
+
+        // same rule as the WAV files: the temporary file is complete only if the kit was already removed
+        char tmp_path[MAX_BUFF_SIZE], kit_path[MAX_BUFF_SIZE];
+        snprintf(tmp_path, sizeof(tmp_path), "%s/%s", kit_dir, entry -> d_name);
+        snprintf(kit_path, sizeof(kit_path), "%s/%.*s.kit", kit_dir, (int)(ext - entry -> d_name), entry -> d_name);
+
+        struct stat st;
+        if (stat(kit_path, &st) == 0 || rename(tmp_path, kit_path) != 0) {
+            remove(tmp_path);
+            continue;
+        }
+        ESP_LOGW(TAG, "Recovered %s from an interrupted save", kit_path);
+    }
+    closedir(dir);
+}
+
+static bool kit_bank_valid(const kit_bank_t* bank) {
+    if (bank -> encoding != SAMPLE_PCM16 && bank -> encoding != SAMPLE_ADPCM) return false;
+    if (bank -> total_frames == 0 || bank -> header.data_size / sizeof(int16_t) != bank -> total_frames) return false;
+    if (bank -> data_offset < KIT_HDR_SIZE) return false;
+
+    // the block holds exactly the frames of the sample
+    size_t expected = bank -> encoding == SAMPLE_ADPCM ? adpcm_encoded_size(bank -> total_frames) : bank -> header.data_size;
+    return bank -> data_size == expected;
+}
+
+static void clamp_sample_ptrs(float* start_ptr, uint32_t* end_ptr, uint32_t total_frames) {
+    if (total_frames == 0) {
+        *start_ptr = 0.0f;
+        *end_ptr = 0;
+        return;
+    }
+    if (*end_ptr >= total_frames) *end_ptr = total_frames - 1;
+    // the negated test catches a NaN too
+    if (!(*start_ptr >= 0.0f) || *start_ptr >= *end_ptr) *start_ptr = 0.0f;
+}
+
+static esp_err_t commit_tmp_file(const char* tmp_path, const char* path) {
+    // FAT can't rename over an existing file. If the power goes off right after the remove,
+    // sd_fs_init() finds the complete temporary file and renames it
+    remove(path);
+    if (rename(tmp_path, path) != 0) {
+        ESP_LOGE(TAG, "Cannot replace %s", path);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+static void fill_wav_header(wav_header_t* header, uint32_t data_size) {
+    memcpy(header -> riff_section_id, "RIFF", 4);
+    header -> size = sizeof(wav_header_t) - 8 + data_size;
+    memcpy(header -> riff_format, "WAVE", 4);
+
+    memcpy(header -> format_id, "fmt ", 4);
+    header -> format_size = 16;
+    header -> fmt_id = 1;
+    header -> num_channels = 1;
+    header -> sample_rate = GRVCHP_SAMPLE_FREQ;
+    header -> block_align = 2;
+    header -> byte_rate = header -> block_align * GRVCHP_SAMPLE_FREQ;
+    header -> bits_per_sample = 16;
+
+    memcpy(header -> data_id, "data", 4);
+    header -> data_size = data_size;
+}
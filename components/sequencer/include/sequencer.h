@@ -0,0 +1,248 @@
+#ifndef SEQUENCER_H_
+#define SEQUENCER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "mixer.h"
+
+// one track per bank
+#define SEQ_TRACKS SAMPLE_NUM
+
+// pattern length, in steps (a multiple of a 16-step page)
+#define SEQ_MIN_STEPS 16
+#define SEQ_MAX_STEPS 64
+#define SEQ_PAGE_STEPS 16
+
+// the steps of a track are a bitset
+#define SEQ_STEP_WORDS (SEQ_MAX_STEPS / 32)
+
+// steps in a beat (16th notes)
+#define SEQ_STEPS_PER_BEAT 4
+
+// parameter locks of a pattern, shared by all the tracks
+#define SEQ_MAX_LOCKS 128
+
+// what a lock overrides (flags, a step can lock more than one parameter)
+#define SEQ_LOCK_PITCH  (1 << 0)
+#define SEQ_LOCK_VOLUME (1 << 1)
+#define SEQ_LOCK_START  (1 << 2)
+
+// pitch lock range, in semitones
+#define SEQ_LOCK_PITCH_RANGE 12
+
+// resolution of the recorded events: a step is split in ticks (960 per beat)
+#define SEQ_TICKS_PER_STEP 240
+#define SEQ_TICKS_PER_BEAT (SEQ_TICKS_PER_STEP * SEQ_STEPS_PER_BEAT)
+
+// recorded events of a pattern
+#define SEQ_MAX_EVENTS 256
+
+// swing range, in percent: 50 is straight, 75 is the longest delay of the off-beats
+#define SEQ_SWING_MIN 50
+#define SEQ_SWING_MAX 75
+
+// triggers of a block: every track on a step plus the recorded events around it
+#define SEQ_MAX_TRIGGERS (SEQ_TRACKS * 4)
+
+// grid the recorded presses are moved to
+typedef enum {
+    SEQ_QUANTIZE_OFF,       // kept where they were played (to the tick)
+    SEQ_QUANTIZE_16TH,      // a step
+    SEQ_QUANTIZE_8TH,       // two steps
+    SEQ_QUANTIZE_BEAT,      // a beat
+} seq_quantize_t;
+
+// the event was recorded ahead of the play position, it's not played again on the pass it was recorded in
+#define SEQ_EVENT_SKIP_ONCE (1 << 0)
+
+// parameter lock of a step: the values used when the step fires instead of those of the sample
+typedef struct {
+    uint8_t track;
+    uint8_t step;
+    uint8_t flags;              // SEQ_LOCK_*
+    int8_t semitones;           // pitch, added to the pitch of the sample
+    uint8_t volume;             // volume (0-100)
+    uint16_t start;             // start offset, in thousandths of the region between start and end pointer
+} seq_lock_t;
+
+// a recorded pad press
+typedef struct {
+    uint16_t tick;              // position in the pattern (step * SEQ_TICKS_PER_STEP + ticks)
+    uint8_t track;
+    uint8_t flags;              // SEQ_EVENT_*
+} seq_event_t;
+
+// pattern: the steps that are on, plus the locks of the few steps that have them and the recorded presses
+typedef struct {
+    uint8_t length;                                  // steps (SEQ_MIN_STEPS - SEQ_MAX_STEPS)
+    uint32_t steps[SEQ_TRACKS][SEQ_STEP_WORDS];      // bit n of a track: step n is on
+    seq_lock_t locks[SEQ_MAX_LOCKS];                 // sorted by track and step
+    uint8_t lock_count;
+    seq_event_t events[SEQ_MAX_EVENTS];              // sorted by tick
+    uint16_t event_count;
+} seq_pattern_t;
+
+// a step that fires in the block being rendered, with its locks resolved
+typedef struct {
+    uint16_t frame;             // frame of the block
+    uint8_t track;
+    uint8_t step;
+    uint8_t flags;              // SEQ_LOCK_* of the step, 0 if it has none
+    int8_t semitones;
+    uint8_t volume;
+    uint16_t start;
+} seq_trigger_t;
+
+// sequencer struct
+typedef struct {
+    volatile bool playing;
+    volatile bool restart;      // play was pressed: the pattern starts from the top on the next beat
+
+    // recording of the pad presses
+    volatile bool recording;
+    volatile seq_quantize_t quantize;
+    volatile uint8_t swing;     // percent (SEQ_SWING_MIN - SEQ_SWING_MAX)
+
+    seq_pattern_t pattern;
+
+    // position, only touched by the mixer
+    int beat_step;              // first step of the current beat, negative before the first beat
+    float beat_frame;           // frame of the current beat, from the start of the block being rendered
+    uint16_t beat_cursor;       // first tick of the beat not fired yet, SEQ_TICKS_PER_BEAT when waiting for a beat
+    uint16_t next_event;        // first recorded event not fired yet
+    float tick_frames;          // length of a tick, in frames
+    int block_beat_offset;      // frame of the block being rendered on which a beat of the clock falls, -1 if none
+    volatile int current_step;  // last step fired, -1 if stopped
+} sequencer_t;
+
+/*
+@brief function that subscribes the sequencer to the master clock. Must be called before the mixer starts.
+*/
+void sequencer_init(void);
+
+/*
+@brief function that starts or stops the pattern. It starts from the first step, on the next beat of the master clock.
+@param playing new state.
+*/
+void sequencer_set_playing(bool playing);
+
+/*
+@brief getter function for the play state.
+*/
+bool sequencer_get_playing(void);
+
+/*
+@brief function that sets the length of the pattern, rounded down to a page. The steps past the end are kept.
+@param length new length, in steps.
+*/
+void sequencer_set_length(uint8_t length);
+
+/*
+@brief getter function for the length of the pattern.
+*/
+uint8_t sequencer_get_length(void);
+
+/*
+@brief function that turns a step on or off.
+@param track the track (same as the bank index).
+@param step the step.
+@param on new state.
+*/
+esp_err_t sequencer_set_step(uint8_t track, uint8_t step, bool on);
+
+/*
+@brief getter function for a step.
+*/
+bool sequencer_get_step(uint8_t track, uint8_t step);
+
+/*
+@brief function that sets a lock of a step. The other parameters of the step keep their locks.
+@param track the track.
+@param step the step.
+@param flag the parameter (one of SEQ_LOCK_*).
+@param value semitones (-SEQ_LOCK_PITCH_RANGE - SEQ_LOCK_PITCH_RANGE), volume (0-100) or start offset (0-1000).
+*/
+esp_err_t sequencer_set_lock(uint8_t track, uint8_t step, uint8_t flag, int value);
+
+/*
+@brief function that removes a lock of a step.
+@param track the track.
+@param step the step.
+@param flag the parameter (one of SEQ_LOCK_*).
+*/
+esp_err_t sequencer_clear_lock(uint8_t track, uint8_t step, uint8_t flag);
+
+/*
+@brief getter function for the locks of a step.
+@param out the locks, flags is 0 if the step has none.
+@return true if the step has at least a lock.
+*/
+bool sequencer_get_lock(uint8_t track, uint8_t step, seq_lock_t *out);
+
+/*
+@brief function that arms or disarms the recording: while the pattern plays, the pad presses are added to it.
+@param recording new state.
+*/
+void sequencer_set_recording(bool recording);
+
+/*
+@brief getter function for the recording state.
+*/
+bool sequencer_get_recording(void);
+
+/*
+@brief function that sets the grid the recorded presses are moved to.
+@param quantize the grid.
+*/
+void sequencer_set_quantize(seq_quantize_t quantize);
+
+/*
+@brief getter function for the grid of the recorded presses.
+*/
+seq_quantize_t sequencer_get_quantize(void);
+
+/*
+@brief function that sets the swing of the grid: every second position is delayed. Only used with a grid.
+@param swing percent (SEQ_SWING_MIN - SEQ_SWING_MAX).
+*/
+void sequencer_set_swing(uint8_t swing);
+
+/*
+@brief getter function for the swing.
+*/
+uint8_t sequencer_get_swing(void);
+
+/*
+@brief function that removes the recorded presses from the pattern. The steps and the locks are kept.
+*/
+void sequencer_clear_events(void);
+
+/*
+@brief getter function for the number of recorded presses.
+*/
+uint16_t sequencer_get_event_count(void);
+
+/*
+@brief function called by the mixer, after sequencer_render_block(), on the frame a pad is pressed: the press is recorded if the recording is armed.
+@param track the track (same as the bank index).
+@param frame frame of the block being rendered.
+*/
+void sequencer_record_press(uint8_t track, uint16_t frame);
+
+/*
+@brief getter function for the last step that fired, -1 if the pattern is stopped or waiting for its first beat.
+*/
+int sequencer_get_position(void);
+
+/*
+@brief function called by the mixer at the start of every block: it returns the steps and the recorded presses
+that fire in the block. They're placed from the beats of the master clock, so the pattern never drifts from the click.
+Must be called after the clock was advanced for the block.
+@param out the triggers, ordered by frame.
+@param max size of out.
+*/
+size_t sequencer_render_block(seq_trigger_t *out, size_t max);
+
+#endif
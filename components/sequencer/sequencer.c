@@ -0,0 +1,447 @@
+#include "sequencer.h"
+#include <string.h>
+#include <math.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "master_clock.h"
+
+static const char* TAG_SEQ = "SEQUENCER";
+
+static sequencer_t seq = {
+    .quantize = SEQ_QUANTIZE_16TH,
+    .swing = SEQ_SWING_MIN,
+    .pattern = { .length = SEQ_MIN_STEPS },
+    .beat_step = -SEQ_STEPS_PER_BEAT,
+    .beat_cursor = SEQ_TICKS_PER_BEAT,
+    .block_beat_offset = -1,
+    .current_step = -1,
+};
+
+// the locks and the recorded events are edited by the menus while the mixer reads them
+static portMUX_TYPE seq_lock_mux = portMUX_INITIALIZER_UNLOCKED;
+
+/*
+@brief position of the locks of a step in the list (or where they would go), the list is sorted by track and step.
+Must be called inside the critical section.
+*/
+static int sequencer_find_lock(uint8_t track, uint8_t step, bool *found);
+
+/*
+@brief fires the steps and the recorded events of the current beat that fall before a frame of the block.
+@param out the triggers.
+@param count triggers already in out.
+@param max size of out.
+@param limit first frame that is not fired.
+@return the triggers in out.
+*/
+static size_t sequencer_fire(seq_trigger_t *out, size_t count, size_t max, float limit);
+
+/*
+@brief takes the beat of the block (if any) and the tick length from the master clock.
+*/
+static void sequencer_on_clock(const clock_block_t *block, void *arg);
+
+/*
+@brief first recorded event at or after a tick of the pattern. Must be called inside the critical section.
+*/
+static uint16_t sequencer_find_event(uint16_t tick);
+
+void sequencer_init(void) {
+    ESP_ERROR_CHECK(clock_subscribe(sequencer_on_clock, NULL));
+}
+
+static void sequencer_on_clock(const clock_block_t *block, void *arg) {
+    // a tick of the sequencer is a fraction of a tick of the clock
+    seq.tick_frames = (float)block->frames_per_tick_q16 / (1 << CLOCK_FRAC_BITS) * CLOCK_PPQN / SEQ_TICKS_PER_BEAT;
+
+    seq.block_beat_offset = -1;
+    for (uint8_t i = 0; i < block->tick_count; i++) {
+        if ((block->first_tick + i) % CLOCK_PPQN == 0) {
+            seq.block_beat_offset = block->tick_frame[i];
+            break;
+        }
+    }
+}
+
+void sequencer_set_playing(bool playing) {
+    if (playing) {
+        __atomic_store_n(&seq.restart, true, __ATOMIC_RELEASE);
+    } else {
+        seq.current_step = -1;
+    }
+    seq.playing = playing;
+
+    // logging action
+    ESP_LOGI(TAG_SEQ, "Pattern %s", playing ? "started, waiting for the next beat" : "stopped");
+}
+
+bool sequencer_get_playing(void) {
+    return seq.playing;
+}
+
+void sequencer_set_length(uint8_t length) {
+    if (length < SEQ_MIN_STEPS) length = SEQ_MIN_STEPS;
+    if (length > SEQ_MAX_STEPS) length = SEQ_MAX_STEPS;
+    seq.pattern.length = length - length % SEQ_PAGE_STEPS;
+
+    // logging action
+    ESP_LOGI(TAG_SEQ, "Pattern length set to %u steps", seq.pattern.length);
+}
+
+uint8_t sequencer_get_length(void) {
+    return seq.pattern.length;
+}
+
+esp_err_t sequencer_set_step(uint8_t track, uint8_t step, bool on) {
+    if (track >= SEQ_TRACKS || step >= SEQ_MAX_STEPS) return ESP_ERR_INVALID_ARG;
+
+    uint32_t *word = &seq.pattern.steps[track][step / 32];
+    uint32_t bit = 1u << (step % 32);
+    if (on) {
+        __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+    }
+    return ESP_OK;
+}
+
+bool sequencer_get_step(uint8_t track, uint8_t step) {
+    if (track >= SEQ_TRACKS || step >= SEQ_MAX_STEPS) return false;
+    return (__atomic_load_n(&seq.pattern.steps[track][step / 32], __ATOMIC_RELAXED) & (1u << (step % 32))) != 0;
+}
+
+static int sequencer_find_lock(uint8_t track, uint8_t step, bool *found) {
+    uint16_t key = track * SEQ_MAX_STEPS + step;
+    int i = 0;
+    while (i < seq.pattern.lock_count && seq.pattern.locks[i].track * SEQ_MAX_STEPS + seq.pattern.locks[i].step < key) {
+        i++;
+    }
+    *found = i < seq.pattern.lock_count && seq.pattern.locks[i].track == track && seq.pattern.locks[i].step == step;
+    return i;
+}
+
+esp_err_t sequencer_set_lock(uint8_t track, uint8_t step, uint8_t flag, int value) {
+    if (track >= SEQ_TRACKS || step >= SEQ_MAX_STEPS) return ESP_ERR_INVALID_ARG;
+
+    switch (flag) {
+        case SEQ_LOCK_PITCH:
+            if (value < -SEQ_LOCK_PITCH_RANGE || value > SEQ_LOCK_PITCH_RANGE) return ESP_ERR_INVALID_ARG;
+            break;
+        case SEQ_LOCK_VOLUME:
+            if (value < 0 || value > 100) return ESP_ERR_INVALID_ARG;
+            break;
+        case SEQ_LOCK_START:
+            if (value < 0 || value > 1000) return ESP_ERR_INVALID_ARG;
+            break;
+        default:
+            return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t ret = ESP_OK;
+    portENTER_CRITICAL(&seq_lock_mux);
+
+    bool found;
+    int i = sequencer_find_lock(track, step, &found);
+    if (!found) {
+        if (seq.pattern.lock_count >= SEQ_MAX_LOCKS) {
+            ret = ESP_ERR_NO_MEM;
+        } else {
+            // make room, the list stays sorted
+            memmove(&seq.pattern.locks[i + 1], &seq.pattern.locks[i], (seq.pattern.lock_count - i) * sizeof(seq_lock_t));
+            seq.pattern.locks[i] = (seq_lock_t){ .track = track, .step = step };
+            seq.pattern.lock_count++;
+        }
+    }
+
+    if (ret == ESP_OK) {
+        seq_lock_t *lock = &seq.pattern.locks[i];
+        lock->flags |= flag;
+        if (flag == SEQ_LOCK_PITCH) lock->semitones = value;
+        if (flag == SEQ_LOCK_VOLUME) lock->volume = value;
+        if (flag == SEQ_LOCK_START) lock->start = value;
+    }
+
+    portEXIT_CRITICAL(&seq_lock_mux);
+
+    // logging action
+    if (ret == ESP_ERR_NO_MEM) {
+        ESP_LOGE(TAG_SEQ, "No room for another lock (%d in use)", SEQ_MAX_LOCKS);
+    }
+    return ret;
+}
+
+esp_err_t sequencer_clear_lock(uint8_t track, uint8_t step, uint8_t flag) {
+    if (track >= SEQ_TRACKS || step >= SEQ_MAX_STEPS) return ESP_ERR_INVALID_ARG;
+
+    portENTER_CRITICAL(&seq_lock_mux);
+
+    bool found;
+    int i = sequencer_find_lock(track, step, &found);
+    if (found) {
+        seq.pattern.locks[i].flags &= ~flag;
+
+        // a step without locks leaves the list
+        if (seq.pattern.locks[i].flags == 0) {
+            memmove(&seq.pattern.locks[i], &seq.pattern.locks[i + 1], (seq.pattern.lock_count - i - 1) * sizeof(seq_lock_t));
+            seq.pattern.lock_count--;
+        }
+    }
+
+    portEXIT_CRITICAL(&seq_lock_mux);
+    return ESP_OK;
+}
+
+bool sequencer_get_lock(uint8_t track, uint8_t step, seq_lock_t *out) {
+    memset(out, 0, sizeof(*out));
+    if (track >= SEQ_TRACKS || step >= SEQ_MAX_STEPS) return false;
+
+    portENTER_CRITICAL(&seq_lock_mux);
+    bool found;
+    int i = sequencer_find_lock(track, step, &found);
+    if (found) {
+        *out = seq.pattern.locks[i];
+    }
+    portEXIT_CRITICAL(&seq_lock_mux);
+
+    return found;
+}
+
+void sequencer_set_recording(bool recording) {
+    seq.recording = recording;
+
+    // logging action
+    ESP_LOGI(TAG_SEQ, "Pattern recording %s", recording ? "armed" : "disarmed");
+}
+
+bool sequencer_get_recording(void) {
+    return seq.recording;
+}
+
+void sequencer_set_quantize(seq_quantize_t quantize) {
+    if (quantize > SEQ_QUANTIZE_BEAT) return;
+    seq.quantize = quantize;
+}
+
+seq_quantize_t sequencer_get_quantize(void) {
+    return seq.quantize;
+}
+
+void sequencer_set_swing(uint8_t swing) {
+    if (swing < SEQ_SWING_MIN) swing = SEQ_SWING_MIN;
+    if (swing > SEQ_SWING_MAX) swing = SEQ_SWING_MAX;
+    seq.swing = swing;
+}
+
+uint8_t sequencer_get_swing(void) {
+    return seq.swing;
+}
+
+void sequencer_clear_events(void) {
+    portENTER_CRITICAL(&seq_lock_mux);
+    seq.pattern.event_count = 0;
+    seq.next_event = 0;
+    portEXIT_CRITICAL(&seq_lock_mux);
+
+    // logging action
+    ESP_LOGI(TAG_SEQ, "Recorded presses cleared");
+}
+
+uint16_t sequencer_get_event_count(void) {
+    return seq.pattern.event_count;
+}
+
+static uint16_t sequencer_find_event(uint16_t tick) {
+    uint16_t i = 0;
+    while (i < seq.pattern.event_count && seq.pattern.events[i].tick < tick) {
+        i++;
+    }
+    return i;
+}
+
+void sequencer_record_press(uint8_t track, uint16_t frame) {
+    // only while the pattern runs: before its first beat there's no position to record at
+    if (!seq.recording || !seq.playing || seq.beat_step < 0 || track >= SEQ_TRACKS) return;
+
+    int length_ticks = seq.pattern.length * SEQ_TICKS_PER_STEP;
+
+    // the block was already rendered, so beat_frame is counted from the start of the next one
+    float beat_frame = seq.beat_frame + BUFF_SIZE;
+    float position = seq.beat_step * SEQ_TICKS_PER_STEP + (frame - beat_frame) / seq.tick_frames;
+
+    // to the nearest point of the grid, every second point delayed by the swing
+    int tick;
+    switch (seq.quantize) {
+        case SEQ_QUANTIZE_16TH:
+        case SEQ_QUANTIZE_8TH:
+        case SEQ_QUANTIZE_BEAT: {
+            int grid = SEQ_TICKS_PER_STEP << (seq.quantize - SEQ_QUANTIZE_16TH);
+            int point = (int)roundf(position / grid);
+            tick = point * grid;
+            if (point % 2 != 0) {
+                tick += (seq.swing - SEQ_SWING_MIN) * 2 * grid / 100;
+            }
+            break;
+        }
+        default:
+            tick = (int)roundf(position);
+            break;
+    }
+
+    // where the pass stands: the ticks before the cursor already fired
+    int cursor_tick = seq.beat_step * SEQ_TICKS_PER_STEP + seq.beat_cursor;
+
+    // moved to the cursor or past it: the pad was just played by hand, so the pass it was recorded in doesn't play it again.
+    // Moved behind it (even from a late press), it's already fired and plays from the next pass
+    bool behind = tick >= 0 && tick < cursor_tick;
+    bool skip = tick >= cursor_tick;
+
+    tick %= length_ticks;
+    if (tick < 0) tick += length_ticks;
+
+    bool full = false;
+    portENTER_CRITICAL(&seq_lock_mux);
+
+    uint16_t i = sequencer_find_event(tick);
+
+    // the same press on the same point, from a previous pass
+    bool duplicate = false;
+    for (uint16_t j = i; j < seq.pattern.event_count && seq.pattern.events[j].tick == tick; j++) {
+        if (seq.pattern.events[j].track == track) duplicate = true;
+    }
+
+    if (!duplicate) {
+        if (seq.pattern.event_count >= SEQ_MAX_EVENTS) {
+            full = true;
+        } else {
+            memmove(&seq.pattern.events[i + 1], &seq.pattern.events[i], (seq.pattern.event_count - i) * sizeof(seq_event_t));
+            seq.pattern.events[i] = (seq_event_t){ .tick = tick, .track = track };
+            seq.pattern.event_count++;
+
+            // the events not fired yet moved by one, an event behind the cursor goes with the fired ones
+            if (i < seq.next_event || (behind && i == seq.next_event)) {
+                seq.next_event++;
+            }
+
+            if (skip) {
+                seq.pattern.events[i].flags = SEQ_EVENT_SKIP_ONCE;
+            }
+        }
+    }
+
+    portEXIT_CRITICAL(&seq_lock_mux);
+
+    // logging action
+    if (full) {
+        ESP_LOGW(TAG_SEQ, "Pattern full, press not recorded (%d events)", SEQ_MAX_EVENTS);
+    }
+}
+
+int sequencer_get_position(void) {
+    return seq.current_step;
+}
+
+static size_t sequencer_fire(seq_trigger_t *out, size_t count, size_t max, float limit) {
+    portENTER_CRITICAL(&seq_lock_mux);
+
+    while (seq.beat_cursor < SEQ_TICKS_PER_BEAT) {
+        uint16_t beat_tick = seq.beat_step * SEQ_TICKS_PER_STEP;
+
+        // the next step of the beat, or the next recorded event if it comes first
+        uint16_t next = (seq.beat_cursor + SEQ_TICKS_PER_STEP - 1) / SEQ_TICKS_PER_STEP * SEQ_TICKS_PER_STEP;
+        bool event_due = seq.next_event < seq.pattern.event_count
+                         && seq.pattern.events[seq.next_event].tick < beat_tick + next;
+        if (event_due) {
+            // an event behind the cursor is passed over: firing it would play the steps of its tick twice
+            if (seq.pattern.events[seq.next_event].tick < beat_tick + seq.beat_cursor) {
+                seq.pattern.events[seq.next_event++].flags &= ~SEQ_EVENT_SKIP_ONCE;
+                continue;
+            }
+            next = seq.pattern.events[seq.next_event].tick - beat_tick;
+        }
+
+        // the beat is over, the rest waits for the next beat of the clock
+        if (next >= SEQ_TICKS_PER_BEAT) {
+            seq.beat_cursor = SEQ_TICKS_PER_BEAT;
+            break;
+        }
+
+        float frame = seq.beat_frame + next * seq.tick_frames;
+        if (frame >= limit) break;
+        uint16_t out_frame = frame > 0.0f ? (uint16_t)frame : 0;
+
+        // the steps that are on, with their locks
+        uint8_t step = seq.beat_step + next / SEQ_TICKS_PER_STEP;
+        if (next % SEQ_TICKS_PER_STEP == 0 && step < seq.pattern.length) {
+            for (uint8_t track = 0; track < SEQ_TRACKS && count < max; track++) {
+                if ((seq.pattern.steps[track][step / 32] & (1u << (step % 32))) == 0) continue;
+
+                seq_trigger_t *trigger = &out[count++];
+                *trigger = (seq_trigger_t){ .frame = out_frame, .track = track, .step = step };
+
+                bool found;
+                int i = sequencer_find_lock(track, step, &found);
+                if (found) {
+                    seq_lock_t *lock = &seq.pattern.locks[i];
+                    trigger->flags = lock->flags;
+                    trigger->semitones = lock->semitones;
+                    trigger->volume = lock->volume;
+                    trigger->start = lock->start;
+                }
+            }
+            seq.current_step = step;
+        }
+
+        // the recorded presses on this tick
+        while (seq.next_event < seq.pattern.event_count && seq.pattern.events[seq.next_event].tick == beat_tick + next) {
+            seq_event_t *event = &seq.pattern.events[seq.next_event++];
+            if ((event->flags & SEQ_EVENT_SKIP_ONCE) != 0) {
+                event->flags &= ~SEQ_EVENT_SKIP_ONCE;
+                continue;
+            }
+            if (count < max) {
+                out[count++] = (seq_trigger_t){ .frame = out_frame, .track = event->track, .step = step };
+            }
+        }
+
+        seq.beat_cursor = next + 1;
+    }
+
+    portEXIT_CRITICAL(&seq_lock_mux);
+    return count;
+}
+
+size_t sequencer_render_block(seq_trigger_t *out, size_t max) {
+    if (!seq.playing) return 0;
+
+    // play was pressed: nothing fires until the next beat
+    if (__atomic_exchange_n(&seq.restart, false, __ATOMIC_ACQ_REL)) {
+        seq.beat_step = -SEQ_STEPS_PER_BEAT;
+        seq.beat_cursor = SEQ_TICKS_PER_BEAT;
+        seq.current_step = -1;
+    }
+
+    int beat_offset = seq.block_beat_offset;
+
+    // what is left of the previous beat, up to the new one
+    size_t count = sequencer_fire(out, 0, max, beat_offset >= 0 ? beat_offset : BUFF_SIZE);
+
+    if (beat_offset >= 0) {
+        // what the new beat overtook (the tempo went up) is skipped, a beat always starts on its own step
+        int next_step = seq.beat_step + SEQ_STEPS_PER_BEAT;
+        seq.beat_step = next_step >= 0 && next_step < seq.pattern.length ? next_step : 0;
+        seq.beat_frame = beat_offset;
+        seq.beat_cursor = 0;
+
+        portENTER_CRITICAL(&seq_lock_mux);
+        seq.next_event = sequencer_find_event(seq.beat_step * SEQ_TICKS_PER_STEP);
+        portEXIT_CRITICAL(&seq_lock_mux);
+
+        count = sequencer_fire(out, count, max, BUFF_SIZE);
+    }
+
+    // the beat is placed from the start of the next block
+    if (seq.beat_step >= 0) {
+        seq.beat_frame -= BUFF_SIZE;
+    }
+    return count;
+}
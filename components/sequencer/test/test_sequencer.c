@@ -0,0 +1,58 @@
+#include "unity.h"
+#include "sequencer.h"
+#include "master_clock.h"
+
+// a step and a pass of a 16-step pattern at the default tempo, in frames (the clock may round them by a frame or two)
+#define TEST_STEP_FRAMES 2000
+#define TEST_PASS_FRAMES (SEQ_MIN_STEPS * TEST_STEP_FRAMES)
+
+TEST_CASE("a late press on a fired step doesn't fire it again on the same pass", "[sequencer]")
+{
+    sequencer_init();
+    sequencer_set_length(SEQ_MIN_STEPS);
+    sequencer_set_quantize(SEQ_QUANTIZE_16TH);
+    sequencer_set_swing(SEQ_SWING_MIN);
+    sequencer_set_step(0, 1, true);
+    sequencer_set_recording(true);
+    sequencer_set_playing(true);
+
+    seq_trigger_t triggers[SEQ_MAX_TRIGGERS];
+    int first_pass = 0, second_pass = 0;
+    bool pressed = false;
+
+    for (uint32_t start = 0; start < 2 * TEST_PASS_FRAMES; start += BUFF_SIZE) {
+        clock_advance(BUFF_SIZE);
+        size_t count = sequencer_render_block(triggers, SEQ_MAX_TRIGGERS);
+
+        for (size_t i = 0; i < count; i++) {
+            if (triggers[i].track != 0) continue;
+            uint32_t frame = start + triggers[i].frame;
+
+            if (frame < TEST_PASS_FRAMES) {
+                first_pass++;
+                TEST_ASSERT_UINT32_WITHIN(4, TEST_STEP_FRAMES, frame);
+            } else {
+                second_pass++;
+                TEST_ASSERT_UINT32_WITHIN(4, TEST_PASS_FRAMES + TEST_STEP_FRAMES, frame);
+            }
+
+            // pressed a few ticks after the step fired, in the same block: it's quantized back onto it
+            if (!pressed && triggers[i].frame + 40 < BUFF_SIZE) {
+                sequencer_record_press(0, triggers[i].frame + 40);
+                pressed = true;
+            }
+        }
+    }
+
+    TEST_ASSERT_TRUE(pressed);
+    TEST_ASSERT_EQUAL_UINT16(1, sequencer_get_event_count());
+
+    // only the step on the pass of the press, the step and the press on the next one
+    TEST_ASSERT_EQUAL_INT(1, first_pass);
+    TEST_ASSERT_EQUAL_INT(2, second_pass);
+
+    sequencer_set_playing(false);
+    sequencer_set_recording(false);
+    sequencer_clear_events();
+    sequencer_set_step(0, 1, false);
+}
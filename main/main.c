@@ -15,6 +15,8 @@
 #include "fsm.h"
 #include "lcd.h"
 #include "sd_reader.h"
+#include "adpcm.h"
+#include "sample_arena.h"
 #include "nvs.h"
 #include "nvs_flash.h"
 
@@ -22,6 +24,7 @@
 void app_main(void)
 {
     nvs_flash_init();
+    sample_arena_init();
     sd_reader_init();
     lcd_driver_init();
     adc1_init();
@@ -32,6 +35,10 @@ void app_main(void)
     potentiometer_init();
     joystick_init();
 
+#if ADPCM_RUN_BENCHMARK
+    adpcm_benchmark();
+#endif
+
     i2s_chan_handle_t master = i2s_driver_init();
     create_mixer(master);
 